@@ -0,0 +1,121 @@
+#pragma once
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <type_traits>
+
+#include "task.h"
+#include "combinators.h"
+
+namespace cpptask
+{
+	// the tasks of one run_async_batch, in submission order. their state shares one slab, which is freed
+	// once every task of the batch is released.
+	template<typename T>
+	class task_batch {
+	private:
+		std::vector<task<T>> tasks;
+
+	public:
+		task_batch() = default;
+
+		explicit task_batch(std::vector<task<T>>&& tasksIn) : tasks(std::move(tasksIn)) {}
+
+		size_t size() const { return tasks.size(); }
+
+		bool empty() const { return tasks.empty(); }
+
+		task<T>& operator[](size_t index) { return tasks[index]; }
+
+		const task<T>& operator[](size_t index) const { return tasks[index]; }
+
+		auto begin() { return tasks.begin(); }
+		auto end() { return tasks.end(); }
+		auto begin() const { return tasks.begin(); }
+		auto end() const { return tasks.end(); }
+
+		void wait() {
+			for (auto& t : tasks) {
+				t.wait();
+			}
+		}
+
+		// completes with every result in order once all did, like when_all.
+		auto when_all() const { return cpptask::when_all(tasks); }
+
+		// the results in order; throws like when_all(...).get() if any task faulted or was canceled.
+		auto get() const { return when_all().get(); }
+
+		auto operator co_await() const { return when_all().get_awaiter(); }
+	};
+
+	// allocates the state of count tasks in one slab and posts them to ex in one batch, waking only as many
+	// workers as there are tasks. make(i) returns the callable of the i-th task.
+	template<typename F>
+	static auto make_task_batch(executor& ex, size_t count, F&& make)
+	{
+		using C = std::decay_t<decltype(make(size_t(0)))>;
+		using R = std::invoke_result_t<C&>;
+
+		std::vector<task<R>> tasks;
+		tasks.reserve(count);
+		std::vector<work_item*> items;
+		items.reserve(count);
+
+		task_slab* slab = task_slab::create(count);
+		try {
+			for (size_t i = 0; i < count; ++i) {
+				auto block = std::allocate_shared<dispatch_block<R>>(slab_allocator<dispatch_block<R>>(slab), task_function<R>(make(i)), ex, cancellation_token{}, false);
+				block->try_mark_queued();
+				items.push_back(block.get());
+				tasks.emplace_back(std::move(block));
+			}
+		}
+		catch (...) {
+			// the blocks built so far never get posted and go back into the slab.
+			for (auto* item : items) {
+				item->abandon();
+			}
+			slab->release();
+			throw;
+		}
+		slab->release();
+
+		ex.post_batch(items.data(), items.size());
+		return task_batch<R>(std::move(tasks));
+	}
+
+	// runs every callable of the range as one batch; callables are moved out of a range passed as rvalue.
+	template<typename Range, typename = std::enable_if_t<!std::is_convertible_v<Range, size_t>>>
+	static auto run_async_batch(executor& ex, Range&& callables)
+	{
+		auto first = std::begin(callables);
+		return make_task_batch(ex, static_cast<size_t>(std::distance(first, std::end(callables))), [&first](size_t) {
+			if constexpr (std::is_rvalue_reference_v<Range&&>) {
+				return std::move(*first++);
+			}
+			else {
+				return *first++;
+			}
+		});
+	}
+
+	template<typename Range, typename = std::enable_if_t<!is_executor_v<Range> && !std::is_convertible_v<Range, size_t>>>
+	static auto run_async_batch(Range&& callables)
+	{
+		return run_async_batch(default_executor(), std::forward<Range>(callables));
+	}
+
+	// count tasks calling f(i) for i in [0, count).
+	template<typename F>
+	static auto run_async_batch(executor& ex, size_t count, const F& f)
+	{
+		return make_task_batch(ex, count, [&f](size_t i) { return [f, i]() { return f(i); }; });
+	}
+
+	template<typename F>
+	static auto run_async_batch(size_t count, const F& f)
+	{
+		return run_async_batch(default_executor(), count, f);
+	}
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <utility>
+
+#include "task.h"
+
+namespace cpptask
+{
+	// what a bounded_executor does with work posted while its queue is full.
+	enum class overflow_policy
+	{
+		// the posting thread waits for room; a thread of an executor keeps running queued work meanwhile.
+		block,
+		// the new item is dropped.
+		reject,
+		// the oldest queued item is dropped to make room.
+		drop_oldest,
+		// the posting thread runs the new item itself, slowing producers down to the pace of the workers.
+		caller_runs,
+	};
+
+	enum class admission
+	{
+		queued,
+		rejected,
+		ran_inline,
+	};
+
+	// bounds the work waiting for another executor : at most capacity items queue here and at most max_running
+	// of them run on the inner executor at once, so a burst of submissions can't grow memory without limit.
+	// a dropped task completes as canceled, see work_item::abandon.
+	class bounded_executor : public executor {
+	private:
+		// a drainer gives its thread back to the inner executor after this many items so other work gets a turn.
+		static constexpr size_t drain_batch = 64;
+
+		executor& inner;
+		size_t capacity_limit;
+		// blocked producers are woken once the queue drained to here, not on every pop, so they don't ping-pong.
+		size_t low_water;
+		size_t max_running;
+		overflow_policy policy;
+
+		std::mutex mtx;
+		std::condition_variable space;
+		std::condition_variable idle;
+		std::deque<work_item*> items;
+		size_t draining;
+		size_t blocked;
+		bool stopping;
+		std::atomic<size_t> depth;
+		std::atomic<uint64_t> rejected_count;
+		std::atomic<uint64_t> dropped_count;
+		std::atomic<uint64_t> inline_count;
+
+		work_item* take_front() {
+			work_item* item = items.front();
+			items.pop_front();
+			depth.store(items.size(), std::memory_order_relaxed);
+			if (blocked != 0 && items.size() == low_water) {
+				space.notify_all();
+			}
+			return item;
+		}
+
+		void drain() {
+			current_scope scope(this);
+			for (size_t n = 0; n < drain_batch; ++n) {
+				work_item* item = nullptr;
+				{
+					std::lock_guard<std::mutex> lk(mtx);
+					if (items.empty()) {
+						if (--draining == 0) {
+							idle.notify_all();
+						}
+						return;
+					}
+					item = take_front();
+				}
+				item->execute();
+			}
+			inner.post([this]() { drain(); });
+		}
+
+		void wait_for_space(std::unique_lock<std::mutex>& lk) {
+			if (executor::current_executor() != nullptr) {
+				lk.unlock();
+				executor::help_while([this]() { return depth.load(std::memory_order_relaxed) >= capacity_limit; });
+				lk.lock();
+				return;
+			}
+
+			++blocked;
+			space.wait(lk, [this]() { return stopping || items.size() <= low_water; });
+			--blocked;
+		}
+
+		admission admit(work_item* item) {
+			std::unique_lock<std::mutex> lk(mtx);
+			work_item* dropped = nullptr;
+			while (!stopping && items.size() >= capacity_limit) {
+				if (policy == overflow_policy::block) {
+					wait_for_space(lk);
+				}
+				else if (policy == overflow_policy::drop_oldest) {
+					dropped = take_front();
+				}
+				else if (policy == overflow_policy::caller_runs) {
+					lk.unlock();
+					inline_count.fetch_add(1, std::memory_order_relaxed);
+					item->execute();
+					return admission::ran_inline;
+				}
+				else {
+					break;
+				}
+			}
+
+			if (stopping || items.size() >= capacity_limit) {
+				lk.unlock();
+				rejected_count.fetch_add(1, std::memory_order_relaxed);
+				item->abandon();
+				return admission::rejected;
+			}
+
+			items.push_back(item);
+			depth.store(items.size(), std::memory_order_relaxed);
+			const bool start = draining < max_running;
+			if (start) {
+				++draining;
+			}
+			lk.unlock();
+
+			if (dropped != nullptr) {
+				dropped_count.fetch_add(1, std::memory_order_relaxed);
+				dropped->abandon();
+			}
+			if (start) {
+				inner.post([this]() { drain(); });
+			}
+			return admission::queued;
+		}
+
+	public:
+		// a max_running of 0 runs as many items at once as the inner executor has threads.
+		bounded_executor(executor& innerIn, size_t capacityIn, overflow_policy policyIn = overflow_policy::block, size_t max_runningIn = 0)
+			:
+			inner(innerIn),
+			capacity_limit(capacityIn != 0 ? capacityIn : 1),
+			low_water(capacity_limit - (capacity_limit + 3) / 4),
+			max_running(max_runningIn != 0 ? max_runningIn : innerIn.concurrency()),
+			policy(policyIn),
+			draining(0),
+			blocked(0),
+			stopping(false),
+			depth(0),
+			rejected_count(0),
+			dropped_count(0),
+			inline_count(0)
+		{
+		}
+
+		explicit bounded_executor(size_t capacityIn, overflow_policy policyIn = overflow_policy::block) : bounded_executor(default_executor(), capacityIn, policyIn) {}
+
+		// drops what is still queued, then waits for the running items.
+		~bounded_executor() {
+			std::deque<work_item*> remaining;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				stopping = true;
+				remaining.swap(items);
+				depth.store(0, std::memory_order_relaxed);
+			}
+			space.notify_all();
+
+			for (work_item* item : remaining) {
+				item->abandon();
+			}
+
+			std::unique_lock<std::mutex> lk(mtx);
+			idle.wait(lk, [this]() { return draining == 0; });
+		}
+
+		bounded_executor(const bounded_executor&) = delete;
+		bounded_executor& operator=(const bounded_executor&) = delete;
+
+		using executor::post;
+
+		void post(work_item* item) override { try_post(item); }
+
+		admission try_post(work_item* item) { return admit(item); }
+
+		// like run_async on this executor, also telling whether the task was queued, rejected or run inline.
+		// a rejected task is already canceled.
+		template<typename F, typename ...Args>
+		auto submit(F&& f, Args&&... args) {
+			using R = bound_result_t<F, Args...>;
+			// queued by hand like make_task_batch does, so the admission comes straight from admit.
+			auto block = make_dispatch_block<R>(task_function<R>(make_bound_call(std::forward<F>(f), std::forward<Args>(args)...)), *this, cancellation_token{}, false);
+			block->try_mark_queued();
+			task<R> submitted(block);
+			return std::make_pair(admit(block.get()), submitted);
+		}
+
+		bool run_one() override {
+			work_item* item = nullptr;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (!items.empty()) {
+					item = take_front();
+				}
+			}
+
+			if (item == nullptr) {
+				return inner.run_one();
+			}
+
+			current_scope scope(this);
+			item->execute();
+			return true;
+		}
+
+		size_t concurrency() const override { return max_running; }
+
+		size_t capacity() const { return capacity_limit; }
+
+		// items waiting right now, for autoscaling and load shedding decisions.
+		size_t queue_depth() const { return depth.load(std::memory_order_relaxed); }
+
+		uint64_t rejected() const { return rejected_count.load(std::memory_order_relaxed); }
+
+		uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+
+		uint64_t ran_inline() const { return inline_count.load(std::memory_order_relaxed); }
+	};
+}
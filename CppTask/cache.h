@@ -0,0 +1,362 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <type_traits>
+#include <cstdint>
+
+#include "task.h"
+#include "combinators.h"
+
+namespace cpptask
+{
+	// memoizes tasks by key. concurrent callers for a key share one task, started by the first of them (single flight).
+	// keys are spread over shards, each under its own lock and bounded to its part of capacity, least recently used
+	// dropped first. with a ttl, a completed entry is dropped ttl after it completed. an entry that faults or is
+	// canceled is dropped once it completes, so the next caller starts over; callers that already share it still see
+	// the failure.
+	// the factory is called with the key, and with a cancellation_token if it takes one, that is canceled when the
+	// entry is erased or cleared before its task completed. it returns a V, run on the cache's executor, or a task<V>.
+	template<typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+	class async_cache {
+		static_assert(!std::is_void_v<V>, "async_cache memoizes values");
+
+	public:
+		using clock = std::chrono::steady_clock;
+
+		struct statistics {
+			// including callers that joined a task still running.
+			size_t hits = 0;
+			size_t misses = 0;
+			// dropped for capacity.
+			size_t evictions = 0;
+			size_t expirations = 0;
+			// dropped as faulted or canceled.
+			size_t failures = 0;
+		};
+
+	private:
+		struct entry {
+			K key;
+			task<V> value;
+			uint64_t generation;
+			// set once the value completed, if there is a ttl.
+			clock::time_point expires;
+			// only for factories taking a token.
+			std::optional<cancellation_token_source> cancel_source;
+		};
+
+		using entry_list = std::list<entry>;
+
+		struct shard {
+			std::mutex mtx;
+			// most recently used first.
+			entry_list lru;
+			std::unordered_map<K, typename entry_list::iterator, Hash, KeyEqual> index;
+			uint64_t next_generation = 0;
+			statistics stats;
+		};
+
+		// shared with the completion callbacks, which may run after the cache is gone.
+		std::vector<std::shared_ptr<shard>> shards;
+		unsigned shard_bits;
+		size_t shard_capacity;
+		clock::duration ttl;
+		executor* exec;
+		Hash hasher;
+
+		size_t shard_index(const K& key) const {
+			if (shard_bits == 0) {
+				return 0;
+			}
+			// fibonacci hashing, so identity hashes of small integers still spread.
+			const uint64_t h = static_cast<uint64_t>(hasher(key)) * 0x9E3779B97F4A7C15ull;
+			return static_cast<size_t>(h >> (64 - shard_bits));
+		}
+
+		shard& shard_of(const K& key) const { return *shards[shard_index(key)]; }
+
+		// the ttl of a value starts once it completed, when its completion callback ran.
+		static bool is_expired(const entry& e, clock::time_point now) {
+			return e.expires != clock::time_point{} && now >= e.expires;
+		}
+
+		static void erase_locked(shard& s, typename entry_list::iterator it) {
+			s.index.erase(it->key);
+			s.lru.erase(it);
+		}
+
+		// drops the entry if it's no use to the next caller, counting why.
+		static bool drop_if_stale_locked(shard& s, typename entry_list::iterator it, clock::duration ttl) {
+			const task_status status = it->value.get_status();
+			if (status == faulted || status == canceled) {
+				++s.stats.failures;
+			}
+			else if (status == completed && ttl != clock::duration::zero() && is_expired(*it, clock::now())) {
+				++s.stats.expirations;
+			}
+			else {
+				return false;
+			}
+			erase_locked(s, it);
+			return true;
+		}
+
+		// least recently used first, preferring values that completed over tasks still running.
+		void evict_locked(shard& s) {
+			if (shard_capacity == 0) {
+				return;
+			}
+			while (s.lru.size() > shard_capacity) {
+				auto victim = std::prev(s.lru.end());
+				for (auto it = victim; ; --it) {
+					if (it->value.is_completed()) {
+						victim = it;
+						break;
+					}
+					if (it == s.lru.begin()) {
+						break;
+					}
+				}
+				++s.stats.evictions;
+				erase_locked(s, victim);
+			}
+		}
+
+		// drops a failed entry, or starts the ttl of one that completed, unless the key was taken over since.
+		static void on_entry_completed(const std::weak_ptr<shard>& weak, const K& key, uint64_t generation, task_status status, clock::duration ttl) {
+			if (status == completed && ttl == clock::duration::zero()) {
+				return;
+			}
+			auto s = weak.lock();
+			if (!s) {
+				return;
+			}
+			std::lock_guard<std::mutex> lk(s->mtx);
+			auto found = s->index.find(key);
+			if (found == s->index.end() || found->second->generation != generation) {
+				return;
+			}
+			if (status != completed) {
+				++s->stats.failures;
+				erase_locked(*s, found->second);
+				return;
+			}
+			found->second->expires = clock::now() + ttl;
+			found->second->cancel_source.reset();
+		}
+
+		template<typename F>
+		static constexpr bool takes_token_v = std::is_invocable_v<F&, const K&, cancellation_token>;
+
+		template<typename F>
+		static auto call_factory(F& factory, const K& key, std::optional<cancellation_token_source>& source) {
+			if constexpr (takes_token_v<F>) {
+				return factory(key, source->token());
+			}
+			else {
+				(void)source;
+				return factory(key);
+			}
+		}
+
+	public:
+		// capacity bounds the number of entries, 0 for no bound; ttl 0 keeps completed values until evicted.
+		explicit async_cache(size_t capacity = 0, clock::duration ttlIn = clock::duration::zero(), size_t shard_count = 16, executor& ex = default_executor())
+			:
+			shard_bits(0),
+			ttl(ttlIn),
+			exec(&ex)
+		{
+			while ((size_t(1) << shard_bits) < std::max<size_t>(shard_count, 1)) {
+				++shard_bits;
+			}
+			const size_t count = size_t(1) << shard_bits;
+			shard_capacity = capacity == 0 ? 0 : (capacity + count - 1) / count;
+			shards.reserve(count);
+			for (size_t i = 0; i < count; ++i) {
+				shards.push_back(std::make_shared<shard>());
+			}
+		}
+
+		async_cache(const async_cache&) = delete;
+		async_cache& operator=(const async_cache&) = delete;
+
+		// the task cached for key, or the one factory starts for it once no other caller did.
+		template<typename F>
+		task<V> get_or_add(const K& key, F&& factory) {
+			using factory_t = std::decay_t<F>;
+			using result_t = std::decay_t<decltype(call_factory(std::declval<factory_t&>(), key, std::declval<std::optional<cancellation_token_source>&>()))>;
+			static_assert(std::is_convertible_v<result_t, V> || std::is_same_v<result_t, task<V>>, "factory returns V or task<V>");
+
+			const size_t at = shard_index(key);
+			shard& s = *shards[at];
+			std::unique_lock<std::mutex> lk(s.mtx);
+			auto found = s.index.find(key);
+			if (found != s.index.end() && !drop_if_stale_locked(s, found->second, ttl)) {
+				++s.stats.hits;
+				s.lru.splice(s.lru.begin(), s.lru, found->second);
+				return found->second->value;
+			}
+			++s.stats.misses;
+
+			std::optional<cancellation_token_source> cancel_source;
+			cancellation_token token;
+			if constexpr (takes_token_v<factory_t>) {
+				cancel_source.emplace();
+				token = cancel_source->token();
+			}
+
+			// the task goes into the shard before the factory runs, outside the lock, so callers coming meanwhile join it.
+			std::optional<task<V>> value;
+			std::optional<task_completion_source<V>> forward;
+			if constexpr (is_task_v<result_t>) {
+				forward.emplace(*exec);
+				value = forward->get_task();
+			}
+			else {
+				value = task<V>(task_function<V>([f = factory_t(std::forward<F>(factory)), key, source = cancel_source]() mutable -> V {
+					return call_factory(f, key, source);
+				}), *exec, token);
+			}
+
+			const uint64_t generation = s.next_generation++;
+			s.lru.push_front(entry{ key, *value, generation, clock::time_point{}, cancel_source });
+			s.index.emplace(key, s.lru.begin());
+			evict_locked(s);
+			lk.unlock();
+
+			value->on_completed([weak = std::weak_ptr<shard>(shards[at]), key, generation, ttl = ttl, completion = *value]() {
+				on_entry_completed(weak, key, generation, completion.get_status(), ttl);
+			});
+
+			if constexpr (is_task_v<result_t>) {
+				try {
+					task<V> produced = call_factory(factory, key, cancel_source);
+					produced.on_completed([produced, source = std::move(*forward)]() mutable {
+						switch (produced.get_status()) {
+						case faulted:
+							source.try_set_exception(produced.exception_ptr());
+							break;
+						case canceled:
+							source.try_set_canceled();
+							break;
+						default:
+							source.try_set_result(std::move(produced).get());
+							break;
+						}
+					});
+				}
+				catch (...) {
+					forward->try_set_exception(std::current_exception());
+				}
+			}
+			else {
+				value->dispatch();
+			}
+			return *value;
+		}
+
+		// the task cached for key, if there is one still of use.
+		std::optional<task<V>> try_get(const K& key) {
+			shard& s = shard_of(key);
+			std::lock_guard<std::mutex> lk(s.mtx);
+			auto found = s.index.find(key);
+			if (found == s.index.end() || drop_if_stale_locked(s, found->second, ttl)) {
+				++s.stats.misses;
+				return std::nullopt;
+			}
+			++s.stats.hits;
+			s.lru.splice(s.lru.begin(), s.lru, found->second);
+			return found->second->value;
+		}
+
+		// drops the entry for key, canceling the token of a factory still running for it.
+		bool erase(const K& key) {
+			shard& s = shard_of(key);
+			std::optional<cancellation_token_source> running;
+			{
+				std::lock_guard<std::mutex> lk(s.mtx);
+				auto found = s.index.find(key);
+				if (found == s.index.end()) {
+					return false;
+				}
+				running = std::move(found->second->cancel_source);
+				erase_locked(s, found->second);
+			}
+			if (running) {
+				running->cancel();
+			}
+			return true;
+		}
+
+		// drops every entry, canceling the tokens of factories still running.
+		void clear() {
+			for (auto& s : shards) {
+				entry_list dropped;
+				{
+					std::lock_guard<std::mutex> lk(s->mtx);
+					s->index.clear();
+					dropped.swap(s->lru);
+				}
+				for (auto& e : dropped) {
+					if (e.cancel_source) {
+						e.cancel_source->cancel();
+					}
+				}
+			}
+		}
+
+		// drops the completed entries whose ttl elapsed, which otherwise only go once looked up or evicted.
+		size_t purge_expired() {
+			if (ttl == clock::duration::zero()) {
+				return 0;
+			}
+			size_t purged = 0;
+			for (auto& s : shards) {
+				std::lock_guard<std::mutex> lk(s->mtx);
+				const auto now = clock::now();
+				for (auto it = s->lru.begin(); it != s->lru.end();) {
+					auto next = std::next(it);
+					if (it->value.is_completed_sucessfully() && is_expired(*it, now)) {
+						++s->stats.expirations;
+						erase_locked(*s, it);
+						++purged;
+					}
+					it = next;
+				}
+			}
+			return purged;
+		}
+
+		size_t size() const {
+			size_t count = 0;
+			for (auto& s : shards) {
+				std::lock_guard<std::mutex> lk(s->mtx);
+				count += s->lru.size();
+			}
+			return count;
+		}
+
+		statistics stats() const {
+			statistics total;
+			for (auto& s : shards) {
+				std::lock_guard<std::mutex> lk(s->mtx);
+				total.hits += s->stats.hits;
+				total.misses += s->stats.misses;
+				total.evictions += s->stats.evictions;
+				total.expirations += s->stats.expirations;
+				total.failures += s->stats.failures;
+			}
+			return total;
+		}
+
+		size_t shard_count() const { return shards.size(); }
+	};
+}
@@ -0,0 +1,379 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <exception>
+#include <cstdint>
+#include <bit>
+
+#include "timer.h"
+
+namespace cpptask
+{
+	class task_cancelled : public std::exception {
+	public:
+		task_cancelled() = default;
+
+		const char* what() const noexcept override {
+			return "a task was cancelled";
+		}
+	};
+
+	// registration node of a cancellation callback.
+	struct cancel_callback {
+		std::atomic<bool> done{ false };
+		uint32_t slot = 0;
+		bool orphaned = false;
+
+		virtual ~cancel_callback() = default;
+
+		// runs once on the canceling thread; has to end with finish(), after which *this may be gone.
+		virtual void invoke() = 0;
+
+		// a heap callback its owner let go of while it ran deletes itself here.
+		void finish() {
+			if (orphaned) {
+				delete this;
+				return;
+			}
+			done.store(true, std::memory_order_release);
+			done.notify_all();
+		}
+	};
+
+	// callbacks live in slots of chunks that double in size and are never moved, so registering and deregistering
+	// are a few atomic operations. freed slots go to a tagged free list and are reused by later registrations.
+	class cancel_block : public std::enable_shared_from_this<cancel_block> {
+	private:
+		struct slot {
+			std::atomic<cancel_callback*> callback{ nullptr };
+			std::atomic<uint32_t> next_free{ 0 };
+		};
+
+		struct link {
+			std::shared_ptr<cancel_block> parent;
+			std::unique_ptr<cancel_callback> callback;
+		};
+
+		static constexpr uint32_t first_chunk_size = 16;
+		static constexpr size_t chunk_count = 24;
+
+		std::atomic<bool> canceled;
+		std::atomic<std::thread::id> canceler;
+		std::atomic<slot*> chunks[chunk_count];
+		std::atomic<uint32_t> high_water;
+		std::atomic<uint64_t> free_head;
+		std::atomic<timer_wheel::timer_id> deadline_timer;
+		std::vector<link> links;
+
+		static size_t chunk_of(uint32_t index, uint32_t& offset) {
+			const uint32_t k = static_cast<uint32_t>(std::bit_width(index / first_chunk_size + 1) - 1);
+			offset = index - first_chunk_size * ((1u << k) - 1);
+			return k;
+		}
+
+		// null if the chunk of index isn't allocated yet.
+		slot* find_slot(uint32_t index) {
+			uint32_t offset = 0;
+			slot* chunk = chunks[chunk_of(index, offset)].load();
+			return chunk != nullptr ? &chunk[offset] : nullptr;
+		}
+
+		// index has been handed out before, so its chunk exists.
+		slot& slot_at(uint32_t index) {
+			uint32_t offset = 0;
+			return chunks[chunk_of(index, offset)].load()[offset];
+		}
+
+		slot& allocate_slot(uint32_t& index) {
+			uint64_t head = free_head.load(std::memory_order_acquire);
+			while (static_cast<uint32_t>(head) != 0) {
+				const uint32_t candidate = static_cast<uint32_t>(head) - 1;
+				slot& s = slot_at(candidate);
+				const uint64_t next = (((head >> 32) + 1) << 32) | s.next_free.load(std::memory_order_relaxed);
+				if (free_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+					index = candidate;
+					return s;
+				}
+			}
+
+			index = high_water.fetch_add(1);
+			uint32_t offset = 0;
+			const size_t k = chunk_of(index, offset);
+			slot* chunk = chunks[k].load();
+			if (chunk == nullptr) {
+				slot* fresh = new slot[size_t(first_chunk_size) << k];
+				if (chunks[k].compare_exchange_strong(chunk, fresh)) {
+					chunk = fresh;
+				}
+				else {
+					delete[] fresh;
+				}
+			}
+			return chunk[offset];
+		}
+
+		void free_slot(uint32_t index, slot& s) {
+			uint64_t head = free_head.load(std::memory_order_relaxed);
+			uint64_t next = 0;
+			do {
+				s.next_free.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+				next = (((head >> 32) + 1) << 32) | (index + 1);
+			} while (!free_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+	public:
+		cancel_block() : canceled(false), canceler(std::thread::id()), high_water(0), free_head(0), deadline_timer(0) {
+			for (auto& chunk : chunks) {
+				chunk.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		~cancel_block() {
+			for (auto& l : links) {
+				l.parent->deregister(l.callback.get());
+			}
+			if (timer_wheel::timer_id id = deadline_timer.load()) {
+				timer_wheel::instance().cancel(id);
+			}
+			for (auto& chunk : chunks) {
+				delete[] chunk.load();
+			}
+		}
+
+		cancel_block(const cancel_block&) = delete;
+		cancel_block& operator=(const cancel_block&) = delete;
+
+		bool is_canceled() const { return canceled.load(std::memory_order_acquire); }
+
+		// false if the block is already canceled, then callback is neither registered nor invoked.
+		bool try_register(cancel_callback* callback) {
+			if (canceled.load()) {
+				return false;
+			}
+
+			uint32_t index = 0;
+			slot& s = allocate_slot(index);
+			callback->slot = index;
+			s.callback.store(callback);
+			if (canceled.load()) {
+				cancel_callback* expected = callback;
+				if (s.callback.compare_exchange_strong(expected, nullptr)) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// true if callback was removed before it ran. otherwise it ran or is running, and unless that happens
+		// on this very thread, deregister waits until it finished.
+		bool deregister(cancel_callback* callback) {
+			slot& s = slot_at(callback->slot);
+			cancel_callback* expected = callback;
+			if (s.callback.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+				free_slot(callback->slot, s);
+				return true;
+			}
+
+			if (canceler.load(std::memory_order_acquire) != std::this_thread::get_id()) {
+				while (!callback->done.load(std::memory_order_acquire)) {
+					callback->done.wait(false, std::memory_order_acquire);
+				}
+			}
+			return false;
+		}
+
+		// sets the flag and runs every registered callback on this thread, once.
+		void cancel() {
+			if (canceled.exchange(true)) {
+				return;
+			}
+
+			canceler.store(std::this_thread::get_id(), std::memory_order_release);
+			const uint32_t count = high_water.load();
+			for (uint32_t index = 0; index < count; ++index) {
+				slot* s = find_slot(index);
+				if (s == nullptr) {
+					continue;
+				}
+				if (cancel_callback* callback = s->callback.exchange(nullptr)) {
+					callback->invoke();
+				}
+			}
+		}
+
+		// the timer holds only a weak reference, a block that goes away first cancels its timer.
+		void cancel_at(timer_wheel::clock::time_point deadline) {
+			std::weak_ptr<cancel_block> weak = weak_from_this();
+			auto id = timer_wheel::instance().add(deadline, [weak]() {
+				if (auto block = weak.lock()) {
+					block->cancel();
+				}
+			});
+			if (timer_wheel::timer_id previous = deadline_timer.exchange(id)) {
+				timer_wheel::instance().cancel(previous);
+			}
+		}
+
+		// cancels this block when parent is canceled; only called while the block isn't shared yet.
+		void link_to(const std::shared_ptr<cancel_block>& parent);
+	};
+
+	template<typename F>
+	struct function_callback : cancel_callback {
+		F func;
+
+		template<typename U>
+		function_callback(U&& f) : func(std::forward<U>(f)) {}
+
+		void invoke() override {
+			func();
+			finish();
+		}
+	};
+
+	struct link_callback : cancel_callback {
+		cancel_block* child;
+
+		link_callback(cancel_block* childIn) : child(childIn) {}
+
+		void invoke() override {
+			child->cancel();
+			finish();
+		}
+	};
+
+	inline void cancel_block::link_to(const std::shared_ptr<cancel_block>& parent)
+	{
+		auto callback = std::make_unique<link_callback>(this);
+		if (!parent->try_register(callback.get())) {
+			cancel();
+			return;
+		}
+		links.push_back({ parent, std::move(callback) });
+	}
+
+	// unregisters its callback when destroyed.
+	class cancellation_registration {
+	private:
+		std::shared_ptr<cancel_block> block;
+		std::unique_ptr<cancel_callback> callback;
+
+	public:
+		cancellation_registration() = default;
+
+		cancellation_registration(const std::shared_ptr<cancel_block>& blockIn, std::unique_ptr<cancel_callback>&& callbackIn)
+			: block(blockIn), callback(std::move(callbackIn)) {}
+
+		cancellation_registration(cancellation_registration&& rhs) noexcept = default;
+
+		cancellation_registration& operator=(cancellation_registration&& rhs) noexcept {
+			if (this != &rhs) {
+				unregister();
+				block = std::move(rhs.block);
+				callback = std::move(rhs.callback);
+			}
+			return *this;
+		}
+
+		~cancellation_registration() { unregister(); }
+
+		// true if the callback was removed before it ran.
+		bool unregister() {
+			if (callback == nullptr) {
+				return false;
+			}
+
+			bool removed = block->deregister(callback.get());
+			if (!removed && !callback->done.load(std::memory_order_acquire)) {
+				// unregistered from within the callback itself, which frees itself once it returns.
+				callback->orphaned = true;
+				callback.release();
+			}
+			callback.reset();
+			block.reset();
+			return removed;
+		}
+	};
+
+	class cancellation_token {
+	private:
+		std::shared_ptr<cancel_block> block;
+
+	public:
+		cancellation_token() = default;
+
+		cancellation_token(const std::shared_ptr<cancel_block>& blockIn) : block(blockIn) {}
+
+		bool can_be_canceled() const { return block != nullptr; }
+
+		bool is_cancellation_requested() const { return block != nullptr && block->is_canceled(); }
+
+		void throw_if_cancellation_requested() const { if (is_cancellation_requested()) throw task_cancelled(); }
+
+		// f runs once on the canceling thread, or right here if the token is already canceled.
+		template<typename F>
+		cancellation_registration register_callback(F&& f) const {
+			if (block == nullptr) {
+				return {};
+			}
+
+			auto callback = std::make_unique<function_callback<std::decay_t<F>>>(std::forward<F>(f));
+			if (!block->try_register(callback.get())) {
+				callback->func();
+				return {};
+			}
+			return { block, std::move(callback) };
+		}
+
+		// low level registration for callbacks owned by the caller, see cancel_block.
+		bool try_register(cancel_callback* callback) const { return block != nullptr && block->try_register(callback); }
+
+		bool deregister(cancel_callback* callback) const { return block->deregister(callback); }
+
+		const std::shared_ptr<cancel_block>& _block() const { return block; }
+	};
+
+	class cancellation_token_source {
+		friend class cancellation_token;
+	private:
+		std::shared_ptr<cancel_block> impl;
+
+	public:
+		cancellation_token_source() : impl(std::make_shared<cancel_block>()) {}
+
+		// canceled once timeout elapsed, by the shared timer wheel.
+		explicit cancellation_token_source(timer_wheel::clock::duration timeout) : cancellation_token_source() { cancel_after(timeout); }
+
+		// canceled as soon as any of the tokens is.
+		static cancellation_token_source create_linked(const std::vector<cancellation_token>& tokens) {
+			cancellation_token_source source;
+			for (const auto& token : tokens) {
+				if (token.can_be_canceled()) {
+					source.impl->link_to(token._block());
+				}
+			}
+			return source;
+		}
+
+		template<typename ...Tokens>
+		static cancellation_token_source create_linked(const cancellation_token& first, const Tokens&... rest) {
+			return create_linked(std::vector<cancellation_token>{ first, rest... });
+		}
+
+		cancellation_token token() { return { impl }; }
+
+		std::shared_ptr<cancel_block> _block() const { return impl; }
+
+		bool is_cancellation_requested() const { return impl->is_canceled(); }
+
+		void cancel() { impl->cancel(); }
+
+		// replaces an earlier deadline.
+		void cancel_after(timer_wheel::clock::duration timeout) { impl->cancel_at(timer_wheel::clock::now() + timeout); }
+
+		void cancel_at(timer_wheel::clock::time_point deadline) { impl->cancel_at(deadline); }
+	};
+}
@@ -0,0 +1,528 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <optional>
+#include <exception>
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+#include "task.h"
+
+namespace cpptask
+{
+	class channel_closed : public std::exception {
+	public:
+		channel_closed() = default;
+
+		const char* what() const noexcept override {
+			return "the channel is closed";
+		}
+	};
+
+	// Vyukov's bounded multi producer multi consumer queue. every cell carries a sequence number telling whether it
+	// is free for the push at its position or holds the value for the pop at its position, so pushes and pops claim
+	// a position with one CAS and never wait for each other, except a pop on a cell whose push is still writing it,
+	// which reports the queue as empty.
+	template<typename T>
+	class mpmc_ring {
+	private:
+		struct cell {
+			std::atomic<size_t> sequence;
+			std::optional<T> value;
+		};
+
+		std::unique_ptr<cell[]> cells;
+		size_t mask;
+		alignas(64) std::atomic<size_t> tail;
+		alignas(64) std::atomic<size_t> head;
+
+	public:
+		// the capacity is rounded up to a power of two, and to 2 at least : with a single cell the sequence of a full
+		// cell would read as free for the next push.
+		explicit mpmc_ring(size_t capacityIn)
+			:
+			cells(new cell[std::bit_ceil(std::max<size_t>(capacityIn, 2))]),
+			mask(std::bit_ceil(std::max<size_t>(capacityIn, 2)) - 1),
+			tail(0),
+			head(0)
+		{
+			for (size_t i = 0; i <= mask; ++i) {
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		mpmc_ring(const mpmc_ring&) = delete;
+		mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+		size_t capacity() const { return mask + 1; }
+
+		// value is only moved from if the push succeeds.
+		template<typename U>
+		bool try_push(U&& value) {
+			size_t position = tail.load(std::memory_order_relaxed);
+			for (;;) {
+				cell& c = cells[position & mask];
+				const size_t sequence = c.sequence.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+				if (diff == 0) {
+					if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+						c.value.emplace(std::forward<U>(value));
+						c.sequence.store(position + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) {
+					return false;
+				}
+				else {
+					position = tail.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		std::optional<T> try_pop() {
+			size_t position = head.load(std::memory_order_relaxed);
+			for (;;) {
+				cell& c = cells[position & mask];
+				const size_t sequence = c.sequence.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+				if (diff == 0) {
+					if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+						std::optional<T> value(std::move(c.value));
+						c.value.reset();
+						c.sequence.store(position + mask + 1, std::memory_order_release);
+						return value;
+					}
+				}
+				else if (diff < 0) {
+					return std::nullopt;
+				}
+				else {
+					position = head.load(std::memory_order_relaxed);
+				}
+			}
+		}
+	};
+
+	// hands values from producers to consumers, like a Go channel or System.Threading.Channels. send and receive
+	// return tasks, so a producer waiting for room or a consumer waiting for a value holds no thread; a coroutine
+	// just co_awaits them. values are sent and received through a lock free ring; only a channel that is full for
+	// its senders or empty for its receivers takes a lock, to queue the waiting side.
+	// a bounded channel holds at most its capacity (the ring size, see mpmc_ring) and senders wait for room. an
+	// unbounded one queues what doesn't fit in the ring behind it and never lets a sender wait.
+	template<typename T>
+	class channel {
+		static_assert(!std::is_void_v<T>, "a channel carries values");
+	private:
+		struct receive_waiter {
+			task_completion_source<T> source;
+			cancellation_registration registration;
+		};
+
+		struct send_waiter {
+			task_completion_source<void> source;
+			cancellation_registration registration;
+		};
+
+		// a value that didn't fit in the ring; waiter is null when the send already completed.
+		struct pending_send {
+			T value;
+			std::shared_ptr<send_waiter> waiter;
+		};
+
+		// waiters to complete once the lock is released.
+		struct ready_waiters {
+			std::vector<std::pair<std::shared_ptr<receive_waiter>, T>> received;
+			std::vector<std::shared_ptr<send_waiter>> sent;
+			std::vector<std::shared_ptr<receive_waiter>> closed;
+		};
+
+		static constexpr size_t unbounded_ring_size = 1024;
+
+		mpmc_ring<T> ring;
+		const bool bounded;
+
+		std::mutex mtx;
+		std::deque<std::shared_ptr<receive_waiter>> receivers;
+		std::deque<pending_send> pending;
+		bool closed;
+		// the lock free paths read these to tell whether the other side needs the lock taken.
+		std::atomic<size_t> receiver_count;
+		std::atomic<size_t> pending_count;
+		std::atomic<bool> closed_flag;
+
+		void update_counts_locked() {
+			receiver_count.store(receivers.size(), std::memory_order_relaxed);
+			pending_count.store(pending.size(), std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+
+		// moves pending values into the ring and hands values to waiting receivers until neither can go on.
+		void settle_locked(ready_waiters& ready) {
+			for (bool progress = true; progress;) {
+				progress = false;
+				while (!pending.empty() && ring.try_push(std::move(pending.front().value))) {
+					if (pending.front().waiter != nullptr) {
+						ready.sent.push_back(std::move(pending.front().waiter));
+					}
+					pending.pop_front();
+					progress = true;
+				}
+				while (!receivers.empty()) {
+					std::optional<T> value = ring.try_pop();
+					if (!value) {
+						break;
+					}
+					ready.received.emplace_back(std::move(receivers.front()), std::move(*value));
+					receivers.pop_front();
+					progress = true;
+				}
+			}
+
+			if (closed && pending.empty()) {
+				for (auto& waiter : receivers) {
+					ready.closed.push_back(std::move(waiter));
+				}
+				receivers.clear();
+			}
+			update_counts_locked();
+		}
+
+		static void complete(ready_waiters& ready) {
+			for (auto& [waiter, value] : ready.received) {
+				waiter->registration.unregister();
+				waiter->source.try_set_result(std::move(value));
+			}
+			for (auto& waiter : ready.sent) {
+				waiter->registration.unregister();
+				waiter->source.try_set_result();
+			}
+			for (auto& waiter : ready.closed) {
+				waiter->registration.unregister();
+				waiter->source.try_set_exception(std::make_exception_ptr(channel_closed()));
+			}
+		}
+
+		void settle() {
+			ready_waiters ready;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				settle_locked(ready);
+			}
+			complete(ready);
+		}
+
+		// a waiter registers under the lock and then checks the ring again, a lock free push or pop checks the
+		// counts after it, and the fences between make sure at least one of the two sees the other.
+		void after_push() {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (receiver_count.load(std::memory_order_relaxed) != 0) {
+				settle();
+			}
+		}
+
+		void after_pop() {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (pending_count.load(std::memory_order_relaxed) != 0) {
+				settle();
+			}
+		}
+
+		template<typename W>
+		static bool remove_waiter(std::deque<std::shared_ptr<W>>& waiters, const std::shared_ptr<W>& waiter) {
+			auto found = std::find(waiters.begin(), waiters.end(), waiter);
+			if (found == waiters.end()) {
+				return false;
+			}
+			waiters.erase(found);
+			return true;
+		}
+
+		void cancel_receive(const std::shared_ptr<receive_waiter>& waiter) {
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (!remove_waiter(receivers, waiter)) {
+					return;
+				}
+				update_counts_locked();
+			}
+			waiter->source.try_set_canceled();
+		}
+
+		void cancel_send(const std::shared_ptr<send_waiter>& waiter) {
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				auto found = std::find_if(pending.begin(), pending.end(), [&](const pending_send& p) { return p.waiter == waiter; });
+				if (found == pending.end()) {
+					return;
+				}
+				pending.erase(found);
+				update_counts_locked();
+			}
+			waiter->source.try_set_canceled();
+		}
+
+		template<typename U>
+		static task<T> received(U&& value) {
+			task_completion_source<T> source;
+			source.set_result(std::forward<U>(value));
+			return source.get_task();
+		}
+
+		// a completed task<void> is never written again, so every send completing right away shares one per thread.
+		static task<void> sent() {
+			thread_local task<void> completed = []() {
+				task_completion_source<void> source;
+				source.set_result();
+				return source.get_task();
+			}();
+			return completed;
+		}
+
+		template<typename R>
+		static task<R> failed(std::exception_ptr e) {
+			task_completion_source<R> source;
+			if (e) {
+				source.set_exception(e);
+			}
+			else {
+				source.set_canceled();
+			}
+			return source.get_task();
+		}
+
+	public:
+		static constexpr size_t unbounded = 0;
+
+		// a capacity of unbounded makes an unbounded channel.
+		explicit channel(size_t capacity = unbounded)
+			:
+			ring(capacity != unbounded ? capacity : unbounded_ring_size),
+			bounded(capacity != unbounded),
+			closed(false),
+			receiver_count(0),
+			pending_count(0),
+			closed_flag(false)
+		{
+		}
+
+		// fails the receivers still waiting and cancels the senders still waiting for room.
+		~channel() {
+			std::deque<std::shared_ptr<receive_waiter>> remaining_receivers;
+			std::deque<pending_send> remaining_sends;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				closed = true;
+				remaining_receivers.swap(receivers);
+				remaining_sends.swap(pending);
+			}
+			for (auto& waiter : remaining_receivers) {
+				waiter->registration.unregister();
+				waiter->source.try_set_exception(std::make_exception_ptr(channel_closed()));
+			}
+			for (auto& p : remaining_sends) {
+				if (p.waiter != nullptr) {
+					p.waiter->registration.unregister();
+					p.waiter->source.try_set_canceled();
+				}
+			}
+		}
+
+		channel(const channel&) = delete;
+		channel& operator=(const channel&) = delete;
+
+		// false if the channel is full or closed; value is only moved from if it was sent.
+		template<typename U>
+		bool try_send(U&& value) {
+			if (closed_flag.load(std::memory_order_acquire)) {
+				return false;
+			}
+			if (pending_count.load(std::memory_order_relaxed) == 0 && ring.try_push(std::forward<U>(value))) {
+				after_push();
+				return true;
+			}
+			if (bounded) {
+				return false;
+			}
+
+			std::lock_guard<std::mutex> lk(mtx);
+			if (closed) {
+				return false;
+			}
+			pending.push_back({ T(std::forward<U>(value)), nullptr });
+			update_counts_locked();
+			return true;
+		}
+
+		// false if nothing is there right now.
+		bool try_receive(T& out) {
+			std::optional<T> value = ring.try_pop();
+			if (!value) {
+				if (pending_count.load(std::memory_order_relaxed) == 0) {
+					return false;
+				}
+				ready_waiters ready;
+				{
+					std::lock_guard<std::mutex> lk(mtx);
+					settle_locked(ready);
+					value = ring.try_pop();
+				}
+				complete(ready);
+				if (!value) {
+					return false;
+				}
+			}
+			after_pop();
+			out = std::move(*value);
+			return true;
+		}
+
+		// completes once the value is in the channel. it faults with channel_closed if the channel is closed,
+		// and is canceled with the token while it waits for room, the value is dropped then.
+		template<typename U>
+		task<void> send(U&& value, const cancellation_token& token = cancellation_token{}) {
+			if (closed_flag.load(std::memory_order_acquire)) {
+				return failed<void>(std::make_exception_ptr(channel_closed()));
+			}
+			if (pending_count.load(std::memory_order_relaxed) == 0 && ring.try_push(std::forward<U>(value))) {
+				after_push();
+				return sent();
+			}
+
+			// registered before the waiter is visible to others, a token canceled meanwhile is caught below.
+			std::shared_ptr<send_waiter> waiter;
+			if (bounded) {
+				waiter = std::make_shared<send_waiter>();
+				if (token.can_be_canceled()) {
+					std::weak_ptr<send_waiter> weak = waiter;
+					waiter->registration = token.register_callback([this, weak]() {
+						if (auto w = weak.lock()) {
+							cancel_send(w);
+						}
+					});
+				}
+			}
+
+			ready_waiters ready;
+			std::exception_ptr error;
+			bool accepted = false;
+			bool waiting = false;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (closed) {
+					error = std::make_exception_ptr(channel_closed());
+				}
+				else if (pending.empty() && ring.try_push(std::forward<U>(value))) {
+					accepted = true;
+				}
+				else if (!bounded) {
+					pending.push_back({ T(std::forward<U>(value)), nullptr });
+					accepted = true;
+				}
+				else if (!token.is_cancellation_requested()) {
+					pending.push_back({ T(std::forward<U>(value)), waiter });
+					waiting = true;
+				}
+
+				// hands the value to a waiting receiver, or moves it into room a receiver made since the push failed.
+				if (accepted || waiting) {
+					settle_locked(ready);
+				}
+			}
+			complete(ready);
+
+			if (waiting) {
+				return waiter->source.get_task();
+			}
+			if (waiter != nullptr) {
+				waiter->registration.unregister();
+			}
+			return accepted ? sent() : failed<void>(error);
+		}
+
+		// completes with the next value. it faults with channel_closed once the channel is closed and drained,
+		// and is canceled with the token while it waits.
+		task<T> receive(const cancellation_token& token = cancellation_token{}) {
+			std::optional<T> value = ring.try_pop();
+			if (value) {
+				after_pop();
+				return received(std::move(*value));
+			}
+
+			auto waiter = std::make_shared<receive_waiter>();
+			if (token.can_be_canceled()) {
+				std::weak_ptr<receive_waiter> weak = waiter;
+				waiter->registration = token.register_callback([this, weak]() {
+					if (auto w = weak.lock()) {
+						cancel_receive(w);
+					}
+				});
+			}
+
+			ready_waiters ready;
+			std::exception_ptr error;
+			bool waiting = false;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				settle_locked(ready);
+				value = ring.try_pop();
+				if (!value) {
+					if (closed && pending.empty()) {
+						error = std::make_exception_ptr(channel_closed());
+					}
+					else if (!token.is_cancellation_requested()) {
+						receivers.push_back(waiter);
+						update_counts_locked();
+						// a push that missed the count may have landed since.
+						value = ring.try_pop();
+						if (value) {
+							receivers.pop_back();
+							update_counts_locked();
+						}
+						else {
+							waiting = true;
+						}
+					}
+				}
+				if (value) {
+					settle_locked(ready);
+				}
+			}
+			complete(ready);
+
+			if (waiting) {
+				return waiter->source.get_task();
+			}
+			waiter->registration.unregister();
+			if (value) {
+				return received(std::move(*value));
+			}
+			return failed<T>(error);
+		}
+
+		// refuses new sends; what was sent before, including senders still waiting for room, stays receivable.
+		// receivers waiting on the drained channel fault with channel_closed. a send racing with close may still
+		// go through.
+		void close() {
+			ready_waiters ready;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				closed = true;
+				closed_flag.store(true, std::memory_order_release);
+				settle_locked(ready);
+			}
+			complete(ready);
+		}
+
+		bool is_closed() const { return closed_flag.load(std::memory_order_acquire); }
+
+		bool is_bounded() const { return bounded; }
+
+		// the ring size of a bounded channel, 0 for an unbounded one.
+		size_t capacity() const { return bounded ? ring.capacity() : 0; }
+	};
+}
@@ -0,0 +1,285 @@
+#pragma once
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <atomic>
+#include <array>
+#include <variant>
+#include <stdexcept>
+
+#include "task.h"
+
+namespace cpptask
+{
+	template<typename T>
+	using task_value_t = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+	template<typename T>
+	struct is_task : std::false_type {};
+
+	template<typename T>
+	struct is_task<task<T>> : std::true_type {};
+
+	template<typename T>
+	static constexpr bool is_task_v = is_task<std::decay_t<T>>::value;
+
+	// moves the value out when the caller holds the last copy of t.
+	template<typename T>
+	static task_value_t<T> task_value(task<T>& t)
+	{
+		if constexpr (std::is_void_v<T>) {
+			t.get();
+			return {};
+		}
+		else {
+			return std::move(t).get();
+		}
+	}
+
+	// collects the exceptions of the inputs that didn't complete successfully.
+	// returns false if every input completed successfully; otherwise source was completed as faulted or canceled.
+	template<typename R>
+	struct when_all_failure {
+		aggregate_exception faults;
+		bool any_faulted = false;
+		bool any_canceled = false;
+
+		template<typename T>
+		void add(const task<T>& t) {
+			if (t.is_faulted()) {
+				faults.add_exception(t.exception_ptr());
+				any_faulted = true;
+			}
+			else if (t.is_canceled()) {
+				any_canceled = true;
+			}
+		}
+
+		bool complete(task_completion_source<R>& source) {
+			if (any_faulted) {
+				source.set_exception(std::make_exception_ptr(faults));
+				return true;
+			}
+			if (any_canceled) {
+				source.set_canceled();
+				return true;
+			}
+			return false;
+		}
+	};
+
+	// the state of a combinator owns one continuation per input and deletes itself after the last one ran,
+	// so waiting on n tasks costs no thread and no allocation per input.
+	template<typename State>
+	struct arrival : continuation {
+		State* owner = nullptr;
+		size_t index = 0;
+
+		void run() override { owner->arrive(index); }
+	};
+
+	template<typename T>
+	class when_all_state {
+	public:
+		using result_type = std::conditional_t<std::is_void_v<T>, void, std::vector<T>>;
+
+		std::vector<task<T>> tasks;
+		std::vector<arrival<when_all_state>> arrivals;
+		std::atomic<size_t> remaining;
+		task_completion_source<result_type> source;
+
+		when_all_state(std::vector<task<T>>&& tasksIn) : tasks(std::move(tasksIn)), arrivals(tasks.size()), remaining(tasks.size()) {}
+
+		void arrive(size_t) {
+			if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				finish();
+				delete this;
+			}
+		}
+
+		void finish() {
+			when_all_failure<result_type> failure;
+			for (auto& t : tasks) {
+				failure.add(t);
+			}
+			if (failure.complete(source)) {
+				return;
+			}
+
+			if constexpr (std::is_void_v<T>) {
+				source.set_result();
+			}
+			else {
+				std::vector<T> values;
+				values.reserve(tasks.size());
+				for (auto& t : tasks) {
+					values.push_back(std::move(t).get());
+				}
+				source.set_result(std::move(values));
+			}
+		}
+	};
+
+	template<typename ...Ts>
+	class when_all_tuple_state {
+	public:
+		using result_type = std::tuple<task_value_t<Ts>...>;
+
+		std::tuple<task<Ts>...> tasks;
+		std::array<arrival<when_all_tuple_state>, sizeof...(Ts)> arrivals;
+		std::atomic<size_t> remaining;
+		task_completion_source<result_type> source;
+
+		when_all_tuple_state(const task<Ts>&... tasksIn) : tasks(tasksIn...), remaining(sizeof...(Ts)) {}
+
+		void arrive(size_t) {
+			if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				finish();
+				delete this;
+			}
+		}
+
+		void finish() {
+			when_all_failure<result_type> failure;
+			std::apply([&failure](auto&... t) { (failure.add(t), ...); }, tasks);
+			if (failure.complete(source)) {
+				return;
+			}
+
+			source.set_result(std::apply([](auto&... t) { return result_type(task_value(t)...); }, tasks));
+		}
+	};
+
+	template<typename T>
+	class when_any_state {
+	public:
+		using result_type = std::conditional_t<std::is_void_v<T>, size_t, std::pair<size_t, T>>;
+
+		std::vector<task<T>> tasks;
+		std::vector<arrival<when_any_state>> arrivals;
+		std::atomic<size_t> remaining;
+		std::atomic<bool> done;
+		task_completion_source<result_type> source;
+
+		when_any_state(std::vector<task<T>>&& tasksIn) : tasks(std::move(tasksIn)), arrivals(tasks.size()), remaining(tasks.size()), done(false) {}
+
+		void arrive(size_t index) {
+			if (!done.exchange(true, std::memory_order_acq_rel)) {
+				finish(index);
+			}
+			if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete this;
+			}
+		}
+
+		void finish(size_t index) {
+			auto& winner = tasks[index];
+			if (winner.is_faulted()) {
+				source.set_exception(winner.exception_ptr());
+			}
+			else if (winner.is_canceled()) {
+				source.set_canceled();
+			}
+			else if constexpr (std::is_void_v<T>) {
+				source.set_result(index);
+			}
+			else {
+				source.set_result(index, std::move(winner).get());
+			}
+		}
+	};
+
+	template<typename State>
+	static arrival<State>* prepare_arrivals(State* state)
+	{
+		for (size_t i = 0; i < state->arrivals.size(); ++i) {
+			state->arrivals[i].owner = state;
+			state->arrivals[i].index = i;
+		}
+		return state->arrivals.data();
+	}
+
+	// state may be gone once the last arrival is registered.
+	template<typename State>
+	static void register_arrivals(State* state)
+	{
+		const size_t count = state->arrivals.size();
+		auto* arrivals = prepare_arrivals(state);
+		for (size_t i = 0; i < count; ++i) {
+			state->tasks[i].on_completed(&arrivals[i]);
+		}
+	}
+
+	// completes once every input completed, without a waiting thread. faults of the inputs are aggregated;
+	// if none faulted but one was canceled, the result is canceled.
+	template<typename T>
+	static auto when_all(std::vector<task<T>> tasks)
+	{
+		auto* state = new when_all_state<T>(std::move(tasks));
+		auto result = state->source.get_task();
+		if (state->tasks.empty()) {
+			state->finish();
+			delete state;
+			return result;
+		}
+
+		register_arrivals(state);
+		return result;
+	}
+	template<typename Iterator, typename = std::enable_if_t<!is_task_v<Iterator>>>
+	static auto when_all(Iterator first, Iterator last)
+	{
+		return when_all(std::vector<typename std::iterator_traits<Iterator>::value_type>(first, last));
+	}
+
+	template<typename Range, typename = std::enable_if_t<!is_task_v<Range>>>
+	static auto when_all(const Range& tasks)
+	{
+		return when_all(std::begin(tasks), std::end(tasks));
+	}
+
+	template<typename T, typename ...Ts>
+	static auto when_all(const task<T>& first, const task<Ts>&... rest)
+	{
+		auto* state = new when_all_tuple_state<T, Ts...>(first, rest...);
+		auto result = state->source.get_task();
+		auto* arrivals = prepare_arrivals(state);
+		size_t index = 0;
+		std::apply([arrivals, &index](auto&... t) { (t.on_completed(&arrivals[index++]), ...); }, state->tasks);
+		return result;
+	}
+
+	// completes with the index and result of the first input to complete; a faulted or canceled first input
+	// completes it the same way.
+	template<typename T>
+	static auto when_any(std::vector<task<T>> tasks)
+	{
+		if (tasks.empty()) {
+			throw std::invalid_argument("when_any needs at least one task");
+		}
+
+		auto* state = new when_any_state<T>(std::move(tasks));
+		auto result = state->source.get_task();
+		register_arrivals(state);
+		return result;
+	}
+
+	template<typename Iterator, typename = std::enable_if_t<!is_task_v<Iterator>>>
+	static auto when_any(Iterator first, Iterator last)
+	{
+		return when_any(std::vector<typename std::iterator_traits<Iterator>::value_type>(first, last));
+	}
+
+	template<typename Range, typename = std::enable_if_t<!is_task_v<Range>>>
+	static auto when_any(const Range& tasks)
+	{
+		return when_any(std::begin(tasks), std::end(tasks));
+	}
+
+	template<typename T, typename ...Ts>
+	static auto when_any(const task<T>& first, const task<Ts>&... rest)
+	{
+		static_assert((std::is_same_v<T, Ts> && ...), "when_any over tasks of different result types");
+		return when_any(std::vector<task<T>>{ first, rest... });
+	}
+}
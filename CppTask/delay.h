@@ -0,0 +1,180 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <exception>
+#include <type_traits>
+
+#include "task.h"
+#include "timer.h"
+
+namespace cpptask
+{
+	// creates a task and starts it on ex at deadline. a token canceled before that completes it as canceled
+	// and drops its timer, so pending timeouts that never fire don't pile up on the wheel.
+	template<typename F>
+	static auto schedule_at(executor& ex, timer_wheel::clock::time_point deadline, F&& f, const cancellation_token& token = cancellation_token{})
+	{
+		using R = bound_result_t<F>;
+		task<R> scheduled(make_bound_call(std::forward<F>(f)), ex, token);
+		if (scheduled.is_completed()) {
+			return scheduled;
+		}
+
+		auto id = timer_wheel::instance().add(deadline, [scheduled]() mutable { scheduled.dispatch(); });
+		if (token.can_be_canceled()) {
+			scheduled.on_completed([id]() { timer_wheel::instance().cancel(id); });
+		}
+		return scheduled;
+	}
+
+	template<typename F, typename = std::enable_if_t<!is_executor_v<F>>>
+	static auto schedule_at(timer_wheel::clock::time_point deadline, F&& f, const cancellation_token& token = cancellation_token{})
+	{
+		return schedule_at(default_executor(), deadline, std::forward<F>(f), token);
+	}
+
+	template<typename F>
+	static auto schedule_after(executor& ex, timer_wheel::clock::duration delay, F&& f, const cancellation_token& token = cancellation_token{})
+	{
+		return schedule_at(ex, timer_wheel::clock::now() + delay, std::forward<F>(f), token);
+	}
+
+	template<typename F, typename = std::enable_if_t<!is_executor_v<F>>>
+	static auto schedule_after(timer_wheel::clock::duration delay, F&& f, const cancellation_token& token = cancellation_token{})
+	{
+		return schedule_at(default_executor(), timer_wheel::clock::now() + delay, std::forward<F>(f), token);
+	}
+
+	// a task that completes after the delay without holding a thread, like Task.Delay. the timer thread only
+	// completes it : then() continuations run on ex, while on_completed callbacks run on the timer thread and must
+	// be short. a token canceled first completes it as canceled and drops its timer.
+	static inline task<void> delay(executor& ex, timer_wheel::clock::duration duration, const cancellation_token& token = cancellation_token{})
+	{
+		task_completion_source<void> source(ex);
+		task<void> delayed = source.get_task();
+		if (token.is_cancellation_requested()) {
+			source.set_canceled();
+			return delayed;
+		}
+
+		auto id = timer_wheel::instance().add(timer_wheel::clock::now() + duration, [source]() mutable { source.try_set_result(); });
+		if (token.can_be_canceled()) {
+			auto registration = std::make_shared<cancellation_registration>(token.register_callback([source, id]() mutable {
+				if (source.try_set_canceled()) {
+					timer_wheel::instance().cancel(id);
+				}
+			}));
+			delayed.on_completed([registration]() { registration->unregister(); });
+		}
+		return delayed;
+	}
+
+	static inline task<void> delay(timer_wheel::clock::duration duration, const cancellation_token& token = cancellation_token{})
+	{
+		return delay(default_executor(), duration, token);
+	}
+
+	// runs f on an executor every period until the token is canceled or f throws.
+	// the next run is timed from the previous deadline so the schedule doesn't drift, and a run that overlaps
+	// the next deadline skips the occurrences it missed instead of bursting to catch up.
+	template<typename F>
+	class periodic_schedule : public std::enable_shared_from_this<periodic_schedule<F>> {
+	private:
+		executor& exec;
+		timer_wheel::clock::duration period;
+		timer_wheel::clock::time_point next;
+		F func;
+		cancellation_token token;
+		task_completion_source<void> source;
+		cancellation_registration registration;
+		std::atomic<timer_wheel::timer_id> timer;
+
+		bool is_stopped() const { return source.get_task().is_completed(); }
+
+		void tick() {
+			if (is_stopped()) {
+				return;
+			}
+			if (token.is_cancellation_requested()) {
+				source.try_set_canceled();
+				return;
+			}
+
+			try {
+				func();
+			}
+			catch (const task_cancelled&) {
+				source.try_set_canceled();
+				return;
+			}
+			catch (...) {
+				source.try_set_exception(std::current_exception());
+				return;
+			}
+
+			const auto now = timer_wheel::clock::now();
+			next += period;
+			if (next <= now) {
+				next += period * ((now - next) / period + 1);
+			}
+			arm();
+		}
+
+		// a stop() racing with this either sees the new timer or is seen by the check after it.
+		void arm() {
+			auto self = this->shared_from_this();
+			timer.store(timer_wheel::instance().add(next, [self]() { self->exec.post([self]() { self->tick(); }); }));
+			if (is_stopped()) {
+				stop();
+			}
+		}
+
+	public:
+		periodic_schedule(executor& ex, timer_wheel::clock::time_point first, timer_wheel::clock::duration periodIn, F&& f, const cancellation_token& tokenIn)
+			:
+			exec(ex),
+			period(periodIn),
+			next(first),
+			func(std::move(f)),
+			token(tokenIn),
+			timer(0)
+		{
+		}
+
+		task<void> start() {
+			std::weak_ptr<periodic_schedule> weak = this->weak_from_this();
+			registration = token.register_callback([weak]() {
+				if (auto self = weak.lock()) {
+					self->stop();
+				}
+			});
+
+			if (!is_stopped()) {
+				arm();
+			}
+			return source.get_task();
+		}
+
+		void stop() {
+			source.try_set_canceled();
+			if (timer_wheel::timer_id id = timer.exchange(0)) {
+				timer_wheel::instance().cancel(id);
+			}
+		}
+	};
+
+	// the returned task never completes successfully: it is canceled with the token or faulted by f.
+	template<typename F>
+	static task<void> schedule_every(executor& ex, timer_wheel::clock::duration period, F&& f, const cancellation_token& token = cancellation_token{})
+	{
+		auto schedule = std::make_shared<periodic_schedule<std::decay_t<F>>>(ex, timer_wheel::clock::now() + period, period, std::decay_t<F>(std::forward<F>(f)), token);
+		return schedule->start();
+	}
+
+	template<typename F, typename = std::enable_if_t<!is_executor_v<F>>>
+	static task<void> schedule_every(timer_wheel::clock::duration period, F&& f, const cancellation_token& token = cancellation_token{})
+	{
+		return schedule_every(default_executor(), period, std::forward<F>(f), token);
+	}
+}
@@ -0,0 +1,244 @@
+#pragma once
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+
+namespace cpptask
+{
+	struct work_item {
+		virtual ~work_item() = default;
+
+		virtual void execute() = 0;
+
+		// called instead of execute by an executor that drops the item, see bounded_executor.
+		// either way the item is released afterwards.
+		virtual void abandon() { delete this; }
+	};
+
+	template<typename F>
+	struct function_work_item : work_item {
+		F func;
+
+		function_work_item(F&& f) : func(std::move(f)) {}
+
+		void execute() override {
+			func();
+			delete this;
+		}
+	};
+
+	template<typename F>
+	static work_item* make_work_item(F&& f) { return new function_work_item<std::decay_t<F>>(std::forward<F>(f)); }
+
+	// where a task runs. executors don't own the tasks posted to them;
+	// a task keeps a raw pointer to its executor, so the executor has to outlive it.
+	class executor {
+	protected:
+		inline static thread_local executor* current = nullptr;
+
+		struct current_scope {
+			executor* previous;
+
+			current_scope(executor* self) : previous(current) { current = self; }
+			~current_scope() { current = previous; }
+		};
+
+	public:
+		virtual ~executor() = default;
+
+		virtual void post(work_item* item) = 0;
+
+		template<typename F, typename = std::enable_if_t<!std::is_pointer_v<std::decay_t<F>>>>
+		void post(F&& f) { post(make_work_item(std::forward<F>(f))); }
+
+		// posts count items at once; executors that can enqueue them together override this.
+		virtual void post_batch(work_item* const* items, size_t count) {
+			for (size_t i = 0; i < count; ++i) {
+				post(items[i]);
+			}
+		}
+
+		// runs one queued item if the calling thread is allowed to execute this executor's work.
+		virtual bool run_one() { return false; }
+
+		// how many items may run at the same time, used to size the chunks of parallel algorithms.
+		virtual size_t concurrency() const { return 1; }
+
+		static executor* current_executor() { return current; }
+
+		// a thread owned by an executor that has to wait keeps executing queued work instead of parking,
+		// so a fixed number of threads can't deadlock on tasks waiting for tasks behind them in the queue.
+		template<typename Pred>
+		static bool help_while(Pred&& pending) {
+			executor* self = current;
+			if (self == nullptr) {
+				return false;
+			}
+
+			int idle_spins = 0;
+			while (pending()) {
+				if (self->run_one()) {
+					idle_spins = 0;
+				}
+				else if (++idle_spins < 64) {
+					std::this_thread::yield();
+				}
+				else {
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+			}
+			return true;
+		}
+	};
+
+	template<typename T>
+	static constexpr bool is_executor_v = std::is_base_of_v<executor, std::decay_t<T>>;
+
+	// runs the work on the posting thread, e.g. for latency critical continuations.
+	class inline_executor : public executor {
+	public:
+		using executor::post;
+
+		void post(work_item* item) override { item->execute(); }
+
+		static inline_executor& instance() {
+			static inline_executor instance;
+			return instance;
+		}
+	};
+
+	// one dedicated thread, for thread-affine work.
+	class single_thread_executor : public executor {
+	private:
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<work_item*> items;
+		bool stopping;
+		std::thread thread;
+
+		work_item* try_pop() {
+			std::lock_guard<std::mutex> lk(mtx);
+			if (items.empty()) {
+				return nullptr;
+			}
+
+			work_item* item = items.front();
+			items.pop_front();
+			return item;
+		}
+
+		void loop() {
+			current_scope scope(this);
+			while (true) {
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [this]() { return stopping || !items.empty(); });
+				if (items.empty()) {
+					break;
+				}
+
+				work_item* item = items.front();
+				items.pop_front();
+				lk.unlock();
+
+				item->execute();
+			}
+		}
+
+	public:
+		single_thread_executor() : stopping(false), thread([this]() { loop(); }) {}
+
+		~single_thread_executor() {
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				stopping = true;
+			}
+			cv.notify_one();
+			thread.join();
+		}
+
+		single_thread_executor(const single_thread_executor&) = delete;
+		single_thread_executor& operator=(const single_thread_executor&) = delete;
+
+		using executor::post;
+
+		void post(work_item* item) override {
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				items.push_back(item);
+			}
+			cv.notify_one();
+		}
+
+		bool run_one() override {
+			if (std::this_thread::get_id() != thread.get_id()) {
+				return false;
+			}
+
+			if (work_item* item = try_pop()) {
+				item->execute();
+				return true;
+			}
+			return false;
+		}
+
+		std::thread::id thread_id() const { return thread.get_id(); }
+	};
+
+	// queues work until someone drains it, for deterministic tests.
+	class manual_executor : public executor {
+	private:
+		mutable std::mutex mtx;
+		std::deque<work_item*> items;
+
+	public:
+		manual_executor() = default;
+
+		~manual_executor() {
+			for (auto* item : items) {
+				delete item;
+			}
+		}
+
+		manual_executor(const manual_executor&) = delete;
+		manual_executor& operator=(const manual_executor&) = delete;
+
+		using executor::post;
+
+		void post(work_item* item) override {
+			std::lock_guard<std::mutex> lk(mtx);
+			items.push_back(item);
+		}
+
+		bool run_one() override {
+			work_item* item = nullptr;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (items.empty()) {
+					return false;
+				}
+				item = items.front();
+				items.pop_front();
+			}
+
+			current_scope scope(this);
+			item->execute();
+			return true;
+		}
+
+		size_t drain() {
+			size_t count = 0;
+			while (run_one()) {
+				++count;
+			}
+			return count;
+		}
+
+		size_t pending() const {
+			std::lock_guard<std::mutex> lk(mtx);
+			return items.size();
+		}
+	};
+}
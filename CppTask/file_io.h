@@ -0,0 +1,478 @@
+#pragma once
+
+// asynchronous file I/O on Linux io_uring, talking to the kernel through its syscalls directly.
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+
+#include "task.h"
+
+namespace cpptask
+{
+	// one io_uring shared by the process. operations are prepared in its submission queue under a lock and handed to
+	// the kernel with one io_uring_enter for everything queued, or for a whole io_batch. a reaper thread waits for
+	// completions and completes each operation's task from there, so continuations are scheduled directly by the
+	// completion, without a thread blocked per operation.
+	// where io_uring can't be set up, e.g. an old kernel or a seccomp profile denying it, the same calls run the
+	// blocking syscall in a task on the default executor instead.
+	class io_ring {
+	private:
+		struct operation {
+			virtual ~operation() = default;
+
+			// result is what the syscall would have returned, or -errno; deletes the operation.
+			virtual void complete(int result) = 0;
+		};
+
+		template<typename T>
+		struct result_operation : operation {
+			task_completion_source<T> source;
+			const char* name;
+
+			result_operation(const char* nameIn) : name(nameIn) {}
+
+			void complete(int result) override {
+				if (result < 0) {
+					source.set_exception(std::make_exception_ptr(std::system_error(-result, std::system_category(), name)));
+				}
+				else if constexpr (std::is_void_v<T>) {
+					source.set_result();
+				}
+				else {
+					source.set_result(static_cast<T>(result));
+				}
+				delete this;
+			}
+		};
+
+		// the kernel reads the path when the operation runs, not when it is submitted.
+		struct open_operation : result_operation<int> {
+			std::string path;
+
+			open_operation(std::string pathIn) : result_operation<int>("openat"), path(std::move(pathIn)) {}
+		};
+
+		// wakes the reaper so it sees stopping.
+		static constexpr uint64_t wake_data = 0;
+
+		// a single read or write is cut to what the kernel transfers at once anyway.
+		static constexpr size_t max_transfer = 0x7ffff000;
+
+		int ring_fd;
+		void* sq_map;
+		size_t sq_map_size;
+		void* cq_map;
+		size_t cq_map_size;
+		io_uring_sqe* sqes;
+		size_t sqes_size;
+		unsigned* sq_head;
+		unsigned* sq_tail;
+		unsigned sq_mask;
+		unsigned sq_entries;
+		unsigned* cq_head;
+		unsigned* cq_tail;
+		unsigned cq_mask;
+		io_uring_cqe* cqes;
+
+		std::mutex mtx;
+		// prepared in the submission queue but not handed to the kernel yet.
+		unsigned queued;
+		bool buffers_registered;
+		std::atomic<bool> stopping;
+		std::thread reaper;
+
+		inline static thread_local size_t batch_depth = 0;
+
+		static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+			return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+		}
+
+		void unmap() {
+			if (sqes != nullptr) {
+				munmap(sqes, sqes_size);
+			}
+			if (cq_map != nullptr && cq_map != sq_map) {
+				munmap(cq_map, cq_map_size);
+			}
+			if (sq_map != nullptr) {
+				munmap(sq_map, sq_map_size);
+			}
+			if (ring_fd >= 0) {
+				close(ring_fd);
+			}
+			sqes = nullptr;
+			cq_map = nullptr;
+			sq_map = nullptr;
+			ring_fd = -1;
+		}
+
+		bool set_up(unsigned entries) {
+			io_uring_params params;
+			std::memset(&params, 0, sizeof(params));
+			// room for completions of several submission queues' worth of operations in flight.
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = entries * 4;
+			ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+			if (ring_fd < 0) {
+				return false;
+			}
+
+			sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			const bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (single_map) {
+				sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+			}
+
+			sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+			if (sq_map == MAP_FAILED) {
+				sq_map = nullptr;
+				return false;
+			}
+			cq_map = single_map ? sq_map : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			if (cq_map == MAP_FAILED) {
+				cq_map = nullptr;
+				return false;
+			}
+			sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+			void* sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+			if (sqe_map == MAP_FAILED) {
+				return false;
+			}
+			sqes = static_cast<io_uring_sqe*>(sqe_map);
+
+			char* sq = static_cast<char*>(sq_map);
+			sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+			sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			sq_entries = params.sq_entries;
+			// submission queue slot i always points at sqe i.
+			unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			for (unsigned i = 0; i < sq_entries; ++i) {
+				sq_array[i] = i;
+			}
+
+			char* cq = static_cast<char*>(cq_map);
+			cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+			cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+			return true;
+		}
+
+		// hands everything queued to the kernel, which copies the entries out during the call.
+		void flush_locked() {
+			while (queued != 0) {
+				const int submitted = enter(ring_fd, queued, 0, 0);
+				if (submitted >= 0) {
+					queued -= static_cast<unsigned>(submitted);
+				}
+				else if (errno == EAGAIN || errno == EBUSY || errno == EINTR) {
+					// the completion queue backed up; the reaper drains it.
+					std::this_thread::yield();
+				}
+				else {
+					throw std::system_error(errno, std::system_category(), "io_uring_enter");
+				}
+			}
+		}
+
+		// a free submission entry, zeroed; called under the lock.
+		io_uring_sqe& next_sqe() {
+			const unsigned tail = *sq_tail;
+			if (tail - std::atomic_ref<unsigned>(*sq_head).load(std::memory_order_acquire) >= sq_entries) {
+				flush_locked();
+			}
+			io_uring_sqe& sqe = sqes[tail & sq_mask];
+			std::memset(&sqe, 0, sizeof(sqe));
+			return sqe;
+		}
+
+		void publish_locked() {
+			std::atomic_ref<unsigned>(*sq_tail).fetch_add(1, std::memory_order_release);
+			++queued;
+			if (batch_depth == 0) {
+				flush_locked();
+			}
+		}
+
+		template<typename Op, typename Prepare>
+		auto submit(Op* op, Prepare&& prepare) {
+			auto result = op->source.get_task();
+			std::lock_guard<std::mutex> lk(mtx);
+			io_uring_sqe& sqe = next_sqe();
+			prepare(sqe);
+			sqe.user_data = reinterpret_cast<uint64_t>(static_cast<operation*>(op));
+			// if handing it over throws, the entry stays queued and goes with the next submission.
+			publish_locked();
+			return result;
+		}
+
+		void reap() {
+			while (!stopping.load(std::memory_order_acquire)) {
+				if (enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+					return;
+				}
+
+				unsigned head = *cq_head;
+				const unsigned tail = std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire);
+				while (head != tail) {
+					const io_uring_cqe cqe = cqes[head & cq_mask];
+					++head;
+					std::atomic_ref<unsigned>(*cq_head).store(head, std::memory_order_release);
+					if (cqe.user_data != wake_data) {
+						reinterpret_cast<operation*>(cqe.user_data)->complete(cqe.res);
+					}
+				}
+			}
+		}
+
+		template<typename T, typename F>
+		static task<T> run_blocking(const char* name, F&& f) {
+			return run_async([name, f = std::forward<F>(f)]() {
+				const auto result = f();
+				if (result < 0) {
+					throw std::system_error(errno, std::system_category(), name);
+				}
+				if constexpr (!std::is_void_v<T>) {
+					return static_cast<T>(result);
+				}
+			});
+		}
+
+	public:
+		explicit io_ring(unsigned entries = 256)
+			:
+			ring_fd(-1),
+			sq_map(nullptr),
+			sq_map_size(0),
+			cq_map(nullptr),
+			cq_map_size(0),
+			sqes(nullptr),
+			sqes_size(0),
+			sq_head(nullptr),
+			sq_tail(nullptr),
+			sq_mask(0),
+			sq_entries(0),
+			cq_head(nullptr),
+			cq_tail(nullptr),
+			cq_mask(0),
+			cqes(nullptr),
+			queued(0),
+			buffers_registered(false),
+			stopping(false)
+		{
+			if (!set_up(entries)) {
+				unmap();
+				return;
+			}
+			reaper = std::thread([this]() { reap(); });
+		}
+
+		// operations still in flight are dropped with the ring, their tasks never complete.
+		~io_ring() {
+			if (!available()) {
+				return;
+			}
+			stopping.store(true, std::memory_order_release);
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				io_uring_sqe& sqe = next_sqe();
+				sqe.opcode = IORING_OP_NOP;
+				sqe.user_data = wake_data;
+				std::atomic_ref<unsigned>(*sq_tail).fetch_add(1, std::memory_order_release);
+				++queued;
+				flush_locked();
+			}
+			reaper.join();
+			unmap();
+		}
+
+		io_ring(const io_ring&) = delete;
+		io_ring& operator=(const io_ring&) = delete;
+
+		static io_ring& instance() {
+			static io_ring instance;
+			return instance;
+		}
+
+		// false if the kernel refused io_uring; operations then run as blocking calls in tasks.
+		bool available() const { return ring_fd >= 0; }
+
+		// operations started on this thread while an io_batch lives are submitted together when the last one ends.
+		class io_batch {
+		private:
+			io_ring& ring;
+
+		public:
+			explicit io_batch(io_ring& ringIn = io_ring::instance()) : ring(ringIn) { ++batch_depth; }
+
+			~io_batch() {
+				if (--batch_depth == 0 && ring.available()) {
+					std::lock_guard<std::mutex> lk(ring.mtx);
+					try {
+						ring.flush_locked();
+					}
+					catch (...) {
+						// the entries stay queued and go with the next submission.
+					}
+				}
+			}
+
+			io_batch(const io_batch&) = delete;
+			io_batch& operator=(const io_batch&) = delete;
+		};
+
+		// pins buffers once for read_fixed and write_fixed, instead of the kernel mapping the memory on every
+		// operation. replaces buffers registered before; nothing may be in flight on the old ones.
+		void register_buffers(const std::vector<iovec>& buffers) {
+			if (!available()) {
+				return;
+			}
+			std::lock_guard<std::mutex> lk(mtx);
+			if (buffers_registered) {
+				syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+				buffers_registered = false;
+			}
+			if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), static_cast<unsigned>(buffers.size())) < 0) {
+				throw std::system_error(errno, std::system_category(), "io_uring_register");
+			}
+			buffers_registered = true;
+		}
+
+		void unregister_buffers() {
+			if (!available()) {
+				return;
+			}
+			std::lock_guard<std::mutex> lk(mtx);
+			if (buffers_registered) {
+				syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+				buffers_registered = false;
+			}
+		}
+
+		// completes with the new file descriptor.
+		task<int> open(const std::string& path, int flags, mode_t mode = 0644) {
+			if (!available()) {
+				return run_blocking<int>("openat", [path, flags, mode]() { return ::openat(AT_FDCWD, path.c_str(), flags, mode); });
+			}
+			auto* op = new open_operation(path);
+			return submit(op, [op, flags, mode](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_OPENAT;
+				sqe.fd = AT_FDCWD;
+				sqe.addr = reinterpret_cast<uint64_t>(op->path.c_str());
+				sqe.len = mode;
+				sqe.open_flags = static_cast<uint32_t>(flags);
+			});
+		}
+
+		// completes with the bytes read, 0 at the end of the file. buffer has to stay valid until then.
+		task<size_t> read(int fd, void* buffer, size_t length, uint64_t offset) {
+			if (!available()) {
+				return run_blocking<size_t>("pread", [fd, buffer, length, offset]() { return ::pread(fd, buffer, length, static_cast<off_t>(offset)); });
+			}
+			return submit(new result_operation<size_t>("read"), [=](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_READ;
+				sqe.fd = fd;
+				sqe.addr = reinterpret_cast<uint64_t>(buffer);
+				sqe.len = static_cast<uint32_t>(std::min(length, max_transfer));
+				sqe.off = offset;
+			});
+		}
+
+		// completes with the bytes written. buffer has to stay valid until then.
+		task<size_t> write(int fd, const void* buffer, size_t length, uint64_t offset) {
+			if (!available()) {
+				return run_blocking<size_t>("pwrite", [fd, buffer, length, offset]() { return ::pwrite(fd, buffer, length, static_cast<off_t>(offset)); });
+			}
+			return submit(new result_operation<size_t>("write"), [=](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_WRITE;
+				sqe.fd = fd;
+				sqe.addr = reinterpret_cast<uint64_t>(buffer);
+				sqe.len = static_cast<uint32_t>(std::min(length, max_transfer));
+				sqe.off = offset;
+			});
+		}
+
+		// like read, from inside the registered buffer at buffer_index.
+		task<size_t> read_fixed(int fd, void* buffer, size_t length, uint64_t offset, unsigned buffer_index) {
+			if (!available()) {
+				return read(fd, buffer, length, offset);
+			}
+			return submit(new result_operation<size_t>("read_fixed"), [=](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_READ_FIXED;
+				sqe.fd = fd;
+				sqe.addr = reinterpret_cast<uint64_t>(buffer);
+				sqe.len = static_cast<uint32_t>(std::min(length, max_transfer));
+				sqe.off = offset;
+				sqe.buf_index = static_cast<uint16_t>(buffer_index);
+			});
+		}
+
+		// like write, from inside the registered buffer at buffer_index.
+		task<size_t> write_fixed(int fd, const void* buffer, size_t length, uint64_t offset, unsigned buffer_index) {
+			if (!available()) {
+				return write(fd, buffer, length, offset);
+			}
+			return submit(new result_operation<size_t>("write_fixed"), [=](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_WRITE_FIXED;
+				sqe.fd = fd;
+				sqe.addr = reinterpret_cast<uint64_t>(buffer);
+				sqe.len = static_cast<uint32_t>(std::min(length, max_transfer));
+				sqe.off = offset;
+				sqe.buf_index = static_cast<uint16_t>(buffer_index);
+			});
+		}
+
+		task<void> fsync(int fd) {
+			if (!available()) {
+				return run_blocking<void>("fsync", [fd]() { return ::fsync(fd); });
+			}
+			return submit(new result_operation<void>("fsync"), [fd](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_FSYNC;
+				sqe.fd = fd;
+			});
+		}
+
+		task<void> close_file(int fd) {
+			if (!available()) {
+				return run_blocking<void>("close", [fd]() { return ::close(fd); });
+			}
+			return submit(new result_operation<void>("close"), [fd](io_uring_sqe& sqe) {
+				sqe.opcode = IORING_OP_CLOSE;
+				sqe.fd = fd;
+			});
+		}
+	};
+
+	using io_batch = io_ring::io_batch;
+
+	static inline task<int> async_open(const std::string& path, int flags, mode_t mode = 0644) { return io_ring::instance().open(path, flags, mode); }
+
+	static inline task<size_t> async_read(int fd, void* buffer, size_t length, uint64_t offset) { return io_ring::instance().read(fd, buffer, length, offset); }
+
+	static inline task<size_t> async_write(int fd, const void* buffer, size_t length, uint64_t offset) { return io_ring::instance().write(fd, buffer, length, offset); }
+
+	static inline task<size_t> async_read_fixed(int fd, void* buffer, size_t length, uint64_t offset, unsigned buffer_index) { return io_ring::instance().read_fixed(fd, buffer, length, offset, buffer_index); }
+
+	static inline task<size_t> async_write_fixed(int fd, const void* buffer, size_t length, uint64_t offset, unsigned buffer_index) { return io_ring::instance().write_fixed(fd, buffer, length, offset, buffer_index); }
+
+	static inline task<void> async_fsync(int fd) { return io_ring::instance().fsync(fd); }
+
+	static inline task<void> async_close(int fd) { return io_ring::instance().close_file(fd); }
+}
+#endif
@@ -7,14 +7,11 @@ namespace cpptask
     template<typename... Ts> struct make_void { typedef void type; };
     template<typename... Ts> using void_t = typename make_void<Ts...>::type;
 
-    template<typename R>
-    struct callable_t
-    {
-        virtual R operator()() const = 0;
-    };
+    // no members for types that aren't callable, so signatures using it drop out of overload resolution.
+    struct not_callable_traits {};
 
     template <typename T, typename = void>
-    struct function_traits : function_traits<std::decay_t<T>> {};
+    struct function_traits : std::conditional_t<std::is_same_v<T, std::decay_t<T>>, not_callable_traits, function_traits<std::decay_t<T>>> {};
 
     template <typename R, typename... A>
     struct function_traits<R(A...)>
@@ -59,24 +56,6 @@ namespace cpptask
         using FArgsType = typename function_traits<decltype(&T::operator())>::ArgsType;
     };
 
-    template<typename R, typename T>
-    struct gen_func_type
-    {
-        using type = void;
-    };
-
-    template<typename R, typename ...Args>
-    struct gen_func_type<R, std::tuple<Args...>>
-    {
-        using type = std::function<R(Args...)>;
-    };
-
-    template<typename T>
-    struct gen_param_type
-    {
-        using type = std::remove_reference_t<std::remove_cv_t<T>>;
-    };
-
     template<typename ...Args>
     struct decay_tuple_type
     {
@@ -88,16 +67,4 @@ namespace cpptask
     {
         using type = std::tuple<std::decay_t<Args>...>;
     };
-
-    template<typename T>
-    using gen_param_type_t = typename gen_param_type<T>::type;
-
-    template<typename F, typename ...Args>
-    struct gen_task_type
-    {
-        using Return = std::decay_t<typename function_traits<std::decay_t<F>>::ReturnType>;
-        using FArgs = typename function_traits<std::decay_t<F>>::FArgsType;
-        using Func = typename gen_func_type<Return, FArgs>::type;
-        using Tuple = std::tuple<gen_param_type_t<Args>...>;
-    };
 }
\ No newline at end of file
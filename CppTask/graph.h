@@ -0,0 +1,300 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <optional>
+#include <algorithm>
+#include <initializer_list>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+
+#include "task.h"
+
+namespace cpptask
+{
+	// a DAG of callables run on an executor, for work with many to many dependencies that then() chains can't express.
+	// a node runs once every node preceding it completed. a node that faults or is skipped skips its successors, and
+	// the run faults with an aggregate_exception of every node that threw. a canceled token skips the nodes that
+	// didn't start yet and cancels the run.
+	// nodes are ranked by the cost of the longest path from them to the end. when a node completes, its worker goes on
+	// with the highest ranked successor that became ready, so the critical path doesn't wait in a queue behind other
+	// work. the graph is laid out once on its first run; later runs only reset counters and allocate nothing but
+	// the returned task. a graph has to outlive its runs and can run once at a time.
+	class task_graph {
+	public:
+		using node = size_t;
+
+	private:
+		struct graph_node : work_item {
+			task_graph* graph;
+			size_t index;
+			task_function<void> body;
+			uint64_t cost;
+			uint64_t rank;
+			uint32_t dependencies;
+			// ascending by rank once the graph is laid out.
+			std::vector<graph_node*> successors;
+			std::atomic<uint32_t> remaining;
+			std::atomic<bool> skipped;
+			std::atomic<task_status> status;
+
+			graph_node(task_graph* graphIn, size_t indexIn, task_function<void>&& bodyIn, uint64_t costIn)
+				:
+				graph(graphIn),
+				index(indexIn),
+				body(std::move(bodyIn)),
+				cost(costIn),
+				rank(0),
+				dependencies(0),
+				remaining(0),
+				skipped(false),
+				status(created)
+			{
+			}
+
+			void execute() override { graph->run_node(this); }
+
+			// a node an executor drops cancels the run; its memory belongs to the graph.
+			void abandon() override {
+				graph->cancel_requested.store(true, std::memory_order_release);
+				graph->run_node(this);
+			}
+		};
+
+		struct cancel_hook : cancel_callback {
+			task_graph* graph = nullptr;
+
+			void invoke() override {
+				graph->cancel_requested.store(true, std::memory_order_release);
+				finish();
+			}
+		};
+
+		std::deque<graph_node> nodes;
+		// descending by rank, the most critical are queued first.
+		std::vector<work_item*> roots;
+		bool laid_out;
+
+		executor* exec;
+		std::atomic<bool> running;
+		std::atomic<bool> cancel_requested;
+		std::atomic<size_t> pending;
+		cancellation_token run_token;
+		cancel_hook hook;
+		bool hooked;
+		std::mutex fault_mtx;
+		aggregate_exception faults;
+		task_completion_source<void> completion;
+		std::optional<task<void>> last_run;
+
+		void throw_if_running() const {
+			if (running.load(std::memory_order_acquire)) {
+				throw std::logic_error("task_graph is running");
+			}
+		}
+
+		// ranks the nodes and orders the successors and roots by rank; throws on a cycle.
+		void lay_out() {
+			std::vector<graph_node*> order;
+			order.reserve(nodes.size());
+			std::vector<uint32_t> indegree;
+			indegree.reserve(nodes.size());
+			for (auto& n : nodes) {
+				indegree.push_back(n.dependencies);
+				if (n.dependencies == 0) {
+					order.push_back(&n);
+				}
+			}
+			for (size_t i = 0; i < order.size(); ++i) {
+				for (graph_node* s : order[i]->successors) {
+					if (--indegree[s->index] == 0) {
+						order.push_back(s);
+					}
+				}
+			}
+			if (order.size() != nodes.size()) {
+				throw std::logic_error("task_graph has a cycle");
+			}
+
+			for (auto it = order.rbegin(); it != order.rend(); ++it) {
+				graph_node* n = *it;
+				uint64_t longest = 0;
+				for (graph_node* s : n->successors) {
+					longest = std::max(longest, s->rank);
+				}
+				n->rank = n->cost + longest;
+			}
+
+			roots.clear();
+			for (auto& n : nodes) {
+				std::sort(n.successors.begin(), n.successors.end(), [](graph_node* lhs, graph_node* rhs) { return lhs->rank < rhs->rank; });
+				if (n.dependencies == 0) {
+					roots.push_back(&n);
+				}
+			}
+			std::sort(roots.begin(), roots.end(), [](work_item* lhs, work_item* rhs) { return static_cast<graph_node*>(lhs)->rank > static_cast<graph_node*>(rhs)->rank; });
+			laid_out = true;
+		}
+
+		// runs n and then, on this thread, the most critical successor it made ready, posting the others in
+		// ascending rank so a worker popping its own queue picks the next most critical one.
+		void run_node(graph_node* n) {
+			while (n != nullptr) {
+				task_status result = canceled;
+				if (!n->skipped.load(std::memory_order_relaxed) && !cancel_requested.load(std::memory_order_acquire)) {
+					try {
+						n->body();
+						result = completed;
+					}
+					catch (...) {
+						std::lock_guard<std::mutex> lk(fault_mtx);
+						faults.add_exception(std::current_exception());
+						result = faulted;
+					}
+				}
+				n->status.store(result, std::memory_order_relaxed);
+
+				graph_node* next = nullptr;
+				for (graph_node* s : n->successors) {
+					if (result != completed) {
+						s->skipped.store(true, std::memory_order_relaxed);
+					}
+					if (s->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+						if (next != nullptr) {
+							exec->post(next);
+						}
+						next = s;
+					}
+				}
+
+				if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					finish();
+					return;
+				}
+				n = next;
+			}
+		}
+
+		// the last thing a run does with the graph; after the completion the graph may be run again or destroyed.
+		void finish() {
+			if (hooked) {
+				run_token.deregister(&hook);
+				hooked = false;
+			}
+			run_token = cancellation_token{};
+
+			std::exception_ptr error;
+			if (faults.size() != 0) {
+				error = std::make_exception_ptr(std::move(faults));
+				faults = aggregate_exception();
+			}
+			const bool was_canceled = cancel_requested.load(std::memory_order_acquire);
+			auto source = std::move(completion);
+			running.store(false, std::memory_order_release);
+
+			if (error) {
+				source.set_exception(error);
+			}
+			else if (was_canceled) {
+				source.set_canceled();
+			}
+			else {
+				source.set_result();
+			}
+		}
+
+	public:
+		task_graph() : laid_out(false), exec(nullptr), running(false), cancel_requested(false), pending(0), hooked(false) {
+			hook.graph = this;
+		}
+
+		// waits for a run still going on.
+		~task_graph() {
+			if (last_run) {
+				last_run->wait();
+			}
+		}
+
+		task_graph(const task_graph&) = delete;
+		task_graph& operator=(const task_graph&) = delete;
+
+		// cost weighs the node on the critical path, e.g. its expected run time in any unit.
+		template<typename F>
+		node add(F&& f, uint64_t cost = 1) {
+			throw_if_running();
+			nodes.emplace_back(this, nodes.size(), task_function<void>(std::forward<F>(f)), cost);
+			laid_out = false;
+			return nodes.size() - 1;
+		}
+
+		// after runs once before completed.
+		void precede(node before, node after) {
+			throw_if_running();
+			nodes.at(before).successors.push_back(&nodes.at(after));
+			++nodes[after].dependencies;
+			laid_out = false;
+		}
+
+		void precede(node before, std::initializer_list<node> afters) {
+			for (node after : afters) {
+				precede(before, after);
+			}
+		}
+
+		size_t size() const { return nodes.size(); }
+
+		// how the node ended in the last run : completed, faulted, or canceled if it was skipped.
+		task_status status(node n) const { return nodes.at(n).status.load(std::memory_order_acquire); }
+
+		// the cost of the longest path from n to the end, known once the graph ran.
+		uint64_t rank(node n) const { return nodes.at(n).rank; }
+
+		task<void> run(executor& ex, const cancellation_token& token = cancellation_token{}) {
+			if (running.exchange(true, std::memory_order_acq_rel)) {
+				throw std::logic_error("task_graph is running");
+			}
+
+			try {
+				if (!laid_out) {
+					lay_out();
+				}
+			}
+			catch (...) {
+				running.store(false, std::memory_order_release);
+				throw;
+			}
+
+			exec = &ex;
+			completion = task_completion_source<void>(ex);
+			task<void> result = completion.get_task();
+			last_run = result;
+			for (auto& n : nodes) {
+				n.remaining.store(n.dependencies, std::memory_order_relaxed);
+				n.skipped.store(false, std::memory_order_relaxed);
+				n.status.store(created, std::memory_order_relaxed);
+			}
+			cancel_requested.store(false, std::memory_order_relaxed);
+			pending.store(nodes.size(), std::memory_order_relaxed);
+
+			run_token = token;
+			if (token.can_be_canceled()) {
+				hook.done.store(false, std::memory_order_relaxed);
+				hooked = token.try_register(&hook);
+				if (!hooked && token.is_cancellation_requested()) {
+					cancel_requested.store(true, std::memory_order_release);
+				}
+			}
+
+			if (nodes.empty()) {
+				finish();
+				return result;
+			}
+			ex.post_batch(roots.data(), roots.size());
+			return result;
+		}
+
+		task<void> run(const cancellation_token& token = cancellation_token{}) { return run(default_executor(), token); }
+	};
+}
@@ -1,6 +1,8 @@
 #include "task.h"
+#include "delay.h"
 #include <set>
 #include <chrono>
+#include <stdexcept>
 
 using namespace std;
 using namespace cpptask;
@@ -11,19 +13,21 @@ int test_num = 512;
 void test1();
 void test2();
 void test3();
+void test4();
 
 int main()
 {
 	//test1();
 	//test2();
 	test3();
+	//test4();
 
 	return 0;
 }
 
 void test1()
 {
-	auto t1 = make_task([]() { cout << "hello world" << endl; throw std::exception("noop"); });
+	auto t1 = make_task([]() { cout << "hello world" << endl; throw std::runtime_error("noop"); });
 	t1.start();
 
 	try {
@@ -52,7 +56,7 @@ void test1()
 		std::this_thread::sleep_for(std::chrono::seconds(1));
 		if (always)
 		{
-			throw std::exception("noop");
+			throw std::runtime_error("noop");
 		}
 	
 		return 10; 
@@ -68,9 +72,8 @@ void test1()
 
 void test2()
 {
-	auto t1 = run_async([]() {
-		std::this_thread::sleep_for(std::chrono::seconds(2));
-		throw std::exception("noop");
+	auto t1 = delay(std::chrono::seconds(2)).then([](task<void>& t) {
+		throw std::runtime_error("noop");
 	});
 
 	auto t2 = t1.then([](task<void>& t) {
@@ -106,15 +109,27 @@ void test2()
 
 void test3()
 {
-	auto e1 = run_async([]() { cout << "first task starts" << endl; throw std::exception("my exception"); });
+	auto e1 = run_async([]() { cout << "first task starts" << endl; throw std::runtime_error("my exception"); });
 	auto v1 = e1.then([](task<void>& t) {
 		if (t.is_faulted()) {
-			const auto& ex = t.exception();
-			for (const auto& e : ex) {
+			t.exception().for_each([](const std::exception& e) {
 				cout << e.what() << endl;
-			}
+			});
 		}
 	});
 
 	v1.wait();
-}
\ No newline at end of file
+}
+
+task<int> add_async(int a, int b)
+{
+	auto t = run_async([a, b]() { return a + b; });
+	int sum = co_await t;
+	co_return sum * 2;
+}
+
+void test4()
+{
+	auto t1 = add_async(1, 2);
+	cout << "coroutine result : " << t1.get() << endl;
+}
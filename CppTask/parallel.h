@@ -0,0 +1,268 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <exception>
+#include <iterator>
+#include <utility>
+#include <type_traits>
+#include <thread>
+
+#include "task.h"
+
+namespace cpptask
+{
+	// shared by all chunks of one parallel algorithm. a range of chunks is split lazily : it is halved a few times up
+	// front so every thread of the executor finds a piece, and after that only on demand, the upper half of what is
+	// left posted and the lower half kept. there is demand when no posted half is waiting to be taken, so workers
+	// that ran out of work have nothing to steal, and when a half was stolen, so the thief leaves a piece behind for
+	// the next one. cheap, even chunks are posted a few times per thread; slow or uneven ones keep being split for
+	// as long as workers go idle. posted halves land in the worker's own deque, where idle workers steal the
+	// biggest first.
+	template<typename F>
+	class parallel_region : public std::enable_shared_from_this<parallel_region<F>> {
+	private:
+		struct range_item : work_item {
+			std::shared_ptr<parallel_region> region;
+			size_t first;
+			size_t last;
+			std::thread::id poster;
+
+			range_item(std::shared_ptr<parallel_region>&& regionIn, size_t firstIn, size_t lastIn)
+				: region(std::move(regionIn)), first(firstIn), last(lastIn), poster(std::this_thread::get_id()) {}
+
+			void execute() override {
+				region->queued.fetch_sub(1, std::memory_order_relaxed);
+				region->run(first, last, poster != std::this_thread::get_id() ? 1 : 0);
+				region->leave();
+				delete this;
+			}
+
+			// the region waits for every half, so a dropped one runs on the dropping thread.
+			void abandon() override { execute(); }
+		};
+
+		executor& exec;
+		cancellation_token token;
+		F run_chunk;
+		std::atomic<size_t> pending;
+		// posted halves no worker took yet.
+		std::atomic<size_t> queued;
+		std::atomic<bool> stopped;
+		std::atomic<bool> canceled;
+		std::atomic<bool> faulted;
+		std::exception_ptr error;
+
+		void leave() {
+			if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				pending.notify_all();
+			}
+		}
+
+		void fail() {
+			if (!faulted.exchange(true, std::memory_order_acq_rel)) {
+				error = std::current_exception();
+			}
+			stopped.store(true, std::memory_order_release);
+		}
+
+		// posts the upper half of [first, last) and returns where the kept lower half ends.
+		size_t split(size_t first, size_t last) {
+			const size_t middle = first + (last - first) / 2;
+			pending.fetch_add(1, std::memory_order_relaxed);
+			queued.fetch_add(1, std::memory_order_relaxed);
+			exec.post(new range_item(this->shared_from_this(), middle, last));
+			return middle;
+		}
+
+	public:
+		parallel_region(executor& ex, const cancellation_token& tokenIn, F&& f)
+			:
+			exec(ex),
+			token(tokenIn),
+			run_chunk(std::move(f)),
+			pending(1),
+			queued(0),
+			stopped(false),
+			canceled(false),
+			faulted(false)
+		{
+		}
+
+		// splits runs up front, the rest on demand.
+		void run(size_t first, size_t last, size_t splits) {
+			for (; splits > 0 && last - first > 1 && !stopped.load(std::memory_order_relaxed); --splits) {
+				last = split(first, last);
+			}
+
+			for (size_t chunk = first; chunk < last; ++chunk) {
+				if (stopped.load(std::memory_order_relaxed)) {
+					return;
+				}
+				if (token.is_cancellation_requested()) {
+					canceled.store(true, std::memory_order_relaxed);
+					stopped.store(true, std::memory_order_release);
+					return;
+				}
+
+				try {
+					run_chunk(chunk);
+				}
+				catch (...) {
+					fail();
+				}
+
+				if (last - chunk > 2 && queued.load(std::memory_order_relaxed) == 0) {
+					last = split(chunk + 1, last);
+				}
+			}
+		}
+
+		// runs the whole range with the calling thread taking part, then waits for the posted halves.
+		// the first exception thrown by a chunk is rethrown here; skipped chunks throw task_cancelled.
+		void run_all(size_t chunk_count, size_t splits) {
+			run(0, chunk_count, splits);
+			leave();
+
+			auto busy = [this]() { return pending.load(std::memory_order_acquire) != 0; };
+			if (!executor::help_while(busy)) {
+				for (size_t count = pending.load(std::memory_order_acquire); count != 0; count = pending.load(std::memory_order_acquire)) {
+					pending.wait(count, std::memory_order_acquire);
+				}
+			}
+
+			if (faulted.load(std::memory_order_acquire)) {
+				std::rethrow_exception(error);
+			}
+			if (canceled.load(std::memory_order_relaxed)) {
+				throw task_cancelled();
+			}
+		}
+	};
+
+	// a grain of 0 picks one fine enough that splitting on demand can balance uneven chunks, about 64 chunks
+	// per thread of the executor. running a chunk costs a call and an atomic load, posting one only happens on demand.
+	static inline size_t parallel_grain(executor& ex, size_t count, size_t grain)
+	{
+		if (grain != 0) {
+			return grain;
+		}
+
+		const size_t chunks = ex.concurrency() * 64;
+		return count <= chunks ? 1 : (count + chunks - 1) / chunks;
+	}
+
+	// enough up front splits for two pieces per thread of the executor.
+	static inline size_t parallel_splits(executor& ex)
+	{
+		size_t splits = 1;
+		while ((size_t(1) << splits) < ex.concurrency() * 2) {
+			++splits;
+		}
+		return splits;
+	}
+
+	template<typename F>
+	static void parallel_chunks(executor& ex, size_t chunk_count, const cancellation_token& token, F&& run_chunk, size_t splits)
+	{
+		if (chunk_count == 0) {
+			token.throw_if_cancellation_requested();
+			return;
+		}
+
+		auto region = std::make_shared<parallel_region<std::decay_t<F>>>(ex, token, std::forward<F>(run_chunk));
+		region->run_all(chunk_count, splits);
+	}
+
+	template<typename F>
+	static void parallel_chunks(executor& ex, size_t chunk_count, const cancellation_token& token, F&& run_chunk)
+	{
+		parallel_chunks(ex, chunk_count, token, std::forward<F>(run_chunk), parallel_splits(ex));
+	}
+
+	// calls body(i) for every i in [begin, end), or body(first, last) once per chunk if it takes a sub range.
+	// works for integers and random access iterators.
+	template<typename Index, typename Body>
+	static void parallel_for(executor& ex, Index begin, Index end, size_t grain, Body&& body, const cancellation_token& token = cancellation_token{})
+	{
+		const size_t count = end > begin ? static_cast<size_t>(end - begin) : 0;
+		grain = parallel_grain(ex, count, grain);
+
+		parallel_chunks(ex, (count + grain - 1) / grain, token, [&](size_t chunk) {
+			const size_t offset = chunk * grain;
+			const Index first = begin + static_cast<std::ptrdiff_t>(offset);
+			const Index last = begin + static_cast<std::ptrdiff_t>(offset + grain < count ? offset + grain : count);
+			if constexpr (std::is_invocable_v<Body&, Index, Index>) {
+				body(first, last);
+			}
+			else {
+				for (Index i = first; i != last; ++i) {
+					body(i);
+				}
+			}
+		});
+	}
+
+	template<typename Index, typename Body>
+	static void parallel_for(Index begin, Index end, size_t grain, Body&& body, const cancellation_token& token = cancellation_token{})
+	{
+		parallel_for(default_executor(), begin, end, grain, std::forward<Body>(body), token);
+	}
+
+	template<typename Index, typename Body, typename = std::enable_if_t<!std::is_convertible_v<Body, size_t>>>
+	static void parallel_for(Index begin, Index end, Body&& body, const cancellation_token& token = cancellation_token{})
+	{
+		parallel_for(default_executor(), begin, end, 0, std::forward<Body>(body), token);
+	}
+
+	// body(first, last, init) folds a chunk starting from init, reduce(lhs, rhs) joins two partial results.
+	// partial results are joined in index order, so reduce only has to be associative.
+	template<typename Index, typename T, typename Body, typename Reduce>
+	static T parallel_reduce(executor& ex, Index begin, Index end, size_t grain, T identity, Body&& body, Reduce&& reduce, const cancellation_token& token = cancellation_token{})
+	{
+		const size_t count = end > begin ? static_cast<size_t>(end - begin) : 0;
+		grain = parallel_grain(ex, count, grain);
+
+		const size_t chunk_count = (count + grain - 1) / grain;
+		std::vector<std::optional<T>> partials(chunk_count);
+		parallel_chunks(ex, chunk_count, token, [&](size_t chunk) {
+			const size_t offset = chunk * grain;
+			const Index first = begin + static_cast<std::ptrdiff_t>(offset);
+			const Index last = begin + static_cast<std::ptrdiff_t>(offset + grain < count ? offset + grain : count);
+			partials[chunk].emplace(body(first, last, identity));
+		});
+
+		T result = std::move(identity);
+		for (auto& partial : partials) {
+			result = reduce(std::move(result), std::move(*partial));
+		}
+		return result;
+	}
+
+	template<typename Index, typename T, typename Body, typename Reduce>
+	static T parallel_reduce(Index begin, Index end, size_t grain, T identity, Body&& body, Reduce&& reduce, const cancellation_token& token = cancellation_token{})
+	{
+		return parallel_reduce(default_executor(), begin, end, grain, std::move(identity), std::forward<Body>(body), std::forward<Reduce>(reduce), token);
+	}
+
+	// runs the functions concurrently and returns once all of them returned.
+	template<typename ...F>
+	static void parallel_invoke(executor& ex, F&&... funcs)
+	{
+		// every call is posted up front, they are few and each may be long.
+		auto calls = std::forward_as_tuple(funcs...);
+		parallel_chunks(ex, sizeof...(F), cancellation_token{}, [&calls](size_t chunk) {
+			std::apply([chunk](auto&... f) {
+				size_t index = 0;
+				((index++ == chunk ? (void)f() : (void)0), ...);
+			}, calls);
+		}, sizeof...(F));
+	}
+
+	template<typename F, typename = std::enable_if_t<!is_executor_v<F>>, typename ...Fs>
+	static void parallel_invoke(F&& f, Fs&&... funcs)
+	{
+		parallel_invoke(default_executor(), std::forward<F>(f), std::forward<Fs>(funcs)...);
+	}
+}
@@ -0,0 +1,416 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <optional>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "task.h"
+
+namespace cpptask
+{
+	enum class stage_mode
+	{
+		// any number of items in the stage at once.
+		parallel,
+		// one item at a time, in the order the source produced them.
+		serial_in_order,
+		// one item at a time, in the order they arrive.
+		serial_out_of_order,
+	};
+
+	// handed to the source of a pipeline, which calls stop() instead of producing an item once its input ran out.
+	class flow_control {
+	private:
+		bool stopped = false;
+
+	public:
+		void stop() { stopped = true; }
+
+		bool is_stopped() const { return stopped; }
+	};
+
+	// a stage of a pipeline. an item in flight holds a token, the index of the slot its value occupies in every stage.
+	class pipeline_stage {
+	private:
+		struct waiting_item {
+			size_t sequence;
+			size_t token;
+		};
+
+		std::mutex mtx;
+		bool busy = false;
+		size_t next_sequence = 0;
+		std::vector<waiting_item> waiting;
+
+	public:
+		stage_mode mode;
+
+		pipeline_stage(stage_mode modeIn) : mode(modeIn) {}
+
+		virtual ~pipeline_stage() = default;
+
+		virtual void prepare(size_t max_tokens) {
+			waiting.reserve(max_tokens);
+			busy = false;
+			next_sequence = 0;
+		}
+
+		// consumes the input value of token and stores its output.
+		virtual void process(size_t token) = 0;
+
+		// drops the input value of token without processing it.
+		virtual void discard(size_t token) = 0;
+
+		// the source only : stores a new value at token, false once the source stopped.
+		virtual bool produce(size_t) { return false; }
+
+		// serial stages only : false if the item has to wait, then it is handed out by leave() once it's its turn.
+		bool try_enter(size_t sequence, size_t token) {
+			std::lock_guard<std::mutex> lk(mtx);
+			if (!busy && (mode == stage_mode::serial_out_of_order || sequence == next_sequence)) {
+				busy = true;
+				return true;
+			}
+			waiting.push_back({ sequence, token });
+			return false;
+		}
+
+		// the item in the stage leaves; returns true with the token of the waiting item that enters next, if any.
+		bool leave(size_t& token) {
+			std::lock_guard<std::mutex> lk(mtx);
+			++next_sequence;
+			for (size_t i = 0; i < waiting.size(); ++i) {
+				if (mode == stage_mode::serial_out_of_order || waiting[i].sequence == next_sequence) {
+					token = waiting[i].token;
+					waiting.erase(waiting.begin() + static_cast<std::ptrdiff_t>(i));
+					return true;
+				}
+			}
+			busy = false;
+			return false;
+		}
+	};
+
+	template<typename T>
+	class pipeline_output : public pipeline_stage {
+	public:
+		std::vector<std::optional<T>> slots;
+
+		pipeline_output(stage_mode modeIn) : pipeline_stage(modeIn) {}
+
+		void prepare(size_t max_tokens) override {
+			pipeline_stage::prepare(max_tokens);
+			slots.clear();
+			slots.resize(max_tokens);
+		}
+	};
+
+	template<>
+	class pipeline_output<void> : public pipeline_stage {
+	public:
+		pipeline_output(stage_mode modeIn) : pipeline_stage(modeIn) {}
+	};
+
+	// the first stage. it runs serially and numbers the items it produces, which in order stages go by.
+	template<typename T, typename F>
+	class pipeline_source : public pipeline_output<T> {
+	private:
+		F body;
+
+	public:
+		pipeline_source(F&& f) : pipeline_output<T>(stage_mode::serial_in_order), body(std::move(f)) {}
+
+		bool produce(size_t token) override {
+			flow_control control;
+			T value = body(control);
+			if (control.is_stopped()) {
+				return false;
+			}
+			this->slots[token].emplace(std::move(value));
+			return true;
+		}
+
+		void process(size_t) override {}
+
+		void discard(size_t token) override { this->slots[token].reset(); }
+	};
+
+	template<typename In, typename Out, typename F>
+	class pipeline_transform : public pipeline_output<Out> {
+	private:
+		pipeline_output<In>* input;
+		F body;
+
+	public:
+		pipeline_transform(stage_mode modeIn, pipeline_output<In>* inputIn, F&& f) : pipeline_output<Out>(modeIn), input(inputIn), body(std::move(f)) {}
+
+		void process(size_t token) override {
+			auto& slot = input->slots[token];
+			if constexpr (std::is_void_v<Out>) {
+				body(std::move(*slot));
+			}
+			else {
+				this->slots[token].emplace(body(std::move(*slot)));
+			}
+			slot.reset();
+		}
+
+		void discard(size_t token) override { input->slots[token].reset(); }
+	};
+
+	// the state of one run. the thread that produced an item carries it through the stages as far as it can;
+	// an item that has to wait at a serial stage is posted again by the item leaving that stage. at most
+	// max_tokens items are in flight, the source produces the next one when an item left the last stage.
+	// a fault or cancellation stops the source, and the items in flight pass the remaining stages without running.
+	class pipeline_run : public std::enable_shared_from_this<pipeline_run> {
+	private:
+		executor& exec;
+		std::vector<std::unique_ptr<pipeline_stage>> stages;
+		size_t max_tokens;
+		cancellation_token cancel_token;
+		cancellation_registration registration;
+		task_completion_source<void> completion;
+
+		// sequence numbers of the items holding each token.
+		std::vector<size_t> sequence;
+		size_t next_sequence;
+
+		std::mutex mtx;
+		std::vector<size_t> free_tokens;
+		bool producing;
+		bool exhausted;
+		bool finished;
+		std::atomic<bool> failed;
+		std::exception_ptr error;
+
+		bool take_finish_locked() {
+			if (finished || !exhausted || producing || free_tokens.size() != max_tokens) {
+				return false;
+			}
+			finished = true;
+			return true;
+		}
+
+		void finish() {
+			if (error) {
+				completion.set_exception(error);
+			}
+			else if (failed.load(std::memory_order_acquire)) {
+				completion.set_canceled();
+			}
+			else {
+				completion.set_result();
+			}
+		}
+
+		// a null e cancels the run.
+		void fail(std::exception_ptr e) {
+			bool done = false;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (!failed.load(std::memory_order_relaxed)) {
+					error = std::move(e);
+					failed.store(true, std::memory_order_release);
+				}
+				exhausted = true;
+				done = take_finish_locked();
+			}
+			if (done) {
+				finish();
+			}
+		}
+
+		bool is_stopping() {
+			if (cancel_token.is_cancellation_requested()) {
+				fail(nullptr);
+			}
+			return failed.load(std::memory_order_acquire);
+		}
+
+		void schedule_source() {
+			size_t token = 0;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (producing || exhausted || free_tokens.empty()) {
+					return;
+				}
+				producing = true;
+				token = free_tokens.back();
+				free_tokens.pop_back();
+			}
+			exec.post([self = shared_from_this(), token]() { self->produce(token); });
+		}
+
+		void produce(size_t token) {
+			bool produced = false;
+			if (!is_stopping()) {
+				try {
+					produced = stages[0]->produce(token);
+				}
+				catch (...) {
+					fail(std::current_exception());
+				}
+			}
+
+			if (!produced) {
+				bool done = false;
+				{
+					std::lock_guard<std::mutex> lk(mtx);
+					producing = false;
+					exhausted = true;
+					free_tokens.push_back(token);
+					done = take_finish_locked();
+				}
+				if (done) {
+					finish();
+				}
+				return;
+			}
+
+			sequence[token] = next_sequence++;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				producing = false;
+			}
+			schedule_source();
+			carry(token, 1, false);
+		}
+
+		void run_stage(pipeline_stage& stage, size_t token) {
+			if (is_stopping()) {
+				stage.discard(token);
+				return;
+			}
+
+			try {
+				stage.process(token);
+			}
+			catch (...) {
+				stage.discard(token);
+				fail(std::current_exception());
+			}
+		}
+
+		void carry(size_t token, size_t index, bool entered) {
+			for (; index < stages.size(); ++index, entered = false) {
+				pipeline_stage& stage = *stages[index];
+				const bool serial = stage.mode != stage_mode::parallel;
+				if (serial && !entered && !stage.try_enter(sequence[token], token)) {
+					return;
+				}
+
+				run_stage(stage, token);
+
+				size_t next = 0;
+				if (serial && stage.leave(next)) {
+					exec.post([self = shared_from_this(), next, index]() { self->carry(next, index, true); });
+				}
+			}
+			release(token);
+		}
+
+		void release(size_t token) {
+			bool done = false;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				free_tokens.push_back(token);
+				done = take_finish_locked();
+			}
+			if (done) {
+				finish();
+			}
+			else {
+				schedule_source();
+			}
+		}
+
+	public:
+		pipeline_run(executor& ex, std::vector<std::unique_ptr<pipeline_stage>>&& stagesIn, size_t max_tokensIn, const cancellation_token& token)
+			:
+			exec(ex),
+			stages(std::move(stagesIn)),
+			max_tokens(max_tokensIn != 0 ? max_tokensIn : 1),
+			cancel_token(token),
+			completion(ex),
+			sequence(max_tokens),
+			next_sequence(0),
+			producing(false),
+			exhausted(false),
+			finished(false),
+			failed(false)
+		{
+			free_tokens.reserve(max_tokens);
+			for (size_t i = max_tokens; i-- > 0;) {
+				free_tokens.push_back(i);
+			}
+			for (auto& stage : stages) {
+				stage->prepare(max_tokens);
+			}
+		}
+
+		task<void> start() {
+			auto result = completion.get_task();
+			std::weak_ptr<pipeline_run> weak = weak_from_this();
+			registration = cancel_token.register_callback([weak]() {
+				if (auto self = weak.lock()) {
+					self->fail(nullptr);
+				}
+			});
+			schedule_source();
+			return result;
+		}
+	};
+
+	// stages built on a source, typed by the value the last stage yields; a pipeline ends with a stage yielding void.
+	//   make_pipeline(read).stage(stage_mode::parallel, parse).stage(stage_mode::serial_in_order, write).run(8);
+	template<typename T>
+	class pipeline {
+		template<typename> friend class pipeline;
+	private:
+		std::vector<std::unique_ptr<pipeline_stage>> stages;
+		pipeline_output<T>* tail;
+
+		pipeline(std::vector<std::unique_ptr<pipeline_stage>>&& stagesIn, pipeline_output<T>* tailIn) : stages(std::move(stagesIn)), tail(tailIn) {}
+
+	public:
+		// source(flow_control&) returns the next item, or calls stop() on the flow_control.
+		template<typename F>
+		explicit pipeline(F&& source) {
+			auto first = std::make_unique<pipeline_source<T, std::decay_t<F>>>(std::decay_t<F>(std::forward<F>(source)));
+			tail = first.get();
+			stages.push_back(std::move(first));
+		}
+
+		template<typename F, typename U = T, typename R = std::invoke_result_t<std::decay_t<F>&, U&&>>
+		pipeline<R> stage(stage_mode mode, F&& f) && {
+			static_assert(!std::is_void_v<T>, "a pipeline ends with its first stage yielding void");
+			auto next = std::make_unique<pipeline_transform<T, R, std::decay_t<F>>>(mode, tail, std::decay_t<F>(std::forward<F>(f)));
+			auto* next_tail = next.get();
+			stages.push_back(std::move(next));
+			return pipeline<R>(std::move(stages), next_tail);
+		}
+
+		// runs the stage bodies on ex with at most max_tokens items in flight; the task completes once the source
+		// stopped and every item left the pipeline, faults with the first exception a stage threw, or is canceled.
+		task<void> run(executor& ex, size_t max_tokens, const cancellation_token& token = cancellation_token{}) && {
+			static_assert(std::is_void_v<T>, "the last stage of a pipeline has to yield void");
+			return std::make_shared<pipeline_run>(ex, std::move(stages), max_tokens, token)->start();
+		}
+
+		task<void> run(size_t max_tokens, const cancellation_token& token = cancellation_token{}) && {
+			return std::move(*this).run(default_executor(), max_tokens, token);
+		}
+	};
+
+	template<typename F>
+	static auto make_pipeline(F&& source)
+	{
+		using T = std::invoke_result_t<std::decay_t<F>&, flow_control&>;
+		return pipeline<T>(std::forward<F>(source));
+	}
+}
@@ -0,0 +1,553 @@
+#pragma once
+
+// asynchronous sockets on a Linux epoll reactor.
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+
+#include "task.h"
+
+namespace cpptask
+{
+	class async_socket;
+
+	// an epoll instance and a thread waiting on it. a socket is registered once, edge triggered for both directions.
+	// an operation runs its syscall right away on the thread starting it, and only one that would block waits for
+	// the next edge; the reactor thread then posts the side to the executor to try its waiting operations again
+	// there, so neither syscalls on sockets nor continuations ever run on the reactor thread.
+	// each side of a socket is a queue : an operation started while others wait on its side queues behind them
+	// without trying, and only the head of a side runs its syscall, so operations complete in the order they started.
+	// sockets share one reactor by default. a server may create one per core and spread its sockets over them.
+	class reactor {
+		friend class async_socket;
+	private:
+		enum side { read_side = 0, write_side = 1 };
+
+		struct socket_op {
+			cancellation_token token;
+			cancellation_registration registration;
+
+			virtual ~socket_op() = default;
+
+			// runs the syscall once under the socket's lock; false if it would block.
+			virtual bool attempt(int fd) = 0;
+
+			// completes the task with what the attempt returning true got.
+			virtual void finish() = 0;
+
+			virtual void cancel() = 0;
+		};
+
+		struct socket_state : std::enable_shared_from_this<socket_state> {
+			reactor* owner;
+			// written under mtx, read without it by is_open() and native_handle().
+			std::atomic<int> fd;
+			std::mutex mtx;
+			bool closed;
+			// operations that would block, per side, in the order they started; the head is the one that blocked.
+			std::deque<std::shared_ptr<socket_op>> waiting[2];
+			// a resume of the side is posted and didn't take the lock yet.
+			bool resuming[2];
+
+			socket_state(reactor* ownerIn, int fdIn) : owner(ownerIn), fd(fdIn), closed(false), resuming{ false, false } {}
+		};
+
+		executor& exec;
+		int epoll_fd;
+		int wake_fd;
+		std::atomic<bool> stopping;
+		// closed sockets, freed by the reactor thread once no event it already took can point at them.
+		std::mutex retire_mtx;
+		std::vector<std::shared_ptr<socket_state>> retired;
+		std::thread loop_thread;
+
+		static constexpr int max_events = 256;
+
+		std::shared_ptr<socket_state> attach(int fd) {
+			const int flags = fcntl(fd, F_GETFL);
+			if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+				throw std::system_error(errno, std::system_category(), "fcntl");
+			}
+			auto state = std::make_shared<socket_state>(this, fd);
+			epoll_event ev;
+			std::memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = state.get();
+			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				throw std::system_error(errno, std::system_category(), "epoll_ctl");
+			}
+			return state;
+		}
+
+		// closes the socket; the operations waiting on it are canceled.
+		void detach(socket_state& state) {
+			std::deque<std::shared_ptr<socket_op>> dropped;
+			{
+				std::lock_guard<std::mutex> lk(state.mtx);
+				if (state.closed) {
+					return;
+				}
+				state.closed = true;
+				for (auto& waiting : state.waiting) {
+					std::move(waiting.begin(), waiting.end(), std::back_inserter(dropped));
+					waiting.clear();
+				}
+				const int fd = state.fd.exchange(-1, std::memory_order_acq_rel);
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+				::close(fd);
+			}
+			{
+				std::lock_guard<std::mutex> lk(retire_mtx);
+				retired.push_back(state.shared_from_this());
+			}
+			for (auto& op : dropped) {
+				op->registration.unregister();
+				op->cancel();
+			}
+		}
+
+		template<typename Op>
+		auto start(const std::shared_ptr<socket_state>& state, const std::shared_ptr<Op>& op, side s, const cancellation_token& token) {
+			auto result = op->source.get_task();
+			if (token.can_be_canceled()) {
+				op->token = token;
+				std::weak_ptr<socket_state> weak_state = state;
+				std::weak_ptr<socket_op> weak_op = op;
+				op->registration = token.register_callback([weak_state, weak_op, s]() {
+					auto state = weak_state.lock();
+					auto op = weak_op.lock();
+					if (state != nullptr && op != nullptr) {
+						state->owner->withdraw(*state, op, s);
+					}
+				});
+			}
+			drive(state, op, s);
+			return result;
+		}
+
+		// tries a new operation unless others wait on its side, then it queues behind them untried.
+		// holding the lock through the attempt orders it with the edges: an edge the attempt missed is handed
+		// out after the operation is queued, and finds it.
+		void drive(const std::shared_ptr<socket_state>& state, const std::shared_ptr<socket_op>& op, side s) {
+			bool done = false;
+			{
+				std::lock_guard<std::mutex> lk(state->mtx);
+				if (!state->closed) {
+					auto& waiting = state->waiting[s];
+					done = waiting.empty() && op->attempt(state->fd.load(std::memory_order_relaxed));
+					// a token canceled meanwhile found nothing to withdraw.
+					if (!done && !op->token.is_cancellation_requested()) {
+						waiting.push_back(op);
+						return;
+					}
+				}
+			}
+			op->registration.unregister();
+			if (done) {
+				op->finish();
+			}
+			else {
+				op->cancel();
+			}
+		}
+
+		// the operations behind a withdrawn head may never have been tried, so the side is tried again.
+		void withdraw(socket_state& state, const std::shared_ptr<socket_op>& op, side s) {
+			bool was_head = false;
+			{
+				std::lock_guard<std::mutex> lk(state.mtx);
+				auto& waiting = state.waiting[s];
+				auto found = std::find(waiting.begin(), waiting.end(), op);
+				if (found == waiting.end()) {
+					return;
+				}
+				was_head = found == waiting.begin();
+				waiting.erase(found);
+			}
+			op->cancel();
+			if (was_head) {
+				wake_side(state, s);
+			}
+		}
+
+		// tries the waiting operations of a side in order up to the first that would still block. with edge
+		// triggering no edge comes for what the head left readable or writable, so the ones behind it go on at once.
+		void resume(const std::shared_ptr<socket_state>& state, side s) {
+			std::vector<std::shared_ptr<socket_op>> done;
+			{
+				std::lock_guard<std::mutex> lk(state->mtx);
+				state->resuming[s] = false;
+				auto& waiting = state->waiting[s];
+				while (!state->closed && !waiting.empty() && waiting.front()->attempt(state->fd.load(std::memory_order_relaxed))) {
+					done.push_back(std::move(waiting.front()));
+					waiting.pop_front();
+				}
+			}
+			for (auto& op : done) {
+				op->registration.unregister();
+				op->finish();
+			}
+		}
+
+		// posts one resume of the side however many edges come before it ran.
+		void wake_side(socket_state& state, side s) {
+			{
+				std::lock_guard<std::mutex> lk(state.mtx);
+				if (state.waiting[s].empty() || state.resuming[s]) {
+					return;
+				}
+				state.resuming[s] = true;
+			}
+			exec.post([self = state.shared_from_this(), s]() { self->owner->resume(self, s); });
+		}
+
+		void run_loop() {
+			epoll_event events[max_events];
+			std::vector<std::shared_ptr<socket_state>> released;
+			while (!stopping.load(std::memory_order_acquire)) {
+				const int count = epoll_wait(epoll_fd, events, max_events, -1);
+				if (count < 0 && errno != EINTR) {
+					return;
+				}
+				for (int i = 0; i < count; ++i) {
+					auto* state = static_cast<socket_state*>(events[i].data.ptr);
+					if (state == nullptr) {
+						uint64_t value = 0;
+						[[maybe_unused]] auto n = ::read(wake_fd, &value, sizeof(value));
+						continue;
+					}
+					const uint32_t flags = events[i].events;
+					if ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
+						wake_side(*state, read_side);
+					}
+					if ((flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0) {
+						wake_side(*state, write_side);
+					}
+				}
+
+				// removed from epoll before this point, they can't turn up in a later wait.
+				{
+					std::lock_guard<std::mutex> lk(retire_mtx);
+					released.swap(retired);
+				}
+				released.clear();
+			}
+		}
+
+	public:
+		explicit reactor(executor& ex = default_executor()) : exec(ex), epoll_fd(-1), wake_fd(-1), stopping(false) {
+			epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			if (epoll_fd < 0) {
+				throw std::system_error(errno, std::system_category(), "epoll_create1");
+			}
+			wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			epoll_event ev;
+			std::memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.ptr = nullptr;
+			if (wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+				const int error = errno;
+				if (wake_fd >= 0) {
+					::close(wake_fd);
+				}
+				::close(epoll_fd);
+				throw std::system_error(error, std::system_category(), "eventfd");
+			}
+			loop_thread = std::thread([this]() { run_loop(); });
+		}
+
+		// sockets have to be closed before their reactor goes.
+		~reactor() {
+			stopping.store(true, std::memory_order_release);
+			const uint64_t one = 1;
+			[[maybe_unused]] auto n = ::write(wake_fd, &one, sizeof(one));
+			loop_thread.join();
+			::close(wake_fd);
+			::close(epoll_fd);
+		}
+
+		reactor(const reactor&) = delete;
+		reactor& operator=(const reactor&) = delete;
+
+		static reactor& instance() {
+			static reactor instance;
+			return instance;
+		}
+
+		executor& get_executor() const { return exec; }
+	};
+
+	// a socket registered with a reactor. copies share the socket, which is closed with the last of them or by close().
+	// operations complete on the reactor's executor and are canceled by their token while they wait, or when the
+	// socket is closed. the operations on one side of a socket run one after the other in the order they started,
+	// so concurrent sends don't interleave their bytes and concurrent receives take the stream in turn.
+	class async_socket {
+	private:
+		template<typename T>
+		struct result_op : reactor::socket_op {
+			task_completion_source<T> source;
+			const char* name;
+			int error;
+			T value;
+
+			result_op(executor& ex, const char* nameIn) : source(ex), name(nameIn), error(0), value() {}
+
+			// errno of a call that neither went through nor would block.
+			bool fail(int e) {
+				error = e;
+				return true;
+			}
+
+			void finish() override {
+				if (error != 0) {
+					source.try_set_exception(std::make_exception_ptr(std::system_error(error, std::system_category(), name)));
+				}
+				else {
+					source.try_set_result(std::move(value));
+				}
+			}
+
+			void cancel() override { source.try_set_canceled(); }
+		};
+
+		struct receive_op : result_op<size_t> {
+			void* buffer;
+			size_t length;
+
+			receive_op(executor& ex, void* bufferIn, size_t lengthIn) : result_op<size_t>(ex, "recv"), buffer(bufferIn), length(lengthIn) {}
+
+			bool attempt(int fd) override {
+				for (;;) {
+					const ssize_t n = ::recv(fd, buffer, length, 0);
+					if (n >= 0) {
+						value = static_cast<size_t>(n);
+						return true;
+					}
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						return false;
+					}
+					if (errno != EINTR) {
+						return fail(errno);
+					}
+				}
+			}
+		};
+
+		struct send_op : result_op<size_t> {
+			const char* data;
+			size_t length;
+			size_t sent;
+
+			send_op(executor& ex, const void* dataIn, size_t lengthIn) : result_op<size_t>(ex, "send"), data(static_cast<const char*>(dataIn)), length(lengthIn), sent(0) {}
+
+			bool attempt(int fd) override {
+				while (sent < length) {
+					const ssize_t n = ::send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+					if (n >= 0) {
+						sent += static_cast<size_t>(n);
+					}
+					else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						return false;
+					}
+					else if (errno != EINTR) {
+						return fail(errno);
+					}
+				}
+				value = sent;
+				return true;
+			}
+		};
+
+		struct accept_op;
+		struct connect_op;
+
+		struct handle {
+			std::shared_ptr<reactor::socket_state> state;
+
+			handle(std::shared_ptr<reactor::socket_state>&& stateIn) : state(std::move(stateIn)) {}
+
+			~handle() { state->owner->detach(*state); }
+		};
+
+		std::shared_ptr<handle> socket;
+
+		reactor::socket_state& state() const {
+			if (socket == nullptr) {
+				throw std::logic_error("async_socket is empty");
+			}
+			return *socket->state;
+		}
+
+		template<typename Op>
+		auto start(const std::shared_ptr<Op>& op, reactor::side s, const cancellation_token& token) const {
+			auto& st = state();
+			return st.owner->start(st.shared_from_this(), op, s, token);
+		}
+
+	public:
+		async_socket() = default;
+
+		// takes ownership of fd, which is made non blocking, and closed if it can't be registered.
+		explicit async_socket(int fd, reactor& r = reactor::instance()) {
+			try {
+				socket = std::make_shared<handle>(r.attach(fd));
+			}
+			catch (...) {
+				::close(fd);
+				throw;
+			}
+		}
+
+		// a socket listening on address, with SO_REUSEADDR set.
+		static async_socket listen(const sockaddr* address, socklen_t length, int backlog = SOMAXCONN, reactor& r = reactor::instance()) {
+			const int fd = ::socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd < 0) {
+				throw std::system_error(errno, std::system_category(), "socket");
+			}
+			const int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (::bind(fd, address, length) < 0 || ::listen(fd, backlog) < 0) {
+				const int error = errno;
+				::close(fd);
+				throw std::system_error(error, std::system_category(), "listen");
+			}
+			return async_socket(fd, r);
+		}
+
+		// completes with a stream socket connected to address.
+		static task<async_socket> connect(const sockaddr* address, socklen_t length, const cancellation_token& token = cancellation_token{}, reactor& r = reactor::instance());
+
+		// completes with the next connection on a listening socket.
+		task<async_socket> accept(const cancellation_token& token = cancellation_token{}) const;
+
+		// completes with the bytes received, 0 once the peer shut down. buffer has to stay valid until then.
+		task<size_t> receive(void* buffer, size_t length, const cancellation_token& token = cancellation_token{}) const {
+			return start(std::make_shared<receive_op>(state().owner->exec, buffer, length), reactor::read_side, token);
+		}
+
+		// completes once all of data was sent; a canceled send may have sent a part. data has to stay valid until then.
+		task<size_t> send(const void* data, size_t length, const cancellation_token& token = cancellation_token{}) const {
+			return start(std::make_shared<send_op>(state().owner->exec, data, length), reactor::write_side, token);
+		}
+
+		// closes the socket for every copy; waiting operations are canceled.
+		void close() {
+			if (socket != nullptr) {
+				socket->state->owner->detach(*socket->state);
+			}
+		}
+
+		bool is_open() const { return socket != nullptr && socket->state->fd.load(std::memory_order_acquire) >= 0; }
+
+		int native_handle() const { return socket != nullptr ? socket->state->fd.load(std::memory_order_acquire) : -1; }
+	};
+
+	struct async_socket::accept_op : async_socket::result_op<async_socket> {
+		reactor& owner;
+		int accepted;
+
+		accept_op(reactor& ownerIn) : result_op<async_socket>(ownerIn.exec, "accept4"), owner(ownerIn), accepted(-1) {}
+
+		bool attempt(int fd) override {
+			for (;;) {
+				accepted = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (accepted >= 0) {
+					return true;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return false;
+				}
+				// the peer gave up before it was accepted, take the next one.
+				if (errno != EINTR && errno != ECONNABORTED) {
+					return fail(errno);
+				}
+			}
+		}
+
+		// registers the new socket outside the listener's lock.
+		void finish() override {
+			if (error == 0) {
+				try {
+					value = async_socket(accepted, owner);
+				}
+				catch (const std::system_error& e) {
+					error = e.code().value();
+				}
+			}
+			result_op<async_socket>::finish();
+		}
+	};
+
+	// connect() again tells whether the connection in progress went through.
+	struct async_socket::connect_op : async_socket::result_op<async_socket> {
+		sockaddr_storage address;
+		socklen_t address_length;
+
+		connect_op(executor& ex, const async_socket& socket, const sockaddr* addressIn, socklen_t lengthIn) : result_op<async_socket>(ex, "connect"), address_length(lengthIn) {
+			std::memcpy(&address, addressIn, std::min<size_t>(lengthIn, sizeof(address)));
+			value = socket;
+		}
+
+		bool attempt(int fd) override {
+			for (;;) {
+				if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), address_length) == 0 || errno == EISCONN) {
+					return true;
+				}
+				if (errno == EINPROGRESS || errno == EALREADY || errno == EAGAIN) {
+					return false;
+				}
+				if (errno != EINTR) {
+					return fail(errno);
+				}
+			}
+		}
+
+		// the socket isn't handed out if it didn't connect.
+		void finish() override {
+			if (error != 0) {
+				value.close();
+			}
+			result_op<async_socket>::finish();
+		}
+
+		void cancel() override {
+			value.close();
+			result_op<async_socket>::cancel();
+		}
+	};
+
+	inline task<async_socket> async_socket::connect(const sockaddr* address, socklen_t length, const cancellation_token& token, reactor& r) {
+		const int fd = ::socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category(), "socket");
+		}
+		async_socket s(fd, r);
+		return s.start(std::make_shared<connect_op>(r.exec, s, address, length), reactor::write_side, token);
+	}
+
+	inline task<async_socket> async_socket::accept(const cancellation_token& token) const {
+		return start(std::make_shared<accept_op>(*state().owner), reactor::read_side, token);
+	}
+
+	static inline task<async_socket> async_accept(const async_socket& listener, const cancellation_token& token = cancellation_token{}) { return listener.accept(token); }
+
+	static inline task<async_socket> async_connect(const sockaddr* address, socklen_t length, const cancellation_token& token = cancellation_token{}) { return async_socket::connect(address, length, token); }
+
+	static inline task<size_t> async_recv(const async_socket& socket, void* buffer, size_t length, const cancellation_token& token = cancellation_token{}) { return socket.receive(buffer, length, token); }
+
+	static inline task<size_t> async_send(const async_socket& socket, const void* data, size_t length, const cancellation_token& token = cancellation_token{}) { return socket.send(data, length, token); }
+}
+#endif
@@ -0,0 +1,665 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+
+#include "executor.h"
+#include "topology.h"
+
+namespace cpptask
+{
+	// Chase-Lev deque : the owner pushes and pops at the bottom, thieves steal from the top.
+	template<typename T>
+	class work_stealing_deque {
+	private:
+		struct ring {
+			int64_t capacity;
+			int64_t mask;
+			std::unique_ptr<std::atomic<T*>[]> slots;
+
+			ring(int64_t capacityIn) : capacity(capacityIn), mask(capacityIn - 1), slots(new std::atomic<T*>[capacityIn]) {}
+
+			T* load(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+
+			void store(int64_t i, T* item) { slots[i & mask].store(item, std::memory_order_relaxed); }
+
+			ring* grow(int64_t bottom, int64_t top) const {
+				ring* bigger = new ring(capacity * 2);
+				for (int64_t i = top; i < bottom; ++i) {
+					bigger->store(i, load(i));
+				}
+				return bigger;
+			}
+		};
+
+		alignas(64) std::atomic<int64_t> top;
+		alignas(64) std::atomic<int64_t> bottom;
+		std::atomic<ring*> buffer;
+		std::vector<std::unique_ptr<ring>> retired;
+
+	public:
+		work_stealing_deque(int64_t capacity = 256) : top(0), bottom(0), buffer(new ring(capacity)) {}
+
+		~work_stealing_deque() { delete buffer.load(); }
+
+		work_stealing_deque(const work_stealing_deque&) = delete;
+		work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+		size_t size() const {
+			int64_t b = bottom.load(std::memory_order_relaxed);
+			int64_t t = top.load(std::memory_order_relaxed);
+			return b > t ? static_cast<size_t>(b - t) : 0;
+		}
+
+		bool empty() const { return size() == 0; }
+
+		void push(T* item) {
+			int64_t b = bottom.load(std::memory_order_relaxed);
+			int64_t t = top.load(std::memory_order_acquire);
+			ring* r = buffer.load(std::memory_order_relaxed);
+			if (b - t > r->capacity - 1) {
+				ring* bigger = r->grow(b, t);
+				retired.emplace_back(r);
+				buffer.store(bigger, std::memory_order_release);
+				r = bigger;
+			}
+			r->store(b, item);
+			bottom.store(b + 1, std::memory_order_release);
+		}
+
+		T* pop() {
+			int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+			ring* r = buffer.load(std::memory_order_relaxed);
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = top.load(std::memory_order_relaxed);
+			if (t > b) {
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			T* item = r->load(b);
+			if (t == b) {
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					item = nullptr;
+				}
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return item;
+		}
+
+		T* steal() {
+			int64_t t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = bottom.load(std::memory_order_acquire);
+			if (t >= b) {
+				return nullptr;
+			}
+
+			ring* r = buffer.load(std::memory_order_acquire);
+			T* item = r->load(t);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				return nullptr;
+			}
+			return item;
+		}
+	};
+
+	// latency class of the work posted to a scheduler lane, most urgent first.
+	enum class task_priority : uint8_t
+	{
+		interactive,
+		normal,
+		background,
+	};
+
+	struct worker_metrics {
+		bool reserved = false;
+		size_t node = 0;
+		// -1 for a worker not pinned to a cpu.
+		int cpu = -1;
+		// items in the worker's own deques right now.
+		size_t queue_depth = 0;
+		// counted only with CPPTASK_TRACE defined, zero otherwise.
+		uint64_t executed = 0;
+		uint64_t stolen = 0;
+		uint64_t idle_ns = 0;
+	};
+
+	struct scheduler_metrics {
+		std::vector<worker_metrics> workers;
+		// items in the shared queue of each lane, indexed by task_priority.
+		size_t injected[3] = {};
+	};
+
+	// every worker serves the interactive lane first, then normal, then background. a lower lane passed over
+	// aging_limit times in a row by a worker is served next, so a flood of urgent work can't starve it.
+	// reserved workers run interactive work only, keeping cores free for it while batch work saturates the rest.
+	// workers are grouped by the NUMA node of their cpu. an idle worker steals from its own node first, then from
+	// the nearest nodes on. a continuation posted by a worker goes to the bottom of its deque and runs there next,
+	// on the worker that completed its antecedent, while thieves take the oldest work from the top.
+	class scheduler : public executor {
+	private:
+		static constexpr size_t lane_count = 3;
+		static constexpr size_t interactive_lane = static_cast<size_t>(task_priority::interactive);
+		static constexpr size_t normal_lane = static_cast<size_t>(task_priority::normal);
+
+		// posts into one lane; work runs with the lane as current executor so continuations stay in it.
+		class lane_executor : public executor {
+		private:
+			scheduler* owner;
+			size_t lane;
+
+		public:
+			lane_executor(scheduler* ownerIn, size_t laneIn) : owner(ownerIn), lane(laneIn) {}
+
+			using executor::post;
+
+			void post(work_item* item) override { owner->post(item, lane); }
+
+			void post_batch(work_item* const* items, size_t count) override { owner->post_batch(items, count, lane); }
+
+			bool run_one() override { return owner->run_one(); }
+
+			size_t concurrency() const override { return owner->concurrency(); }
+		};
+
+		struct worker {
+			size_t index;
+			scheduler* owner;
+			bool reserved;
+			size_t node;
+			int cpu;
+			// the other workers, same node first, then by distance.
+			std::vector<worker*> victims;
+			// interactive work always goes through the shared queue, so slot 0 stays unused.
+			work_stealing_deque<work_item> local[lane_count];
+			size_t passed_over[lane_count] = {};
+			size_t local_streak = 0;
+			std::thread thread;
+#if defined(CPPTASK_TRACE)
+			// written by the worker only, read by metrics() from anywhere.
+			std::atomic<uint64_t> executed{ 0 };
+			std::atomic<uint64_t> stolen{ 0 };
+			std::atomic<uint64_t> idle_ns{ 0 };
+			std::chrono::steady_clock::time_point idle_since;
+			bool idle = false;
+
+			static void count(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+				counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+			}
+
+			void begin_idle() {
+				if (!idle) {
+					idle = true;
+					idle_since = std::chrono::steady_clock::now();
+				}
+			}
+
+			void end_idle() {
+				if (idle) {
+					idle = false;
+					count(idle_ns, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - idle_since).count()));
+				}
+			}
+#endif
+
+			worker(size_t indexIn, scheduler* ownerIn, bool reservedIn, size_t nodeIn, int cpuIn) : index(indexIn), owner(ownerIn), reserved(reservedIn), node(nodeIn), cpu(cpuIn) {}
+		};
+
+		struct injection_queue {
+			std::mutex mtx;
+			std::deque<work_item*> items;
+			std::atomic<size_t> size{ 0 };
+		};
+
+		struct sleep_group {
+			std::condition_variable cv;
+			std::atomic<size_t> sleeping{ 0 };
+			uint64_t wake_epoch = 0;
+		};
+
+		cpu_topology placement;
+		std::vector<std::unique_ptr<worker>> workers;
+		// the normal lane is the scheduler itself.
+		std::unique_ptr<lane_executor> lanes[lane_count];
+		injection_queue injection[lane_count];
+		size_t aging_limit;
+
+		std::mutex sleep_mtx;
+		sleep_group general_sleepers;
+		sleep_group reserved_sleepers;
+		bool stopping;
+
+		inline static thread_local worker* current_worker = nullptr;
+
+		static constexpr int spin_count = 64;
+		static constexpr size_t max_refill = 32;
+
+		void push_injection(work_item* item, size_t lane) {
+			injection_queue& q = injection[lane];
+			std::lock_guard<std::mutex> lk(q.mtx);
+			q.items.push_back(item);
+			q.size.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		work_item* pop_injection(size_t lane) {
+			injection_queue& q = injection[lane];
+			if (q.size.load(std::memory_order_relaxed) == 0) {
+				return nullptr;
+			}
+
+			std::lock_guard<std::mutex> lk(q.mtx);
+			if (q.items.empty()) {
+				return nullptr;
+			}
+
+			work_item* item = q.items.front();
+			q.items.pop_front();
+			q.size.fetch_sub(1, std::memory_order_relaxed);
+			return item;
+		}
+
+		// a worker whose deque ran dry takes its share of the shared queue under one lock. the rest of the share
+		// goes to its deque oldest on top, so it runs in queue order and other workers can steal from it.
+		work_item* refill_from_injection(worker* self, size_t lane) {
+			injection_queue& q = injection[lane];
+			if (q.size.load(std::memory_order_relaxed) == 0) {
+				return nullptr;
+			}
+
+			std::lock_guard<std::mutex> lk(q.mtx);
+			if (q.items.empty()) {
+				return nullptr;
+			}
+
+			const size_t share = std::min({ q.items.size(), q.items.size() / workers.size() + 1, max_refill });
+			work_item* item = q.items.front();
+			for (size_t i = share - 1; i > 0; --i) {
+				self->local[lane].push(q.items[i]);
+			}
+			q.items.erase(q.items.begin(), q.items.begin() + static_cast<std::ptrdiff_t>(share));
+			q.size.fetch_sub(share, std::memory_order_relaxed);
+			return item;
+		}
+
+		work_item* steal_from_others(worker* thief, size_t lane) {
+			for (worker* victim : thief->victims) {
+				if (work_item* item = victim->local[lane].steal()) {
+#if defined(CPPTASK_TRACE)
+					worker::count(thief->stolen);
+#endif
+					return item;
+				}
+			}
+			return nullptr;
+		}
+
+		// the shared queue and then the oldest item of the own deque go first now and then, or work that keeps posting
+		// to its own deque would starve both : items refilled from the shared queue sit under whatever it posts.
+		work_item* take_local(worker* self, size_t lane) {
+			if (++self->local_streak >= aging_limit) {
+				self->local_streak = 0;
+				if (work_item* item = pop_injection(lane)) {
+					return item;
+				}
+				if (work_item* item = self->local[lane].steal()) {
+					return item;
+				}
+			}
+			if (work_item* item = self->local[lane].pop()) {
+				return item;
+			}
+			return refill_from_injection(self, lane);
+		}
+
+		work_item* take(worker* self, size_t lane) {
+			if (lane == interactive_lane) {
+				return pop_injection(lane);
+			}
+			if (work_item* item = take_local(self, lane)) {
+				return item;
+			}
+			return steal_from_others(self, lane);
+		}
+
+		work_item* find_work(worker* self, size_t& lane) {
+			if (self->reserved) {
+				lane = interactive_lane;
+				return pop_injection(interactive_lane);
+			}
+
+			for (size_t aged = lane_count - 1; aged > interactive_lane; --aged) {
+				if (self->passed_over[aged] >= aging_limit) {
+					self->passed_over[aged] = 0;
+					if (work_item* item = take(self, aged)) {
+						lane = aged;
+						return item;
+					}
+				}
+			}
+
+			// own and shared queues in lane order first, other workers' deques only when those are empty.
+			for (lane = 0; lane < lane_count; ++lane) {
+				work_item* item = lane == interactive_lane ? pop_injection(lane) : take_local(self, lane);
+				if (item != nullptr) {
+					pass_over(self, lane);
+					return item;
+				}
+			}
+			for (lane = interactive_lane + 1; lane < lane_count; ++lane) {
+				if (work_item* item = steal_from_others(self, lane)) {
+					pass_over(self, lane);
+					return item;
+				}
+			}
+			return nullptr;
+		}
+
+		void pass_over(worker* self, size_t served) {
+			for (size_t lower = served + 1; lower < lane_count; ++lower) {
+				++self->passed_over[lower];
+			}
+			self->passed_over[served] = 0;
+		}
+
+		bool has_pending_work(bool reserved) const {
+			if (injection[interactive_lane].size.load(std::memory_order_relaxed) != 0) {
+				return true;
+			}
+			if (reserved) {
+				return false;
+			}
+
+			for (size_t lane = interactive_lane + 1; lane < lane_count; ++lane) {
+				if (injection[lane].size.load(std::memory_order_relaxed) != 0) {
+					return true;
+				}
+			}
+			for (const auto& w : workers) {
+				for (size_t lane = interactive_lane + 1; lane < lane_count; ++lane) {
+					if (!w->local[lane].empty()) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+		// wakes up to count workers of the group, returns how many it woke.
+		size_t wake(sleep_group& group, size_t count) {
+			const size_t sleeping = group.sleeping.load(std::memory_order_relaxed);
+			if (sleeping == 0 || count == 0) {
+				return 0;
+			}
+
+			std::lock_guard<std::mutex> lk(sleep_mtx);
+			++group.wake_epoch;
+			if (count >= sleeping) {
+				group.cv.notify_all();
+				return sleeping;
+			}
+			for (size_t i = 0; i < count; ++i) {
+				group.cv.notify_one();
+			}
+			return count;
+		}
+
+		// one worker per posted item at most. interactive work wakes reserved workers first, anything else general ones.
+		void notify(size_t lane, size_t count = 1) {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (lane == interactive_lane) {
+				count -= wake(reserved_sleepers, count);
+			}
+			wake(general_sleepers, count);
+		}
+
+		void sleep(worker* self) {
+			sleep_group& group = self->reserved ? reserved_sleepers : general_sleepers;
+			std::unique_lock<std::mutex> lk(sleep_mtx);
+			const uint64_t epoch = group.wake_epoch;
+			group.sleeping.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!stopping && !has_pending_work(self->reserved)) {
+				group.cv.wait(lk, [&]() { return stopping || group.wake_epoch != epoch; });
+			}
+			group.sleeping.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		executor* lane_executor_of(size_t lane) { return lane == normal_lane ? static_cast<executor*>(this) : lanes[lane].get(); }
+
+		void execute(work_item* item, size_t lane) {
+#if defined(CPPTASK_TRACE)
+			worker::count(current_worker->executed);
+#endif
+			current = lane_executor_of(lane);
+			item->execute();
+		}
+
+		void post(work_item* item, size_t lane) {
+			worker* self = current_worker;
+			if (lane != interactive_lane && self != nullptr && self->owner == this && !self->reserved) {
+				self->local[lane].push(item);
+			}
+			else {
+				push_injection(item, lane);
+			}
+			notify(lane);
+		}
+
+		// the whole batch goes to the worker's own deque or to the shared queue under one lock.
+		void post_batch(work_item* const* items, size_t count, size_t lane) {
+			worker* self = current_worker;
+			if (lane != interactive_lane && self != nullptr && self->owner == this && !self->reserved) {
+				for (size_t i = 0; i < count; ++i) {
+					self->local[lane].push(items[i]);
+				}
+			}
+			else {
+				injection_queue& q = injection[lane];
+				std::lock_guard<std::mutex> lk(q.mtx);
+				q.items.insert(q.items.end(), items, items + count);
+				q.size.fetch_add(count, std::memory_order_relaxed);
+			}
+			notify(lane, count);
+		}
+
+		// each worker starts with the workers of its node, from the one after it around, so thieves spread out.
+		void order_victims() {
+			std::vector<std::vector<worker*>> by_node(placement.node_count());
+			for (auto& w : workers) {
+				by_node[w->node].push_back(w.get());
+			}
+			for (auto& w : workers) {
+				std::vector<size_t> nodes;
+				for (size_t n = 0; n < by_node.size(); ++n) {
+					nodes.push_back((w->node + n) % by_node.size());
+				}
+				std::stable_sort(nodes.begin() + 1, nodes.end(), [&](size_t lhs, size_t rhs) { return placement.distance(w->node, lhs) < placement.distance(w->node, rhs); });
+				for (size_t n : nodes) {
+					const auto& group = by_node[n];
+					for (size_t i = 0; i < group.size(); ++i) {
+						worker* victim = group[(w->index + 1 + i) % group.size()];
+						if (victim != w.get()) {
+							w->victims.push_back(victim);
+						}
+					}
+				}
+			}
+		}
+
+		void worker_loop(worker* self) {
+			if (self->cpu >= 0) {
+				pin_current_thread(static_cast<unsigned>(self->cpu));
+			}
+			current_numa_node = self->node;
+			current_scope scope(this);
+			current_worker = self;
+			int idle_spins = 0;
+			while (true) {
+				size_t lane = 0;
+				if (work_item* item = find_work(self, lane)) {
+#if defined(CPPTASK_TRACE)
+					self->end_idle();
+#endif
+					execute(item, lane);
+					idle_spins = 0;
+					continue;
+				}
+
+#if defined(CPPTASK_TRACE)
+				self->begin_idle();
+#endif
+
+				if (++idle_spins < spin_count) {
+					std::this_thread::yield();
+					continue;
+				}
+
+				{
+					std::lock_guard<std::mutex> lk(sleep_mtx);
+					if (stopping && !has_pending_work(self->reserved)) {
+						break;
+					}
+				}
+				sleep(self);
+				idle_spins = 0;
+			}
+#if defined(CPPTASK_TRACE)
+			self->end_idle();
+#endif
+			current_worker = nullptr;
+		}
+
+	public:
+		// reserved_threads of the thread_count workers run interactive work only; at least one worker stays general.
+		// the workers aren't pinned and form a single node.
+		explicit scheduler(size_t thread_count = std::thread::hardware_concurrency(), size_t reserved_threads = 0, size_t aging_limitIn = 16)
+			: scheduler(cpu_topology::flat(thread_count), false, reserved_threads, aging_limitIn) {}
+
+		// a worker per cpu of topology, stealing from its own node first. pin_threads also pins each worker to its
+		// cpu, which only pays off when the process owns those cpus. reserved workers are the last ones.
+		explicit scheduler(const cpu_topology& topology, bool pin_threads = false, size_t reserved_threads = 0, size_t aging_limitIn = 16)
+			:
+			placement(topology.cpu_count() != 0 ? topology : cpu_topology::flat(1)),
+			aging_limit(aging_limitIn != 0 ? aging_limitIn : 1),
+			stopping(false)
+		{
+			const size_t thread_count = placement.cpu_count();
+			if (reserved_threads >= thread_count) {
+				reserved_threads = thread_count - 1;
+			}
+
+			for (size_t lane = 0; lane < lane_count; ++lane) {
+				if (lane != normal_lane) {
+					lanes[lane] = std::make_unique<lane_executor>(this, lane);
+				}
+			}
+
+			workers.reserve(thread_count);
+			for (size_t node = 0; node < placement.node_count(); ++node) {
+				for (unsigned cpu : placement.nodes()[node].cpus) {
+					const size_t i = workers.size();
+					workers.push_back(std::make_unique<worker>(i, this, i >= thread_count - reserved_threads, node, pin_threads ? static_cast<int>(cpu) : -1));
+				}
+			}
+			order_victims();
+			for (auto& w : workers) {
+				w->thread = std::thread([this, self = w.get()]() { worker_loop(self); });
+			}
+		}
+
+		~scheduler() {
+			{
+				std::lock_guard<std::mutex> lk(sleep_mtx);
+				stopping = true;
+				++general_sleepers.wake_epoch;
+				++reserved_sleepers.wake_epoch;
+			}
+			general_sleepers.cv.notify_all();
+			reserved_sleepers.cv.notify_all();
+			for (auto& w : workers) {
+				w->thread.join();
+			}
+		}
+
+		scheduler(const scheduler&) = delete;
+		scheduler& operator=(const scheduler&) = delete;
+
+		// a worker per cpu the process may run on, grouped by node but not pinned : pinned workers of several
+		// processes sharing the machine would crowd the same cpus while others idle.
+		static scheduler& default_instance() {
+			static scheduler instance(cpu_topology::detect());
+			return instance;
+		}
+
+		size_t concurrency() const override { return workers.size(); }
+
+		const cpu_topology& topology() const { return placement; }
+
+		bool is_worker_thread() const { return current_worker != nullptr && current_worker->owner == this; }
+
+		// the executor of one lane; posting to the scheduler itself uses the normal lane.
+		executor& lane(task_priority priority) { return *lane_executor_of(static_cast<size_t>(priority)); }
+
+		using executor::post;
+
+		void post(work_item* item) override { post(item, normal_lane); }
+
+		void post_batch(work_item* const* items, size_t count) override { post_batch(items, count, normal_lane); }
+
+		// a racy snapshot, good for watching a running scheduler rather than exact accounting.
+		scheduler_metrics metrics() const {
+			scheduler_metrics m;
+			m.workers.reserve(workers.size());
+			for (const auto& w : workers) {
+				worker_metrics wm;
+				wm.reserved = w->reserved;
+				wm.node = w->node;
+				wm.cpu = w->cpu;
+				for (const auto& deque : w->local) {
+					wm.queue_depth += deque.size();
+				}
+#if defined(CPPTASK_TRACE)
+				wm.executed = w->executed.load(std::memory_order_relaxed);
+				wm.stolen = w->stolen.load(std::memory_order_relaxed);
+				wm.idle_ns = w->idle_ns.load(std::memory_order_relaxed);
+#endif
+				m.workers.push_back(wm);
+			}
+			for (size_t lane = 0; lane < lane_count; ++lane) {
+				m.injected[lane] = injection[lane].size.load(std::memory_order_relaxed);
+			}
+			return m;
+		}
+
+		bool run_one() override {
+			worker* self = current_worker;
+			if (self == nullptr || self->owner != this) {
+				return false;
+			}
+
+			size_t lane = 0;
+			if (work_item* item = find_work(self, lane)) {
+				executor* previous = current;
+				execute(item, lane);
+				current = previous;
+				return true;
+			}
+			return false;
+		}
+	};
+
+	using thread_pool_executor = scheduler;
+
+	static inline executor& default_executor() { return scheduler::default_instance(); }
+
+	static inline executor& default_executor(task_priority priority) { return scheduler::default_instance().lane(priority); }
+}
@@ -1,42 +1,27 @@
 #pragma once
 #include <iostream>
 #include <tuple>
-#include <future>
+#include <optional>
+#include <variant>
+#include <exception>
+#include <cstdint>
+#include <coroutine>
 #include <thread>
 #include <memory>
 #include <atomic>
 #include <vector>
+#include <mutex>
+#include <utility>
 
 #include "function_traits.h"
+#include "task_function.h"
+#include "task_allocator.h"
+#include "scheduler.h"
+#include "cancellation.h"
+#include "trace.h"
 
 namespace cpptask
 {
-	template<typename F, typename ...Args>
-	struct func_wrapper : callable_t<typename gen_task_type<F, Args...>::Return>
-	{
-		using ThisType = func_wrapper<F, Args...>;
-		using FuncType = typename gen_task_type<F, Args...>::Func;
-		using TupleType = typename gen_task_type<F, Args...>::Tuple;
-		using ReturnType = typename gen_task_type<F, Args...>::Return;
-		using BaseType = callable_t<ReturnType>;
-
-		FuncType func;
-		TupleType params;
-
-		func_wrapper(F&& f, Args&&... args) : func(std::forward<F>(f)), params(std::forward<Args>(args)...) {}
-
-		ReturnType operator()() const override { return const_cast<ThisType*>(this)->call_fn(std::make_index_sequence<std::tuple_size_v<TupleType>>()); }
-
-		template<size_t ...Is>
-		ReturnType call_fn(std::index_sequence<Is...>) { return func(std::get<Is>(std::forward<TupleType>(params))...); }
-	};
-
-	template<typename F, typename ...Args>
-	static auto make_func_wrapper(F&& f, Args&&... args) { return func_wrapper<F, Args...>(std::forward<F>(f), std::forward<Args>(args)...); }
-
-	template<typename F, typename ...Args>
-	static typename func_wrapper<F, Args...>::BaseType* make_func_wrapper_pointer(F&& f, Args&&... args) { return new func_wrapper<F, Args...>(std::forward<F>(f), std::forward<Args>(args)...); }
-
 	enum task_status
 	{
 		created,
@@ -46,295 +31,554 @@ namespace cpptask
 		faulted,
 	};
 
-	class task_cancelled : public std::exception {
-	public:
-		task_cancelled() = default;
-
-		const char* what() const override {
-			return "a task was cancelled";
-		}
-	};
-	
+	// the exceptions of one or more failed tasks, kept as exception_ptr so their types and messages survive.
 	class aggregate_exception : public std::exception {
-		template<typename T>
-		friend class dispatch_block;
 	private:
-		std::vector<std::exception> inner_exceptions;
+		std::vector<std::exception_ptr> inner_exceptions;
 
 	public:
-		auto begin() { return inner_exceptions.begin(); }
 		auto begin() const { return inner_exceptions.begin(); }
-		auto end() { return inner_exceptions.end(); }
 		auto end() const { return inner_exceptions.end(); }
 
 		size_t size() const { return inner_exceptions.size(); }
 
 		aggregate_exception() = default;
 
-		const char* what() const override {
+		const char* what() const noexcept override {
 			return "aggregate exception";
 		}
 
-		void add_exception(const std::exception& e) {
-			inner_exceptions.push_back(e);
+		void add_exception(std::exception_ptr e) {
+			inner_exceptions.push_back(std::move(e));
 		}
 
 		void add_exception(const aggregate_exception& es) {
-			for (const auto& e : es) {
-				inner_exceptions.push_back(e);
+			inner_exceptions.insert(inner_exceptions.end(), es.begin(), es.end());
+		}
+
+		// calls f(const std::exception&) for every inner exception, nested aggregates flattened.
+		// each one is rethrown to reach it, so this is for reporting rather than hot paths.
+		template<typename F>
+		void for_each(F&& f) const {
+			for (const auto& e : inner_exceptions) {
+				try {
+					std::rethrow_exception(e);
+				}
+				catch (const aggregate_exception& nested) {
+					nested.for_each(f);
+				}
+				catch (const std::exception& inner) {
+					f(inner);
+				}
+				catch (...) {
+				}
 			}
 		}
 	};
 
-	struct cancel_block {
-		std::atomic<bool> canceled;
-		cancel_block() : canceled(false) {}
-		void cancel() { canceled.exchange(true); }
-	};
+	template<typename T>
+	class task_awaiter;
 
-	class cancellation_token {
-	private:
-		std::shared_ptr<cancel_block> block;
+	template<typename T>
+	class task_ref_awaiter;
 
-	public:
-		cancellation_token() = default;
+	template<typename T>
+	class task_base;
 
-		cancellation_token(const std::shared_ptr<cancel_block>& blockIn) : block(blockIn) {}
+	template<typename T>
+	class task;
 
-		bool is_cancellation_requested() const { if (block == nullptr) return false; return block->canceled; }
+	template<typename T>
+	class task_promise;
 
-		void throw_if_cancellation_requested() const { if (block != nullptr && block->canceled) throw task_cancelled(); }
-	};
+	struct task_t {
+		virtual void wait() = 0;
 
-	class cancellation_token_source {
-		friend class cancellation_token;
-	private:
-		std::shared_ptr<cancel_block> impl;
+		virtual void dispatch() = 0;
+	};
 
-	public:
-		cancellation_token_source() : impl(std::make_shared<cancel_block>()) {}
+	// runs once when the antecedent completes, on the thread that completed it.
+	struct continuation {
+		continuation* next = nullptr;
 
-		cancellation_token token() { return { impl }; }
+		virtual ~continuation() = default;
 
-		std::shared_ptr<cancel_block> _block() const { return impl; }
+		virtual void run() = 0;
 
-		void cancel() { impl->cancel(); }
+		// whether the completing thread may hand control straight to this continuation instead of running it.
+		virtual bool transferable() const { return false; }
 	};
 
-	template<typename T>
-	class task_awaiter;
+	template<typename F>
+	struct callback_continuation : continuation {
+		F func;
 
-	template<typename T>
-	class task_base;
-
-	template<typename T>
-	class task;
+		callback_continuation(F&& f) : func(std::move(f)) {}
 
-	struct task_t {
-		virtual void wait() = 0;
-
-		virtual void dispatch() = 0;
+		void run() override {
+			func();
+			delete this;
+		}
 	};
 
-	class child_disaptch_block {
+	// Treiber stack of continuations, sealed when the block completes.
+	class continuation_block {
 	private:
-		struct one_time_event {
-			std::promise<void> p;
-			std::future<void> f;
+		struct sealed_continuation : continuation {
+			void run() override {}
+		};
 
-			one_time_event() : f(p.get_future()) {}
+		inline static sealed_continuation sealed;
 
-			void set() { p.set_value(); }
-			void wait() { f.wait(); }
-		};
-		bool dispatched;
-		std::mutex mtx;
-		std::vector<std::unique_ptr<task_t>> childs;
-		std::unique_ptr<one_time_event> child_would_dispatch;
+		std::atomic<continuation*> head;
 
 	protected:
 		bool is_self_child;
 
-		child_disaptch_block(bool child)
+		continuation_block(bool child)
 			:
-			is_self_child(child),
-			dispatched(false)
+			head(nullptr),
+			is_self_child(child)
 		{
-			if (is_self_child) {
-				child_would_dispatch = std::make_unique<one_time_event>();
-			}
 		}
 
-		void wait_if_is_self_child() {
-			if (child_would_dispatch) {
-				child_would_dispatch->wait();
+		~continuation_block() {
+			continuation* list = head.load(std::memory_order_acquire);
+			while (list != nullptr && list != &sealed) {
+				delete std::exchange(list, list->next);
 			}
 		}
 
-		void dispatched_if_is_self_child() {
-			if (child_would_dispatch) {
-				child_would_dispatch->set();
+		// with transfer given, the first transferable continuation is handed back to the caller instead of run.
+		void run_continuations(continuation** transfer = nullptr) {
+			continuation* list = head.exchange(&sealed, std::memory_order_acq_rel);
+			if (list == &sealed) {
+				throw std::logic_error("continuations already dispatched");
 			}
-		}
 
-		template<typename T>
-		bool add_child(const task<T>& child) {
-			std::unique_ptr<task_t> task_pointer(new task<T>(child));
-			std::lock_guard<std::mutex> lk(mtx);
-			if (!dispatched) {
-				childs.push_back(std::move(task_pointer));
-				return true;
+			continuation* ordered = nullptr;
+			while (list != nullptr) {
+				continuation* next = list->next;
+				list->next = ordered;
+				ordered = list;
+				list = next;
 			}
-			else {
-				return false;
+
+			while (ordered != nullptr) {
+				continuation* next = ordered->next;
+				if (transfer != nullptr && *transfer == nullptr && ordered->transferable()) {
+					*transfer = ordered;
+				}
+				else {
+					ordered->run();
+				}
+				ordered = next;
 			}
 		}
 
-		std::vector<std::unique_ptr<task_t>> mark_dispatch() {
-			std::lock_guard<std::mutex> lk(mtx);
-			if (dispatched) {
-				throw std::logic_error("child tasks already dispatched");
-			}
-			dispatched = true;
+	public:
+		// registers c to run after completion, or runs it right away if the block already completed.
+		void continue_with(continuation* c) {
+			continuation* current = head.load(std::memory_order_acquire);
+			do {
+				if (current == &sealed) {
+					c->run();
+					return;
+				}
+				c->next = current;
+			} while (!head.compare_exchange_weak(current, c, std::memory_order_release, std::memory_order_acquire));
+		}
+	};
+
+	// resumes a suspended coroutine on the executor it was suspended on.
+	struct coroutine_continuation : continuation, work_item {
+		std::coroutine_handle<> handle;
+		executor* exec;
 
-			return std::move(childs);
+		coroutine_continuation(std::coroutine_handle<> handleIn, executor& ex) : handle(handleIn), exec(&ex) {}
+
+		bool transferable() const override { return exec == executor::current_executor(); }
+
+		void run() override { exec->post(static_cast<work_item*>(this)); }
+
+		void execute() override {
+			auto resumed = handle;
+			delete this;
+			resumed.resume();
 		}
+
+		// a suspended coroutine can't be dropped, it resumes on the dropping thread.
+		void abandon() override { execute(); }
 	};
 
 	template<typename T>
-	class dispatch_block : public child_disaptch_block
+	class dispatch_block : public continuation_block, public work_item, public std::enable_shared_from_this<dispatch_block<T>>
 	{
 		friend class task_base<T>;
 		friend class task<T>;
 		friend class task_awaiter<T>;
 	private:
-		task_status	status;
-		cancellation_token cancel_token;
-		std::shared_ptr<aggregate_exception> exception_ptr;
-
-		std::atomic<bool> dispatch_once;
-		std::future<void> dispatch_token;
+		using value_type = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+		// low bits hold the task_status, waiter_flag is set once somebody blocks on completion,
+		// claim_flag once a producer took the right to complete a task without callable.
+		static constexpr uint32_t status_mask = 0xff;
+		static constexpr uint32_t waiter_flag = 0x100;
+		static constexpr uint32_t claim_flag = 0x200;
+
+		// completes the task as canceled when its token is, unless somebody claimed it first.
+		struct cancel_hook : cancel_callback {
+			dispatch_block* owner = nullptr;
+
+			void invoke() override {
+				auto self = owner->weak_from_this().lock();
+				finish();
+				if (self != nullptr) {
+					self->cancel_pending();
+				}
+			}
+		};
 
-		std::promise<T> result_token_setter;
-		std::future<T> result_token;
+		std::atomic<uint32_t> state;
+		executor* exec;
+		cancellation_token cancel_token;
+		cancel_hook hook;
+		bool hooked;
+		task_function<T> callable;
+		std::shared_ptr<dispatch_block> keep_alive;
+#if defined(CPPTASK_TRACE)
+		uint64_t trace_id;
+#endif
+
+		// a faulted task keeps what it threw; a canceled one keeps nothing and get() throws a fresh task_cancelled.
+		std::optional<value_type> result;
+		std::exception_ptr error;
+		// set once the result was moved out, it's gone for every copy of the task then.
+		std::atomic<bool> taken{ false };
+
+		void block_until_completed() {
+			uint32_t observed = state.fetch_or(waiter_flag, std::memory_order_acq_rel) | waiter_flag;
+			while ((observed & status_mask) <= running) {
+				state.wait(observed, std::memory_order_acquire);
+				observed = state.load(std::memory_order_acquire);
+			}
+		}
 
 	public:
-		dispatch_block(const cancellation_token& token, const bool& child_in) 
-			: 
-			child_disaptch_block(child_in),
-			status(created),
+		dispatch_block(task_function<T>&& callableIn, executor& ex, const cancellation_token& token, const bool& child_in)
+			:
+			continuation_block(child_in),
+			state(created),
+			exec(&ex),
 			cancel_token(token),
-			dispatch_once(false),
-			result_token_setter{},
-			result_token(result_token_setter.get_future()),
-			exception_ptr(nullptr)
-		{}
+			hooked(false),
+			callable(std::move(callableIn))
+		{
+#if defined(CPPTASK_TRACE)
+			trace_id = tracer::next_id();
+#endif
+			CPPTASK_TRACE_EVENT(trace_event::created, id(), 0);
+		}
+
+		~dispatch_block() {
+			if (hooked) {
+				cancel_token.deregister(&hook);
+			}
+		}
+
+		dispatch_block(task_function<T>&& callableIn, const cancellation_token& token, const bool& child_in) : dispatch_block(std::move(callableIn), default_executor(), token, child_in) {}
+		dispatch_block(task_function<T>&& callableIn, const bool& child_in) : dispatch_block(std::move(callableIn), cancellation_token{}, child_in) {}
 
-		dispatch_block(const bool& child_in) : dispatch_block(cancellation_token{}, child_in) {}
-		dispatch_block() : dispatch_block(false) {}
+		std::exception_ptr exception_ptr() const { return error; }
 
-		void add_exception(const std::exception& e) {
-			if (exception_ptr == nullptr) {
-				exception_ptr = std::make_shared<aggregate_exception>();
+		// built on request only.
+		aggregate_exception exception() const {
+			aggregate_exception aggregate;
+			if (error) {
+				aggregate.add_exception(error);
+			}
+			else if (status() == canceled) {
+				aggregate.add_exception(std::make_exception_ptr(task_cancelled()));
 			}
-			exception_ptr->add_exception(e);
+			return aggregate;
 		}
 
-		void add_exception(const aggregate_exception& e) {
-			if (exception_ptr == nullptr) {
-				exception_ptr = std::make_shared<aggregate_exception>();
+		bool is_child() const { return is_self_child; }
+
+		// the id in trace records; without tracing compiled in, unique only while the task lives.
+		uint64_t id() const {
+#if defined(CPPTASK_TRACE)
+			return trace_id;
+#else
+			return reinterpret_cast<uintptr_t>(this);
+#endif
+		}
+
+		executor& target() const { return *exec; }
+
+		bool is_canceled() const { return cancel_token.is_cancellation_requested(); }
+
+		task_status status() const { return static_cast<task_status>(state.load(std::memory_order_acquire) & status_mask); }
+
+		bool is_completed() const { return status() > running; }
+
+		// created -> running, exactly once.
+		bool try_mark_running() {
+			uint32_t observed = state.load(std::memory_order_relaxed);
+			do {
+				if ((observed & status_mask) != created) {
+					return false;
+				}
+			} while (!state.compare_exchange_weak(observed, (observed & waiter_flag) | running, std::memory_order_acq_rel, std::memory_order_relaxed));
+			return true;
+		}
+
+		bool try_claim() {
+			uint32_t previous = state.fetch_or(claim_flag, std::memory_order_acq_rel);
+			return (previous & claim_flag) == 0 && (previous & status_mask) <= running;
+		}
+
+		// created -> running, with the block keeping itself alive until it ran; the caller posts it.
+		bool try_mark_queued() {
+			if (!try_mark_running()) {
+				return false;
 			}
-			exception_ptr->add_exception(e);
+
+			keep_alive = this->shared_from_this();
+			CPPTASK_TRACE_EVENT(trace_event::queued, id(), 0);
+			return true;
 		}
 
-		bool has_exception() const {
-			if (exception_ptr != nullptr) {
-				return exception_ptr->size() != 0;
+		bool try_dispatch() {
+			if (!try_mark_queued()) {
+				return false;
 			}
-			return false;
+
+			exec->post(static_cast<work_item*>(this));
+			return true;
 		}
 
-		const aggregate_exception& exception() const {
-			if (exception_ptr == nullptr) {
-				const static aggregate_exception empty;
-				return empty;
+		// registers the cancel hook; called once the block is owned by a shared_ptr the hook can lock.
+		void watch_cancellation() {
+			if (!cancel_token.can_be_canceled()) {
+				return;
 			}
 
-			return *exception_ptr;
+			hook.owner = this;
+			hooked = true;
+			if (!cancel_token.try_register(&hook)) {
+				hooked = false;
+				cancel_pending();
+			}
 		}
 
-		bool is_child() const { return is_self_child; }
+		// a task that didn't start running yet completes as canceled right away, and its queue entry turns into a no-op.
+		void cancel_pending() {
+			if (try_claim()) {
+				complete(canceled);
+			}
+		}
 
-		bool is_canceled() const { return cancel_token.is_cancellation_requested(); }
+		void execute() override {
+			std::shared_ptr<dispatch_block> self = std::move(keep_alive);
+			run();
+		}
+
+		// dropped from a queue : completes as canceled without running.
+		void abandon() override {
+			std::shared_ptr<dispatch_block> self = std::move(keep_alive);
+			cancel_pending();
+		}
+
+		void run() {
+			if (!try_claim()) {
+				return;
+			}
+
+			CPPTASK_TRACE_EVENT(trace_event::started, id(), 0);
+			if (is_canceled()) {
+				complete(canceled);
+				return;
+			}
+
+			try {
+				if constexpr (std::is_void_v<T>) {
+					callable();
+					result.emplace();
+				}
+				else {
+					result.emplace(callable());
+				}
+			}
+			catch (const task_cancelled&) {
+				complete(canceled);
+				return;
+			}
+			catch (...) {
+				complete_faulted(std::current_exception());
+				return;
+			}
 
-		bool is_dispatchable() { 
-			bool expected = false; 
-			return dispatch_once.compare_exchange_strong(expected, true); 
+			if (is_canceled()) {
+				result.reset();
+				complete(canceled);
+				return;
+			}
+			complete(completed);
 		}
 
-		void set_dispatched(std::future<void>&& dispatch_token_in) {
-			status = running;
-			dispatch_token = std::move(dispatch_token_in);
-			dispatched_if_is_self_child();
+		void complete_faulted(std::exception_ptr e) {
+			error = std::move(e);
+			complete(faulted);
+		}
+
+		// must be called from within a catch block; returns the status the exception completes the task with.
+		task_status capture_current_exception() {
+			try {
+				throw;
+			}
+			catch (const task_cancelled&) {
+				return canceled;
+			}
+			catch (...) {
+				error = std::current_exception();
+				return faulted;
+			}
+		}
+
+		template<typename ...U>
+		void emplace_result(U&&... value) {
+			result.emplace(std::forward<U>(value)...);
+		}
+
+		void complete(task_status status_in, continuation** transfer = nullptr) {
+			if (hooked) {
+				hooked = false;
+				cancel_token.deregister(&hook);
+			}
+
+			callable.reset();
+			CPPTASK_TRACE_EVENT(status_in == completed ? trace_event::completed : status_in == faulted ? trace_event::faulted : trace_event::canceled, id(), 0);
+			uint32_t previous = state.exchange(status_in, std::memory_order_acq_rel);
+			if (previous & waiter_flag) {
+				state.notify_all();
+			}
+			run_continuations(transfer);
+		}
+
+		void wait() {
+			if (is_completed()) {
+				return;
+			}
+
+			auto is_pending = [this]() { return !is_completed(); };
+			if (!executor::help_while(is_pending)) {
+				block_until_completed();
+			}
+		}
+
+		void throw_if_failed() {
+			wait();
+			if (error) {
+				std::rethrow_exception(error);
+			}
+			if (status() == canceled) {
+				throw task_cancelled();
+			}
+		}
+
+		// the result in place, shared by every copy of the task.
+		const value_type& get_ref() {
+			throw_if_failed();
+			if (taken.load(std::memory_order_acquire)) {
+				throw std::logic_error("task result was taken");
+			}
+			return *result;
+		}
+
+		T take() {
+			throw_if_failed();
+			if constexpr (!std::is_void_v<T>) {
+				if (taken.exchange(true, std::memory_order_acq_rel)) {
+					throw std::logic_error("task result was taken");
+				}
+				return std::move(*result);
+			}
+		}
+
+		// a copy of the result; moved out instead if nobody else can see it or T can't be copied.
+		T get(bool sole_owner = false) {
+			if constexpr (std::is_void_v<T>) {
+				throw_if_failed();
+			}
+			else if constexpr (!std::is_copy_constructible_v<T>) {
+				return take();
+			}
+			else if (sole_owner) {
+				return take();
+			}
+			else {
+				return get_ref();
+			}
 		}
 	};
 
+	template<typename T, typename ...Args>
+	static std::shared_ptr<dispatch_block<T>> make_dispatch_block(Args&&... args)
+	{
+		if (block_pool::enabled()) {
+			return std::allocate_shared<dispatch_block<T>>(pool_allocator<dispatch_block<T>>{}, std::forward<Args>(args)...);
+		}
+		return std::make_shared<dispatch_block<T>>(std::forward<Args>(args)...);
+	}
+
 	template<typename T>
 	class task_base : public task_t
 	{
 	protected:
-		std::shared_ptr<callable_t<T>> callable;
 		std::shared_ptr<dispatch_block<T>> signal;
 
 	protected:
-		task_base(callable_t<T>* const& callableIn, bool child = false)
+		task_base(task_function<T>&& callableIn, bool child = false)
 			:
-			callable(callableIn),
-			signal(std::make_shared<dispatch_block<T>>(child))
+			signal(make_dispatch_block<T>(std::move(callableIn), child))
 		{
 		}
 
-		task_base(callable_t<T>* const& callableIn, const cancellation_token& token, bool child = false)
+		task_base(task_function<T>&& callableIn, const cancellation_token& token, bool child = false)
 			:
-			callable(callableIn),
-			signal(std::make_shared<dispatch_block<T>>(token, child))
+			signal(make_dispatch_block<T>(std::move(callableIn), token, child))
 		{
+			signal->watch_cancellation();
 		}
 
+		task_base(task_function<T>&& callableIn, executor& ex, const cancellation_token& token, bool child)
+			:
+			signal(make_dispatch_block<T>(std::move(callableIn), ex, token, child))
+		{
+			signal->watch_cancellation();
+		}
+
+		task_base(const std::shared_ptr<dispatch_block<T>>& signalIn) : signal(signalIn) {}
+
 		task_base(const task_base& rhs) {
-			callable = rhs.callable;
 			signal = rhs.signal;
 		}
 
 		task_base& operator=(const task_base& rhs) {
-			callable = rhs.callable;
 			signal = rhs.signal;
 			return *this;
 		}
 
 		task_base(task_base&& rhs) noexcept {
-			callable = std::move(rhs.callable);
 			signal = std::move(rhs.signal);
 		}
 
 		task_base& operator=(task_base&& rhs) noexcept {
-			callable = std::move(rhs.callable);
 			signal = std::move(rhs.signal);
 			return *this;
 		}
 
-		template<typename T>
-		bool add_child(const task<T>& child) {
-			return signal->add_child(child);
-		}
-
-		void dispatch_child() {
-			auto childs = signal->mark_dispatch();
-			for (auto& child : childs) {
-				child->dispatch();
-			}
-		}
-
 		void throw_if_child_task() {
 			if (signal->is_child()) {
 				throw std::logic_error("start child task");
@@ -342,225 +586,367 @@ namespace cpptask
 		}
 
 	public:
-		const aggregate_exception& exception() const {
+		aggregate_exception exception() const {
 			return signal->exception();
 		}
 
-		virtual void operator()() = 0;
+		// null unless the task faulted.
+		std::exception_ptr exception_ptr() const { return signal->exception_ptr(); }
+
+		void operator()() {
+			signal->run();
+		}
 
 		virtual void wait() override {
-			signal->wait_if_is_self_child();
-			signal->dispatch_token.wait();
+			signal->wait();
+		}
+
+		// a task its token canceled before it started is left as it is.
+		virtual void dispatch() override {
+			if (!signal->try_dispatch() && signal->status() != canceled) {
+				throw std::logic_error("task is already started");
+			}
+		}
+
+		void start() {
+			throw_if_child_task();
+			dispatch();
 		}
 
-		bool is_canceled() const { return signal->status == canceled; }
+		bool is_canceled() const { return signal->status() == canceled; }
 
-		bool is_completed() const { return signal->status > running; }
+		bool is_completed() const { return signal->is_completed(); }
 
-		bool is_faulted() const { return signal->status == faulted; }
+		bool is_faulted() const { return signal->status() == faulted; }
 
-		bool is_completed_sucessfully() const { return signal->status == completed; }
+		uint64_t id() const { return signal->id(); }
 
-		task_status get_status() const { return signal->status; }
+		bool is_completed_sucessfully() const { return signal->status() == completed; }
+
+		task_status get_status() const { return signal->status(); }
 
 		task_awaiter<T> get_awaiter() const { return { signal }; }
+
+		task_awaiter<T> operator co_await() const& { return get_awaiter(); }
+
+		// a task awaited as a temporary hands its result over without a copy, unless a copy of it is left elsewhere.
+		task_awaiter<T> operator co_await() && { return { std::move(signal) }; }
+
+		// calls f on the completing thread once the task completes, or right away if it already did.
+		template<typename F, typename = std::enable_if_t<!std::is_pointer_v<std::decay_t<F>>>>
+		void on_completed(F&& f) const {
+			signal->continue_with(new callback_continuation<std::decay_t<F>>(std::forward<F>(f)));
+		}
+
+		// c stays owned by the caller and must live until it ran.
+		void on_completed(continuation* c) const { signal->continue_with(c); }
 	};
 
 	template<typename T>
 	class task : public task_base<T>
 	{
 	public:
-		task(callable_t<T>* const& callableIn, bool child = false) : task_base<T>(callableIn, child)
+		task(task_function<T>&& callableIn, bool child = false) : task_base<T>(std::move(callableIn), child)
 		{}
 
-		task(callable_t<T>* const& callableIn, const cancellation_token& token, bool child = false) : task_base<T>(callableIn, token, child)
+		task(task_function<T>&& callableIn, const cancellation_token& token, bool child = false) : task_base<T>(std::move(callableIn), token, child)
 		{}
 
-		virtual void operator()() override {
-			auto& signal_obj = task_base<T>::signal;
-			try {
-				if (signal_obj->is_canceled()) {
-					throw task_cancelled();
-				}
-				else {
-					T&& value = (*task_base<T>::callable)();
-					if (signal_obj->is_canceled()) {
-						throw task_cancelled();
-					}
+		task(task_function<T>&& callableIn, executor& ex, const cancellation_token& token = {}, bool child = false) : task_base<T>(std::move(callableIn), ex, token, child)
+		{}
 
-					signal_obj->status = completed;
-					signal_obj->result_token_setter.set_value(std::forward<T>(value));
-				}
-			}
-			catch (const task_cancelled& e) {
-				signal_obj->add_exception(e);
-				signal_obj->status = canceled;
-				signal_obj->result_token_setter.set_exception(std::current_exception());
-			}
-			catch (const aggregate_exception& e) {
-				signal_obj->add_exception(e);
-				signal_obj->status = faulted;
-				signal_obj->result_token_setter.set_exception(std::current_exception());
-			}
-			catch (const std::exception& e) {
-				signal_obj->add_exception(e);
-				signal_obj->status = faulted;
-				signal_obj->result_token_setter.set_exception(std::current_exception());
-			}
+		explicit task(const std::shared_ptr<dispatch_block<T>>& signalIn) : task_base<T>(signalIn)
+		{}
 
-			task_base<T>::dispatch_child();
-		}
+		using promise_type = task_promise<T>;
 
-		virtual void dispatch() override {
-			if (task_base<T>::signal->is_dispatchable()) {
-				task_base<T>::signal->set_dispatched(std::async(std::launch::async, [task_obj = *this]() mutable { (task_obj)(); }));
-			}
-			else {
-				throw std::exception("task is already started");
-			}
-		}
-
-		void start() {
-			task_base<T>::throw_if_child_task();
-			dispatch();
-		}
+		template<typename F, typename R = std::decay_t<typename function_traits<std::decay_t<F>>::ReturnType>,
+			typename = std::enable_if_t<std::is_same_v<typename decay_tuple_type<typename function_traits<std::decay_t<F>>::FArgsType>::type, std::tuple<task<T>>>>>
+		task<R> then(F&& fIn, const cancellation_token& token = {}) { return then(task_base<T>::signal->target(), std::forward<F>(fIn), token); }
 
 		template<typename F, typename R = std::decay_t<typename function_traits<std::decay_t<F>>::ReturnType>,
 			typename = std::enable_if_t<std::is_same_v<typename decay_tuple_type<typename function_traits<std::decay_t<F>>::FArgsType>::type, std::tuple<task<T>>>>>
-		task<R> then(F&& fIn);
+		task<R> then(executor& ex, F&& fIn, const cancellation_token& token = {});
+
+		// a copy of the result, as many times as asked from any copy of the task. a T that can't be copied is moved
+		// out instead, once.
+		T get() const& { return task_base<T>::signal->get(); }
 
-		T get() { return task_base<T>::signal->result_token.get(); }
+		// moves the result out if no other copy of the task is left, copies it otherwise.
+		T get() && {
+			auto& block = task_base<T>::signal;
+			block->wait();
+			return block->get(block.use_count() == 1);
+		}
+
+		// the result without a copy, valid as long as a copy of the task lives.
+		const T& get_ref() const { return task_base<T>::signal->get_ref(); }
+
+		// moves the result out for good; get(), get_ref() and take() on any copy throw std::logic_error after that.
+		T take() const { return task_base<T>::signal->take(); }
+
+		// awaits the task and yields get_ref(); the task has to outlive the reference.
+		task_ref_awaiter<T> by_ref() const { return { task_base<T>::signal }; }
 	};
 
 	template<>
 	class task<void> : public task_base<void>
 	{
 	public:
-		task(callable_t<void>* const& callableIn, bool child = false) : task_base<void>(callableIn, child)
+		task(task_function<void>&& callableIn, bool child = false) : task_base<void>(std::move(callableIn), child)
 		{}
 
-		task(callable_t<void>* const& callableIn, const cancellation_token& token, bool child = false) : task_base<void>(callableIn, token, child)
+		task(task_function<void>&& callableIn, const cancellation_token& token, bool child = false) : task_base<void>(std::move(callableIn), token, child)
 		{}
 
-		virtual void operator()() override {
-			auto& signal_obj = task_base<void>::signal;
-			try {
-				if (signal_obj->is_canceled()) {
-					throw task_cancelled();
-				}
-				else {
-					(*task_base<void>::callable)();
-					if (signal_obj->is_canceled()) {
-						throw task_cancelled();
-					}
+		task(task_function<void>&& callableIn, executor& ex, const cancellation_token& token = {}, bool child = false) : task_base<void>(std::move(callableIn), ex, token, child)
+		{}
 
-					signal_obj->status = completed;
-					signal_obj->result_token_setter.set_value();
-				}
-			}
-			catch (const task_cancelled& e) {
-				signal_obj->add_exception(e);
-				signal_obj->status = canceled;
-				signal_obj->result_token_setter.set_exception(std::current_exception());
-			}
-			catch (const aggregate_exception& e) {
-				signal_obj->add_exception(e);
-				signal_obj->status = faulted;
-				signal_obj->result_token_setter.set_exception(std::current_exception());
-			}
-			catch (const std::exception& e) {
-				signal_obj->add_exception(e);
-				signal_obj->status = faulted;
-				signal_obj->result_token_setter.set_exception(std::current_exception());
-			}
+		explicit task(const std::shared_ptr<dispatch_block<void>>& signalIn) : task_base<void>(signalIn)
+		{}
+
+		using promise_type = task_promise<void>;
+
+		template<typename F, typename R = std::decay_t<typename function_traits<std::decay_t<F>>::ReturnType>,
+			typename = std::enable_if_t<std::is_same_v<typename decay_tuple_type<typename function_traits<std::decay_t<F>>::FArgsType>::type, std::tuple<task<void>>>>>
+		task<R> then(F&& fIn, const cancellation_token& token = {}) { return then(task_base<void>::signal->target(), std::forward<F>(fIn), token); }
+
+		template<typename F, typename R = std::decay_t<typename function_traits<std::decay_t<F>>::ReturnType>,
+			typename = std::enable_if_t<std::is_same_v<typename decay_tuple_type<typename function_traits<std::decay_t<F>>::FArgsType>::type, std::tuple<task<void>>>>>
+		task<R> then(executor& ex, F&& fIn, const cancellation_token& token = {});
+
+		void get() const { task_base<void>::signal->get(); }
+	};
+
+	template<typename T>
+	class task_awaiter {
+	protected:
+		std::shared_ptr<dispatch_block<T>> signal;
 
-			task_base<void>::dispatch_child();
+	public:
+		task_awaiter(const std::shared_ptr<dispatch_block<T>>& signalIn) : signal(signalIn) {}
+
+		task_awaiter(std::shared_ptr<dispatch_block<T>>&& signalIn) : signal(std::move(signalIn)) {}
+
+		bool is_completed() { return signal->is_completed(); }
+
+		T get_result() { return await_resume(); }
+
+		bool await_ready() const { return signal->is_completed(); }
+
+		void await_suspend(std::coroutine_handle<> handle) {
+			executor* current = executor::current_executor();
+			signal->continue_with(new coroutine_continuation(handle, current != nullptr ? *current : default_executor()));
 		}
 
-		virtual void dispatch() override {
-			if (task_base<void>::signal->is_dispatchable()) {
-				task_base<void>::signal->set_dispatched(std::async(std::launch::async, [task_obj = *this]() mutable { (task_obj)(); }));
-			} else {
-				throw std::exception("task is already started");
+		// the awaiter holding the only reference moves the result out.
+		T await_resume() { return signal->get(signal.use_count() == 1); }
+	};
+
+	template<typename T>
+	class task_ref_awaiter : public task_awaiter<T> {
+	public:
+		task_ref_awaiter(const std::shared_ptr<dispatch_block<T>>& signalIn) : task_awaiter<T>(signalIn) {}
+
+		const T& await_resume() { return task_awaiter<T>::signal->get_ref(); }
+	};
+
+	// a function returning task<T> may co_await; it runs on the calling thread up to its first suspension,
+	// and the task completes at co_return.
+	template<typename T>
+	class task_promise_base {
+	protected:
+		std::shared_ptr<dispatch_block<T>> block;
+		task_status final_status;
+
+		struct final_awaiter {
+			bool await_ready() noexcept { return false; }
+
+			// the awaiting coroutine, if any, is resumed by symmetric transfer so long await chains don't grow the stack.
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<task_promise<T>> handle) noexcept {
+				auto& promise = handle.promise();
+				auto completed_block = std::move(promise.block);
+				auto status_out = promise.final_status;
+				handle.destroy();
+
+				continuation* transfer = nullptr;
+				completed_block->complete(status_out, &transfer);
+				if (transfer != nullptr) {
+					auto next = static_cast<coroutine_continuation*>(transfer)->handle;
+					delete transfer;
+					return next;
+				}
+				return std::noop_coroutine();
 			}
-		}
 
-		void start() {
-			throw_if_child_task();
-			dispatch();
+			void await_resume() noexcept {}
+		};
+
+	public:
+		task_promise_base() : final_status(completed) {
+			executor* current = executor::current_executor();
+			block = make_dispatch_block<T>(task_function<T>{}, current != nullptr ? *current : default_executor(), cancellation_token{}, false);
+			block->try_mark_running();
+			CPPTASK_TRACE_EVENT(trace_event::started, block->id(), 0);
 		}
 
-		template<typename F, typename R = std::decay_t<typename function_traits<std::decay_t<F>>::ReturnType>,
-			typename = std::enable_if_t<std::is_same_v<typename decay_tuple_type<typename function_traits<std::decay_t<F>>::FArgsType>::type, std::tuple<task<void>>>>>
-		task<R> then(F&& fIn);
+		task<T> get_return_object() { return task<T>(block); }
+
+		std::suspend_never initial_suspend() noexcept { return {}; }
 
-		void get() { task_base<void>::signal->result_token.get(); }
+		final_awaiter final_suspend() noexcept { return {}; }
+
+		void unhandled_exception() { final_status = block->capture_current_exception(); }
 	};
 
 	template<typename T>
-	class task_awaiter {
+	class task_promise : public task_promise_base<T> {
+	public:
+		template<typename U>
+		void return_value(U&& value) { task_promise_base<T>::block->emplace_result(std::forward<U>(value)); }
+	};
+
+	template<>
+	class task_promise<void> : public task_promise_base<void> {
+	public:
+		void return_void() { block->emplace_result(); }
+	};
+
+	// a task completed by hand rather than by running a callable.
+	template<typename T>
+	class task_completion_source {
 	private:
 		std::shared_ptr<dispatch_block<T>> signal;
 
 	public:
-		task_awaiter(const std::shared_ptr<dispatch_block<T>>& signalIn) : signal(signalIn) {}
+		task_completion_source(executor& ex = default_executor())
+			:
+			signal(make_dispatch_block<T>(task_function<T>{}, ex, cancellation_token{}, false))
+		{
+			signal->try_mark_running();
+		}
+
+		task<T> get_task() const { return task<T>(signal); }
 
-		bool is_completed() { return signal->status > running; }
+		template<typename ...U>
+		bool try_set_result(U&&... value) {
+			if (!signal->try_claim()) {
+				return false;
+			}
+			signal->emplace_result(std::forward<U>(value)...);
+			signal->complete(completed);
+			return true;
+		}
+
+		// the task faults with e, whatever its type, like TrySetException.
+		bool try_set_exception(std::exception_ptr e) {
+			if (!signal->try_claim()) {
+				return false;
+			}
+			signal->complete_faulted(std::move(e));
+			return true;
+		}
+
+		bool try_set_canceled() {
+			if (!signal->try_claim()) {
+				return false;
+			}
+			signal->complete(canceled);
+			return true;
+		}
 
-		T get_result() { return signal->result_token.get(); }
+		template<typename ...U>
+		void set_result(U&&... value) {
+			if (!try_set_result(std::forward<U>(value)...)) {
+				throw std::logic_error("task is already completed");
+			}
+		}
+
+		void set_exception(std::exception_ptr e) {
+			if (!try_set_exception(e)) {
+				throw std::logic_error("task is already completed");
+			}
+		}
+
+		void set_canceled() {
+			if (!try_set_canceled()) {
+				throw std::logic_error("task is already completed");
+			}
+		}
 	};
 
-	template<typename F, typename ...Args>
+	template<typename T>
+	struct dispatch_continuation : continuation {
+		task<T> child;
+
+		dispatch_continuation(const task<T>& childIn) : child(childIn) {}
+
+		void run() override {
+			child.dispatch();
+			delete this;
+		}
+	};
+
+	template<typename F, typename = std::enable_if_t<!is_executor_v<F>>, typename ...Args>
 	static inline auto make_task(F&& f, Args&&... args)
 	{
-		return task<typename func_wrapper<F, Args...>::ReturnType>(make_func_wrapper_pointer(std::forward<F>(f), std::forward<Args>(args)...));
+		return task<bound_result_t<F, Args...>>(make_bound_call(std::forward<F>(f), std::forward<Args>(args)...));
 	}
 
 	template<typename F, typename ...Args>
-	static inline auto make_task_with_cancellation_token(const cancellation_token& token, F&& f, Args&&... args)
+	static inline auto make_task(executor& ex, F&& f, Args&&... args)
 	{
-		return task<typename func_wrapper<F, Args...>::ReturnType>(make_func_wrapper_pointer(std::forward<F>(f), std::forward<Args>(args)...), token);
+		return task<bound_result_t<F, Args...>>(make_bound_call(std::forward<F>(f), std::forward<Args>(args)...), ex);
 	}
 
 	template<typename F, typename ...Args>
+	static inline auto make_task_with_cancellation_token(const cancellation_token& token, F&& f, Args&&... args)
+	{
+		return task<bound_result_t<F, Args...>>(make_bound_call(std::forward<F>(f), std::forward<Args>(args)...), token);
+	}
+
+	template<typename F, typename = std::enable_if_t<!is_executor_v<F>>, typename ...Args>
 	static inline auto run_async(F&& f, Args&&... args)
 	{
 		auto task_source = make_task(std::forward<F>(f), std::forward<Args>(args)...);
-		auto fire_and_forget = std::async(std::launch::async, [](auto&& task_obj) { task_obj.dispatch(); }, task_source);
+		task_source.dispatch();
+
+		return task_source;
+	}
+
+	template<typename F, typename ...Args>
+	static inline auto run_async(executor& ex, F&& f, Args&&... args)
+	{
+		auto task_source = make_task(ex, std::forward<F>(f), std::forward<Args>(args)...);
+		task_source.dispatch();
 
 		return task_source;
 	}
 
 	template<typename T> template<typename F, typename R, typename>
-	task<R> task<T>::then(F&& fIn)
+	task<R> task<T>::then(executor& ex, F&& fIn, const cancellation_token& token)
 	{
 		auto entangled = [f = std::forward<F>(fIn), task_obj = *this]() mutable {
-			task_obj.wait();
 			return f(task_obj);
 		};
 
-		auto child_task = task<R>(make_func_wrapper_pointer(entangled), true);
-		if (!task_base<T>::add_child(child_task))
-		{
-			child_task.dispatch();
-		}
+		auto child_task = task<R>(std::move(entangled), ex, token, true);
+		CPPTASK_TRACE_EVENT(trace_event::linked, child_task.id(), task_base<T>::signal->id());
+		task_base<T>::signal->continue_with(new dispatch_continuation<R>(child_task));
 
 		return child_task;
 	}
 
 	template<typename F, typename R, typename>
-	task<R> task<void>::then(F&& fIn)
+	task<R> task<void>::then(executor& ex, F&& fIn, const cancellation_token& token)
 	{
 		auto entangled = [f = std::forward<F>(fIn), task_obj = *this]() mutable {
-			task_obj.wait();
 			return f(task_obj);
 		};
 
-		auto child_task = task<R>(make_func_wrapper_pointer(entangled), true);
-		if (!task_base<void>::add_child(child_task))
-		{
-			child_task.dispatch();
-		}
+		auto child_task = task<R>(std::move(entangled), ex, token, true);
+		CPPTASK_TRACE_EVENT(trace_event::linked, child_task.id(), task_base<void>::signal->id());
+		task_base<void>::signal->continue_with(new dispatch_continuation<R>(child_task));
 
 		return child_task;
 	}
@@ -0,0 +1,418 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "topology.h"
+
+namespace cpptask
+{
+	// size classed pool for task state. every thread allocates from and frees into its own cache,
+	// full caches hand blocks back to a shared depot a batch at a time, so blocks freed on another thread
+	// than the one that allocated them come back without touching the global allocator.
+	// memory taken from the system stays in the pool.
+	// blocks are carved from spans taken by a thread of one NUMA node, which first touches them, and each node has
+	// depots of its own. a block freed on another node is handed back to the depot of its span's node, so task state
+	// is reused on the node whose memory holds it.
+	class block_pool {
+	public:
+		static constexpr size_t block_granularity = 64;
+		static constexpr size_t size_class_count = 16;
+		static constexpr size_t max_block_size = block_granularity * size_class_count;
+		static constexpr size_t batch_size = 32;
+		// nodes beyond that share depots.
+		static constexpr size_t max_nodes = 8;
+		static constexpr size_t span_size = size_t(64) << 10;
+
+		struct statistics {
+			size_t live_blocks;
+			size_t pooled_blocks;
+		};
+
+	private:
+		struct free_node {
+			free_node* next;
+		};
+
+		struct batch {
+			free_node* head;
+			size_t count;
+		};
+
+		// the header at the start of every span, which is aligned to its size.
+		struct span {
+			size_t node;
+		};
+
+		struct thread_cache {
+			block_pool* owner;
+			size_t node;
+			free_node* heads[size_class_count];
+			std::atomic<size_t> counts[size_class_count];
+			// blocks of other nodes' spans, gathered into batches for their depots.
+			free_node* remote_heads[max_nodes][size_class_count];
+			std::atomic<size_t> remote_counts[max_nodes][size_class_count];
+
+			thread_cache(block_pool* ownerIn) : owner(ownerIn), node(current_numa_node % max_nodes), heads{}, remote_heads{} {
+				for (auto& count : counts) {
+					count.store(0, std::memory_order_relaxed);
+				}
+				for (auto& node_counts : remote_counts) {
+					for (auto& count : node_counts) {
+						count.store(0, std::memory_order_relaxed);
+					}
+				}
+				owner->register_cache(this);
+			}
+
+			~thread_cache() {
+				owner->release_cache(this);
+				cache_state = cache_destroyed;
+			}
+		};
+
+		struct depot {
+			std::mutex mtx;
+			std::vector<batch> batches;
+		};
+
+		enum : int { cache_none, cache_alive, cache_destroyed };
+		inline static thread_local int cache_state = cache_none;
+
+		depot depots[max_nodes][size_class_count];
+		std::atomic<size_t> carved_blocks;
+		std::atomic<size_t> depot_blocks;
+		std::mutex caches_mtx;
+		std::vector<thread_cache*> caches;
+		std::atomic<bool> enabled_flag;
+
+		block_pool() : carved_blocks(0), depot_blocks(0), enabled_flag(false) {}
+
+		static size_t size_class(size_t size) { return size == 0 ? 0 : (size - 1) / block_granularity; }
+
+		static size_t class_size(size_t index) { return (index + 1) * block_granularity; }
+
+		static size_t home_node(const void* block) { return reinterpret_cast<const span*>(reinterpret_cast<uintptr_t>(block) & ~(span_size - 1))->node; }
+
+		thread_cache* local_cache() {
+			if (cache_state == cache_destroyed) {
+				return nullptr;
+			}
+
+			thread_local thread_cache cache(this);
+			cache_state = cache_alive;
+			return &cache;
+		}
+
+		void register_cache(thread_cache* cache) {
+			std::lock_guard<std::mutex> lk(caches_mtx);
+			caches.push_back(cache);
+		}
+
+		void release_cache(thread_cache* cache) {
+			for (size_t index = 0; index < size_class_count; ++index) {
+				size_t count = cache->counts[index].load(std::memory_order_relaxed);
+				if (count != 0) {
+					push_depot(cache->node, index, { cache->heads[index], count });
+					cache->heads[index] = nullptr;
+					cache->counts[index].store(0, std::memory_order_relaxed);
+				}
+				for (size_t node = 0; node < max_nodes; ++node) {
+					count = cache->remote_counts[node][index].load(std::memory_order_relaxed);
+					if (count != 0) {
+						push_depot(node, index, { cache->remote_heads[node][index], count });
+						cache->remote_heads[node][index] = nullptr;
+						cache->remote_counts[node][index].store(0, std::memory_order_relaxed);
+					}
+				}
+			}
+
+			std::lock_guard<std::mutex> lk(caches_mtx);
+			for (auto& registered : caches) {
+				if (registered == cache) {
+					registered = caches.back();
+					caches.pop_back();
+					break;
+				}
+			}
+		}
+
+		void push_depot(size_t node, size_t index, batch b) {
+			depot& d = depots[node][index];
+			std::lock_guard<std::mutex> lk(d.mtx);
+			d.batches.push_back(b);
+			depot_blocks.fetch_add(b.count, std::memory_order_relaxed);
+		}
+
+		// a batch from the node's depot, or from a new span carved on this thread; the batches past the first
+		// go to the depot.
+		batch refill(size_t node, size_t index) {
+			{
+				depot& d = depots[node][index];
+				std::lock_guard<std::mutex> lk(d.mtx);
+				if (!d.batches.empty()) {
+					batch b = d.batches.back();
+					d.batches.pop_back();
+					depot_blocks.fetch_sub(b.count, std::memory_order_relaxed);
+					return b;
+				}
+			}
+
+			const size_t bytes = class_size(index);
+			const size_t block_count = (span_size - block_granularity) / bytes;
+			auto* memory = static_cast<unsigned char*>(::operator new(span_size, std::align_val_t{ span_size }));
+			::new (memory) span{ node };
+			unsigned char* blocks = memory + block_granularity;
+			carved_blocks.fetch_add(block_count, std::memory_order_relaxed);
+
+			batch first = { nullptr, 0 };
+			for (size_t begin = 0; begin < block_count; begin += batch_size) {
+				const size_t end = std::min(begin + batch_size, block_count);
+				free_node* head = nullptr;
+				for (size_t i = end; i-- > begin;) {
+					auto* block = reinterpret_cast<free_node*>(blocks + i * bytes);
+					block->next = head;
+					head = block;
+				}
+				if (begin == 0) {
+					first = { head, end - begin };
+				}
+				else {
+					push_depot(node, index, { head, end - begin });
+				}
+			}
+			return first;
+		}
+
+		void spill(thread_cache* cache, size_t index) {
+			free_node* head = cache->heads[index];
+			free_node* tail = head;
+			for (size_t i = 1; i < batch_size; ++i) {
+				tail = tail->next;
+			}
+			cache->heads[index] = tail->next;
+			tail->next = nullptr;
+			cache->counts[index].fetch_sub(batch_size, std::memory_order_relaxed);
+			push_depot(cache->node, index, { head, batch_size });
+		}
+
+	public:
+		block_pool(const block_pool&) = delete;
+		block_pool& operator=(const block_pool&) = delete;
+
+		// never destroyed, blocks may be returned during static destruction.
+		static block_pool& instance() {
+			static block_pool* pool = new block_pool();
+			return *pool;
+		}
+
+		static bool enabled() { return instance().enabled_flag.load(std::memory_order_relaxed); }
+
+		// library wide switch : while enabled, make_task, run_async and then allocate task state from the pool.
+		static void set_enabled(bool enable) { instance().enabled_flag.store(enable, std::memory_order_relaxed); }
+
+		void* allocate(size_t size) {
+			if (size > max_block_size) {
+				return ::operator new(size, std::align_val_t{ block_granularity });
+			}
+
+			const size_t index = size_class(size);
+			thread_cache* cache = local_cache();
+			if (cache == nullptr) {
+				const size_t node = current_numa_node % max_nodes;
+				batch b = refill(node, index);
+				if (b.head->next != nullptr) {
+					push_depot(node, index, { b.head->next, b.count - 1 });
+				}
+				return b.head;
+			}
+
+			if (cache->heads[index] == nullptr) {
+				batch b = refill(cache->node, index);
+				cache->heads[index] = b.head;
+				cache->counts[index].fetch_add(b.count, std::memory_order_relaxed);
+			}
+
+			free_node* node = cache->heads[index];
+			cache->heads[index] = node->next;
+			cache->counts[index].fetch_sub(1, std::memory_order_relaxed);
+			return node;
+		}
+
+		void deallocate(void* p, size_t size) {
+			if (size > max_block_size) {
+				::operator delete(p, std::align_val_t{ block_granularity });
+				return;
+			}
+
+			const size_t index = size_class(size);
+			const size_t home = home_node(p);
+			auto* block = static_cast<free_node*>(p);
+			thread_cache* cache = local_cache();
+			if (cache == nullptr) {
+				block->next = nullptr;
+				push_depot(home, index, { block, 1 });
+				return;
+			}
+
+			if (home != cache->node) {
+				block->next = cache->remote_heads[home][index];
+				cache->remote_heads[home][index] = block;
+				const size_t count = cache->remote_counts[home][index].fetch_add(1, std::memory_order_relaxed) + 1;
+				if (count >= batch_size) {
+					push_depot(home, index, { block, count });
+					cache->remote_heads[home][index] = nullptr;
+					cache->remote_counts[home][index].store(0, std::memory_order_relaxed);
+				}
+				return;
+			}
+
+			block->next = cache->heads[index];
+			cache->heads[index] = block;
+			if (cache->counts[index].fetch_add(1, std::memory_order_relaxed) + 1 >= batch_size * 2) {
+				spill(cache, index);
+			}
+		}
+
+		statistics stats() {
+			size_t pooled = depot_blocks.load(std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lk(caches_mtx);
+				for (auto* cache : caches) {
+					for (const auto& count : cache->counts) {
+						pooled += count.load(std::memory_order_relaxed);
+					}
+					for (const auto& node_counts : cache->remote_counts) {
+						for (const auto& count : node_counts) {
+							pooled += count.load(std::memory_order_relaxed);
+						}
+					}
+				}
+			}
+
+			const size_t carved = carved_blocks.load(std::memory_order_relaxed);
+			return { carved > pooled ? carved - pooled : 0, pooled };
+		}
+	};
+
+	template<typename T>
+	struct pool_allocator {
+		using value_type = T;
+
+		static_assert(alignof(T) <= block_pool::block_granularity, "over-aligned task state");
+
+		pool_allocator() noexcept = default;
+
+		template<typename U>
+		pool_allocator(const pool_allocator<U>&) noexcept {}
+
+		T* allocate(size_t n) { return static_cast<T*>(block_pool::instance().allocate(n * sizeof(T))); }
+
+		void deallocate(T* p, size_t n) noexcept { block_pool::instance().deallocate(p, n * sizeof(T)); }
+
+		template<typename U>
+		bool operator==(const pool_allocator<U>&) const noexcept { return true; }
+
+		template<typename U>
+		bool operator!=(const pool_allocator<U>&) const noexcept { return false; }
+	};
+
+	// holds the state of a batch of tasks in segments of up to segment_blocks blocks, every block on cache lines
+	// of its own. the first allocation fixes the block size, a batch of up to segment_blocks tasks is one
+	// contiguous slab. the memory goes back in one piece once the creator and every block released it.
+	// a single block type is allocated from a slab.
+	class task_slab {
+	public:
+		static constexpr size_t segment_blocks = 1024;
+
+	private:
+		struct segment {
+			segment* next;
+		};
+
+		static constexpr size_t header_size = block_pool::block_granularity;
+
+		std::atomic<size_t> references;
+		size_t remaining;
+		size_t stride;
+		size_t free_in_segment;
+		unsigned char* cursor;
+		segment* segments;
+
+		task_slab(size_t countIn) : references(1), remaining(countIn), stride(0), free_in_segment(0), cursor(nullptr), segments(nullptr) {}
+
+		~task_slab() {
+			while (segments != nullptr) {
+				segment* next = segments->next;
+				::operator delete(segments, std::align_val_t{ block_pool::block_granularity });
+				segments = next;
+			}
+		}
+
+		void add_segment() {
+			const size_t blocks = remaining < segment_blocks ? (remaining != 0 ? remaining : 1) : segment_blocks;
+			auto* memory = static_cast<unsigned char*>(::operator new(header_size + stride * blocks, std::align_val_t{ block_pool::block_granularity }));
+			segments = ::new (memory) segment{ segments };
+			cursor = memory + header_size;
+			free_in_segment = blocks;
+		}
+
+	public:
+		task_slab(const task_slab&) = delete;
+		task_slab& operator=(const task_slab&) = delete;
+
+		// the creator holds the first reference.
+		static task_slab* create(size_t count) { return new task_slab(count); }
+
+		// allocation happens on the creating thread only; release may come from any thread.
+		void* allocate(size_t size) {
+			if (stride == 0) {
+				stride = (size + block_pool::block_granularity - 1) / block_pool::block_granularity * block_pool::block_granularity;
+			}
+			if (free_in_segment == 0) {
+				add_segment();
+			}
+
+			void* block = cursor;
+			cursor += stride;
+			--free_in_segment;
+			remaining -= remaining != 0 ? 1 : 0;
+			references.fetch_add(1, std::memory_order_relaxed);
+			return block;
+		}
+
+		void release() {
+			if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete this;
+			}
+		}
+	};
+
+	template<typename T>
+	struct slab_allocator {
+		using value_type = T;
+
+		static_assert(alignof(T) <= block_pool::block_granularity, "over-aligned task state");
+
+		task_slab* slab;
+
+		slab_allocator(task_slab* slabIn) noexcept : slab(slabIn) {}
+
+		template<typename U>
+		slab_allocator(const slab_allocator<U>& rhs) noexcept : slab(rhs.slab) {}
+
+		T* allocate(size_t n) { return static_cast<T*>(slab->allocate(n * sizeof(T))); }
+
+		void deallocate(T*, size_t) noexcept { slab->release(); }
+
+		template<typename U>
+		bool operator==(const slab_allocator<U>& rhs) const noexcept { return slab == rhs.slab; }
+
+		template<typename U>
+		bool operator!=(const slab_allocator<U>& rhs) const noexcept { return slab != rhs.slab; }
+	};
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
+namespace cpptask
+{
+	// move-only type erased callable with inline storage.
+	// callables that fit in inline_size bytes and are nothrow movable are stored in place, anything else on the heap.
+	template<typename R>
+	class task_function {
+	public:
+		static constexpr size_t inline_size = 56;
+
+	private:
+		struct vtable {
+			R(*invoke)(void*);
+			void(*move)(void* dst, void* src) noexcept;
+			void(*destroy)(void*) noexcept;
+		};
+
+		template<typename F>
+		static constexpr bool stored_inline = sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<F>;
+
+		template<typename F>
+		struct inline_ops {
+			static F* get(void* p) { return std::launder(reinterpret_cast<F*>(p)); }
+
+			static R invoke(void* p) { return (*get(p))(); }
+
+			static void move(void* dst, void* src) noexcept {
+				::new (dst) F(std::move(*get(src)));
+				get(src)->~F();
+			}
+
+			static void destroy(void* p) noexcept { get(p)->~F(); }
+
+			static constexpr vtable table{ &invoke, &move, &destroy };
+		};
+
+		template<typename F>
+		struct heap_ops {
+			static F*& get(void* p) { return *std::launder(reinterpret_cast<F**>(p)); }
+
+			static R invoke(void* p) { return (*get(p))(); }
+
+			static void move(void* dst, void* src) noexcept {
+				::new (dst) F*(get(src));
+			}
+
+			static void destroy(void* p) noexcept { delete get(p); }
+
+			static constexpr vtable table{ &invoke, &move, &destroy };
+		};
+
+		alignas(std::max_align_t) unsigned char storage[inline_size];
+		const vtable* ops;
+
+	public:
+		task_function() noexcept : ops(nullptr) {}
+
+		template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, task_function>>>
+		task_function(F&& f) {
+			using Func = std::decay_t<F>;
+			if constexpr (stored_inline<Func>) {
+				::new (static_cast<void*>(storage)) Func(std::forward<F>(f));
+				ops = &inline_ops<Func>::table;
+			}
+			else {
+				::new (static_cast<void*>(storage)) Func*(new Func(std::forward<F>(f)));
+				ops = &heap_ops<Func>::table;
+			}
+		}
+
+		task_function(task_function&& rhs) noexcept : ops(rhs.ops) {
+			if (ops != nullptr) {
+				ops->move(storage, rhs.storage);
+				rhs.ops = nullptr;
+			}
+		}
+
+		task_function& operator=(task_function&& rhs) noexcept {
+			if (this != &rhs) {
+				reset();
+				if (rhs.ops != nullptr) {
+					rhs.ops->move(storage, rhs.storage);
+					ops = std::exchange(rhs.ops, nullptr);
+				}
+			}
+			return *this;
+		}
+
+		task_function(const task_function&) = delete;
+		task_function& operator=(const task_function&) = delete;
+
+		~task_function() { reset(); }
+
+		void reset() noexcept {
+			if (ops != nullptr) {
+				std::exchange(ops, nullptr)->destroy(storage);
+			}
+		}
+
+		explicit operator bool() const noexcept { return ops != nullptr; }
+
+		R operator()() { return ops->invoke(storage); }
+	};
+
+	// binds the arguments of make_task to the callable; they are moved into the call when the task runs.
+	template<typename F, typename ...Args>
+	struct bound_call {
+		F func;
+		std::tuple<Args...> params;
+
+		decltype(auto) operator()() { return std::apply(func, std::move(params)); }
+	};
+
+	template<typename F, typename ...Args>
+	using bound_result_t = std::decay_t<std::invoke_result_t<std::decay_t<F>&, std::decay_t<Args>&&...>>;
+
+	template<typename F, typename ...Args>
+	static auto make_bound_call(F&& f, Args&&... args)
+	{
+		if constexpr (sizeof...(Args) == 0) {
+			return std::decay_t<F>(std::forward<F>(f));
+		}
+		else {
+			return bound_call<std::decay_t<F>, std::decay_t<Args>...>{ std::forward<F>(f), { std::forward<Args>(args)... } };
+		}
+	}
+}
@@ -0,0 +1,321 @@
+#pragma once
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <bit>
+#include <algorithm>
+#include <iterator>
+
+#include "task_function.h"
+
+namespace cpptask
+{
+	// hierarchical hashed timer wheel driven by one thread. four levels of 256 slots cover 2^32 ticks of 100us,
+	// a timer lands in the lowest level its distance fits in and moves down a level each time the level below wraps,
+	// so adding and canceling a timer are O(1) however many are pending.
+	// callbacks run on the timer thread and must be short; post anything heavier to an executor.
+	class timer_wheel {
+	public:
+		using clock = std::chrono::steady_clock;
+		using timer_id = uint64_t;
+
+		static constexpr clock::duration tick = std::chrono::microseconds(100);
+
+	private:
+		static constexpr size_t level_count = 4;
+		static constexpr size_t slot_bits = 8;
+		static constexpr size_t slot_count = size_t(1) << slot_bits;
+		static constexpr uint64_t slot_mask = slot_count - 1;
+		static constexpr uint32_t unlinked = std::numeric_limits<uint32_t>::max();
+		static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+		static constexpr uint64_t never = std::numeric_limits<uint64_t>::max();
+
+		// 24 bytes, linked by index, so cascading a slot walks densely packed nodes; callbacks are kept apart.
+		struct node {
+			uint64_t expire = 0;
+			uint32_t prev = none;
+			uint32_t next = none;
+			uint32_t generation = 1;
+			uint32_t slot = unlinked;
+		};
+
+		struct level {
+			uint32_t slots[slot_count];
+			uint64_t occupied[slot_count / 64] = {};
+
+			level() { std::fill(std::begin(slots), std::end(slots), none); }
+		};
+
+		struct expired {
+			uint32_t index;
+			task_function<void>* callback;
+		};
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<node> nodes;
+		// never moved once created, so the timer thread can run them outside the lock.
+		std::deque<task_function<void>> callbacks;
+		std::vector<uint32_t> free_nodes;
+		level levels[level_count];
+		clock::time_point epoch;
+		uint64_t current;
+		uint64_t wake_tick;
+		size_t armed;
+		bool stopping;
+		std::thread thread;
+
+		uint64_t to_tick(clock::time_point t) const {
+			if (t <= epoch) {
+				return 0;
+			}
+			return static_cast<uint64_t>((t - epoch + tick - clock::duration(1)) / tick);
+		}
+
+		clock::time_point to_time(uint64_t t) const { return epoch + tick * static_cast<clock::rep>(t); }
+
+		void link(uint32_t index) {
+			node& n = nodes[index];
+			const uint64_t delta = n.expire > current ? n.expire - current : 0;
+			size_t l = 0;
+			uint64_t s = 0;
+			for (; l < level_count; ++l) {
+				if (delta < (uint64_t(1) << (slot_bits * (l + 1)))) {
+					s = (n.expire >> (slot_bits * l)) & slot_mask;
+					break;
+				}
+			}
+			if (l == level_count) {
+				// beyond the top level : park in its farthest slot and place again when it cascades.
+				l = level_count - 1;
+				s = ((current >> (slot_bits * l)) + slot_mask) & slot_mask;
+			}
+
+			uint32_t& head = levels[l].slots[s];
+			n.prev = none;
+			n.next = head;
+			if (head != none) {
+				nodes[head].prev = index;
+			}
+			head = index;
+			levels[l].occupied[s / 64] |= uint64_t(1) << (s % 64);
+			n.slot = static_cast<uint32_t>(l * slot_count + s);
+		}
+
+		void unlink(uint32_t index) {
+			node& n = nodes[index];
+			const size_t l = n.slot / slot_count;
+			const size_t s = n.slot % slot_count;
+			if (n.prev != none) {
+				nodes[n.prev].next = n.next;
+			}
+			else {
+				levels[l].slots[s] = n.next;
+			}
+			if (n.next != none) {
+				nodes[n.next].prev = n.prev;
+			}
+			if (levels[l].slots[s] == none) {
+				levels[l].occupied[s / 64] &= ~(uint64_t(1) << (s % 64));
+			}
+			n.slot = unlinked;
+		}
+
+		uint32_t take_slot(size_t l, size_t s) {
+			uint32_t list = levels[l].slots[s];
+			levels[l].slots[s] = none;
+			levels[l].occupied[s / 64] &= ~(uint64_t(1) << (s % 64));
+			return list;
+		}
+
+		// slots ahead of the current one to the next occupied slot of a level; 0 if the level is empty. the current
+		// slot itself counts as 256 ahead : above level 0 it holds the timers due a full wrap of the level later.
+		uint64_t next_occupied(const level& lv, uint64_t from) const {
+			for (uint64_t d = 1; d <= slot_count;) {
+				const uint64_t s = (from + d) & slot_mask;
+				const uint64_t bits = lv.occupied[s / 64] >> (s % 64);
+				if (bits != 0) {
+					const uint64_t found = d + static_cast<uint64_t>(std::countr_zero(bits));
+					return found <= slot_count ? found : 0;
+				}
+				d += 64 - (s % 64);
+			}
+			return 0;
+		}
+
+		// the next tick at which a slot expires or cascades.
+		uint64_t next_event() const {
+			uint64_t next = never;
+			for (size_t l = 0; l < level_count; ++l) {
+				const size_t shift = slot_bits * l;
+				if (uint64_t d = next_occupied(levels[l], (current >> shift) & slot_mask)) {
+					next = std::min(next, ((current >> shift) + d) << shift);
+				}
+			}
+			return next;
+		}
+
+		void release(uint32_t index) {
+			++nodes[index].generation;
+			free_nodes.push_back(index);
+			--armed;
+		}
+
+		// moves current up to target, collecting every timer that expired on the way. expired nodes are unlinked
+		// but not yet released, so their callbacks can run outside the lock.
+		void advance(uint64_t target, std::vector<expired>& due) {
+			while (current < target) {
+				const uint64_t next = next_event();
+				if (next > target) {
+					current = target;
+					return;
+				}
+
+				current = next;
+				for (size_t l = level_count - 1; l > 0; --l) {
+					const size_t shift = slot_bits * l;
+					if ((current & ((uint64_t(1) << shift) - 1)) == 0) {
+						for (uint32_t index = take_slot(l, (current >> shift) & slot_mask); index != none;) {
+							const uint32_t next_index = nodes[index].next;
+							link(index);
+							index = next_index;
+						}
+					}
+				}
+
+				for (uint32_t index = take_slot(0, current & slot_mask); index != none;) {
+					node& n = nodes[index];
+					const uint32_t next_index = n.next;
+					n.slot = unlinked;
+					++n.generation;
+					due.push_back({ index, &callbacks[index] });
+					index = next_index;
+				}
+			}
+		}
+
+		void loop() {
+			std::vector<expired> due;
+			std::unique_lock<std::mutex> lk(mtx);
+			while (!stopping) {
+				advance(static_cast<uint64_t>((clock::now() - epoch) / tick), due);
+				if (!due.empty()) {
+					lk.unlock();
+					for (auto& e : due) {
+						try {
+							(*e.callback)();
+						}
+						catch (...) {
+						}
+						e.callback->reset();
+					}
+					lk.lock();
+					for (auto& e : due) {
+						free_nodes.push_back(e.index);
+					}
+					armed -= due.size();
+					due.clear();
+					continue;
+				}
+
+				wake_tick = next_event();
+				if (wake_tick == never) {
+					cv.wait(lk);
+				}
+				else {
+					cv.wait_until(lk, to_time(wake_tick));
+				}
+				wake_tick = 0;
+			}
+		}
+
+		timer_wheel() : epoch(clock::now()), current(0), wake_tick(0), armed(0), stopping(false) {
+			thread = std::thread([this]() { loop(); });
+		}
+
+	public:
+		~timer_wheel() {
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				stopping = true;
+			}
+			cv.notify_one();
+			thread.join();
+		}
+
+		timer_wheel(const timer_wheel&) = delete;
+		timer_wheel& operator=(const timer_wheel&) = delete;
+
+		static timer_wheel& instance() {
+			static timer_wheel instance;
+			return instance;
+		}
+
+		// callback runs on the timer thread at the first tick at or after deadline. the returned id is never 0.
+		timer_id add(clock::time_point deadline, task_function<void>&& callback) {
+			std::lock_guard<std::mutex> lk(mtx);
+			uint32_t index = 0;
+			if (!free_nodes.empty()) {
+				index = free_nodes.back();
+				free_nodes.pop_back();
+			}
+			else {
+				index = static_cast<uint32_t>(nodes.size());
+				nodes.emplace_back();
+				callbacks.emplace_back();
+			}
+
+			// an idle timer thread leaves current behind; with nothing due in between, catching it up to now places the
+			// timer by its distance from now rather than from when the thread last ran.
+			const uint64_t now = static_cast<uint64_t>((clock::now() - epoch) / tick);
+			if (now > current && next_event() > now) {
+				current = now;
+			}
+
+			callbacks[index] = std::move(callback);
+			node& n = nodes[index];
+			n.expire = std::max(to_tick(deadline), current + 1);
+			link(index);
+			++armed;
+
+			if (n.expire < wake_tick) {
+				cv.notify_one();
+			}
+			return (static_cast<uint64_t>(n.generation) << 32) | index;
+		}
+
+		timer_id add(clock::duration delay, task_function<void>&& callback) { return add(clock::now() + delay, std::move(callback)); }
+
+		// true if the timer was removed before its callback started.
+		bool cancel(timer_id id) {
+			task_function<void> dropped;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				const uint32_t index = static_cast<uint32_t>(id);
+				if (index >= nodes.size()) {
+					return false;
+				}
+
+				const node& n = nodes[index];
+				if (n.generation != static_cast<uint32_t>(id >> 32) || n.slot == unlinked) {
+					return false;
+				}
+
+				unlink(index);
+				dropped = std::move(callbacks[index]);
+				release(index);
+			}
+			return true;
+		}
+
+		size_t pending() {
+			std::lock_guard<std::mutex> lk(mtx);
+			return armed;
+		}
+	};
+}
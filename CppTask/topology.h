@@ -0,0 +1,208 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+namespace cpptask
+{
+	struct numa_node {
+		std::vector<unsigned> cpus;
+		// distance to every node by index, as the kernel reports it : 10 to itself, more the farther.
+		std::vector<unsigned> distances;
+	};
+
+	// the cpus the process may run on, grouped by NUMA node.
+	class cpu_topology {
+	private:
+		std::vector<numa_node> node_list;
+
+		static constexpr unsigned local_distance = 10;
+		static constexpr unsigned remote_distance = 20;
+
+		// a kernel cpu list like "0-3,8-11".
+		static std::vector<unsigned> parse_cpu_list(const std::string& list) {
+			std::vector<unsigned> cpus;
+			std::stringstream ss(list);
+			std::string range;
+			while (std::getline(ss, range, ',')) {
+				if (range.empty() || range[0] < '0' || range[0] > '9') {
+					continue;
+				}
+				const size_t dash = range.find('-');
+				const unsigned first = static_cast<unsigned>(std::strtoul(range.c_str(), nullptr, 10));
+				const unsigned last = dash == std::string::npos ? first : static_cast<unsigned>(std::strtoul(range.c_str() + dash + 1, nullptr, 10));
+				for (unsigned cpu = first; cpu <= last; ++cpu) {
+					cpus.push_back(cpu);
+				}
+			}
+			return cpus;
+		}
+
+		static std::string read_line(const std::string& path) {
+			std::ifstream file(path);
+			std::string line;
+			std::getline(file, line);
+			return line;
+		}
+
+		// the cpus this process may run on.
+		static std::vector<unsigned> allowed_cpus() {
+			std::vector<unsigned> cpus;
+#if defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+				for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+					if (CPU_ISSET(cpu, &set)) {
+						cpus.push_back(cpu);
+					}
+				}
+			}
+#endif
+			if (cpus.empty()) {
+				const unsigned count = std::max(std::thread::hardware_concurrency(), 1u);
+				for (unsigned cpu = 0; cpu < count; ++cpu) {
+					cpus.push_back(cpu);
+				}
+			}
+			return cpus;
+		}
+
+	public:
+		cpu_topology() = default;
+
+		// nodes without distances are 10 from themselves and 20 from the others.
+		explicit cpu_topology(std::vector<numa_node> nodesIn) : node_list(std::move(nodesIn)) {
+			for (size_t i = 0; i < node_list.size(); ++i) {
+				auto& distances = node_list[i].distances;
+				if (distances.size() != node_list.size()) {
+					distances.assign(node_list.size(), remote_distance);
+					distances[i] = local_distance;
+				}
+			}
+		}
+
+		// one node of cpu_count cpus.
+		static cpu_topology flat(size_t cpu_count) {
+			numa_node node;
+			for (unsigned cpu = 0; cpu < std::max<size_t>(cpu_count, 1); ++cpu) {
+				node.cpus.push_back(cpu);
+			}
+			return cpu_topology({ std::move(node) });
+		}
+
+		// node_count nodes of cpus_per_node cpus each, laid over the cpus the process may run on and wrapping
+		// around them, to exercise node aware placement on a single node machine.
+		static cpu_topology emulated(size_t node_count, size_t cpus_per_node) {
+			const std::vector<unsigned> allowed = allowed_cpus();
+			std::vector<numa_node> nodes(std::max<size_t>(node_count, 1));
+			size_t next = 0;
+			for (auto& node : nodes) {
+				for (size_t i = 0; i < std::max<size_t>(cpus_per_node, 1); ++i) {
+					node.cpus.push_back(allowed[next++ % allowed.size()]);
+				}
+			}
+			return cpu_topology(std::move(nodes));
+		}
+
+		// the nodes of /sys/devices/system/node, keeping the cpus the process may run on; a single node of those
+		// cpus where there is no such directory.
+		static cpu_topology detect() {
+			const std::vector<unsigned> allowed = allowed_cpus();
+			std::vector<numa_node> nodes;
+#if defined(__linux__)
+			std::vector<unsigned> ids;
+			if (DIR* dir = opendir("/sys/devices/system/node")) {
+				while (dirent* entry = readdir(dir)) {
+					const std::string name = entry->d_name;
+					if (name.size() > 4 && name.compare(0, 4, "node") == 0 && name[4] >= '0' && name[4] <= '9') {
+						ids.push_back(static_cast<unsigned>(std::strtoul(name.c_str() + 4, nullptr, 10)));
+					}
+				}
+				closedir(dir);
+			}
+			std::sort(ids.begin(), ids.end());
+
+			std::vector<unsigned> kept;
+			for (unsigned id : ids) {
+				const std::string path = "/sys/devices/system/node/node" + std::to_string(id);
+				numa_node node;
+				for (unsigned cpu : parse_cpu_list(read_line(path + "/cpulist"))) {
+					if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+						node.cpus.push_back(cpu);
+					}
+				}
+				if (node.cpus.empty()) {
+					continue;
+				}
+				// by node id for now, narrowed to the kept nodes below.
+				std::stringstream ss(read_line(path + "/distance"));
+				for (unsigned d = 0; ss >> d;) {
+					node.distances.push_back(d);
+				}
+				kept.push_back(id);
+				nodes.push_back(std::move(node));
+			}
+			for (auto& node : nodes) {
+				std::vector<unsigned> distances;
+				for (unsigned id : kept) {
+					if (id >= node.distances.size()) {
+						distances.clear();
+						break;
+					}
+					distances.push_back(node.distances[id]);
+				}
+				node.distances = std::move(distances);
+			}
+#endif
+			if (nodes.empty()) {
+				nodes.push_back({ allowed, {} });
+			}
+			return cpu_topology(std::move(nodes));
+		}
+
+		const std::vector<numa_node>& nodes() const { return node_list; }
+
+		size_t node_count() const { return node_list.size(); }
+
+		size_t cpu_count() const {
+			size_t count = 0;
+			for (const auto& node : node_list) {
+				count += node.cpus.size();
+			}
+			return count;
+		}
+
+		unsigned distance(size_t from, size_t to) const { return node_list.at(from).distances.at(to); }
+	};
+
+	// the node of the scheduler worker running on this thread, 0 on any other thread.
+	inline thread_local size_t current_numa_node = 0;
+
+	// false where the thread can't be pinned, or on platforms without thread affinity.
+	static inline bool pin_current_thread(unsigned cpu)
+	{
+#if defined(__linux__)
+		if (cpu >= CPU_SETSIZE) {
+			return false;
+		}
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+}
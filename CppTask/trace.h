@@ -0,0 +1,251 @@
+#pragma once
+#include <cstdint>
+
+// tracing is compiled in with CPPTASK_TRACE defined; without it the hooks expand to nothing and their
+// arguments aren't evaluated.
+#if defined(CPPTASK_TRACE)
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <ostream>
+#include <iomanip>
+#endif
+
+namespace cpptask
+{
+	enum class trace_event : uint8_t
+	{
+		created,
+		queued,
+		started,
+		completed,
+		faulted,
+		canceled,
+		// other is the antecedent of a then() continuation.
+		linked,
+	};
+
+	struct trace_record {
+		uint64_t time_ns = 0;
+		uint64_t task = 0;
+		uint64_t other = 0;
+		uint32_t thread = 0;
+		trace_event event = trace_event::created;
+	};
+
+#if defined(CPPTASK_TRACE)
+	// every thread writes its records to its own ring, overwriting the oldest ones once it is full, so recording
+	// takes no lock and never blocks. a snapshot reads the rings while they are being written and skips records
+	// that were overwritten under it.
+	class tracer {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		static constexpr size_t ring_size = size_t(1) << 16;
+
+	private:
+		struct slot {
+			std::atomic<uint64_t> sequence{ 0 };
+			std::atomic<uint64_t> time_ns{ 0 };
+			std::atomic<uint64_t> task{ 0 };
+			std::atomic<uint64_t> other{ 0 };
+			std::atomic<uint8_t> event{ 0 };
+		};
+
+		struct ring {
+			uint32_t thread;
+			std::atomic<uint64_t> head{ 0 };
+			std::unique_ptr<slot[]> slots;
+
+			ring(uint32_t threadIn) : thread(threadIn), slots(new slot[ring_size]) {}
+		};
+
+		std::mutex mtx;
+		// rings outlive their threads, so records of finished threads still show up in a snapshot.
+		std::vector<std::shared_ptr<ring>> rings;
+		std::atomic<uint64_t> next_id_block{ 0 };
+		clock::time_point epoch = clock::now();
+
+		static constexpr uint64_t id_block_size = 1024;
+
+		ring& local_ring() {
+			thread_local std::shared_ptr<ring> local = [this]() {
+				std::lock_guard<std::mutex> lk(mtx);
+				rings.push_back(std::make_shared<ring>(static_cast<uint32_t>(rings.size())));
+				return rings.back();
+			}();
+			return *local;
+		}
+
+		void write(trace_event event, uint64_t task, uint64_t other) {
+			ring& r = local_ring();
+			const uint64_t index = r.head.load(std::memory_order_relaxed);
+			slot& s = r.slots[index & (ring_size - 1)];
+			const uint64_t sequence = s.sequence.load(std::memory_order_relaxed);
+			s.sequence.store(sequence + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			s.time_ns.store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count()), std::memory_order_relaxed);
+			s.task.store(task, std::memory_order_relaxed);
+			s.other.store(other, std::memory_order_relaxed);
+			s.event.store(static_cast<uint8_t>(event), std::memory_order_relaxed);
+			s.sequence.store(sequence + 2, std::memory_order_release);
+			r.head.store(index + 1, std::memory_order_release);
+		}
+
+		static void write_json_number(std::ostream& os, double value) {
+			os << std::fixed << std::setprecision(3) << value << std::defaultfloat;
+		}
+
+	public:
+		static tracer& instance() {
+			static tracer instance;
+			return instance;
+		}
+
+		static void record(trace_event event, uint64_t task, uint64_t other = 0) { instance().write(event, task, other); }
+
+		// ids start at 1 and are handed to threads in blocks, so taking one is a thread local increment.
+		static uint64_t next_id() {
+			thread_local uint64_t next = 0;
+			thread_local uint64_t last = 0;
+			if (next == last) {
+				next = instance().next_id_block.fetch_add(id_block_size, std::memory_order_relaxed) + 1;
+				last = next + id_block_size;
+			}
+			return next++;
+		}
+
+		// the records still held by the rings, oldest first.
+		std::vector<trace_record> snapshot() {
+			std::vector<std::shared_ptr<ring>> current;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				current = rings;
+			}
+
+			std::vector<trace_record> records;
+			for (const auto& r : current) {
+				const uint64_t head = r->head.load(std::memory_order_acquire);
+				for (uint64_t index = head > ring_size ? head - ring_size : 0; index < head; ++index) {
+					slot& s = r->slots[index & (ring_size - 1)];
+					const uint64_t before = s.sequence.load(std::memory_order_acquire);
+					trace_record record;
+					record.time_ns = s.time_ns.load(std::memory_order_relaxed);
+					record.task = s.task.load(std::memory_order_relaxed);
+					record.other = s.other.load(std::memory_order_relaxed);
+					record.event = static_cast<trace_event>(s.event.load(std::memory_order_relaxed));
+					record.thread = r->thread;
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if ((before & 1) == 0 && before != 0 && s.sequence.load(std::memory_order_relaxed) == before) {
+						records.push_back(record);
+					}
+				}
+			}
+
+			std::sort(records.begin(), records.end(), [](const trace_record& lhs, const trace_record& rhs) { return lhs.time_ns < rhs.time_ns; });
+			return records;
+		}
+
+		// drops the recorded events; only meant for quiet moments, records written meanwhile may survive.
+		void clear() {
+			std::lock_guard<std::mutex> lk(mtx);
+			for (const auto& r : rings) {
+				for (size_t i = 0; i < ring_size; ++i) {
+					r->slots[i].sequence.store(0, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// chrome://tracing / Perfetto trace events : a slice per task run on its thread, an async slice for the time
+		// it spent queued, a flow arrow from an antecedent to its continuation, and instants for tasks completed
+		// without running, like canceled or hand completed ones.
+		void write_chrome_trace(std::ostream& os) {
+			struct span {
+				uint64_t created = 0;
+				uint64_t queued = 0;
+				uint64_t started = 0;
+				uint64_t ended = 0;
+				uint64_t parent = 0;
+				uint32_t thread = 0;
+				uint32_t end_thread = 0;
+				trace_event end = trace_event::created;
+				bool has_queued = false;
+				bool has_started = false;
+				bool has_ended = false;
+			};
+
+			std::unordered_map<uint64_t, span> spans;
+			for (const auto& r : snapshot()) {
+				span& s = spans[r.task];
+				switch (r.event) {
+				case trace_event::created: s.created = r.time_ns; break;
+				case trace_event::queued: s.queued = r.time_ns; s.has_queued = true; break;
+				case trace_event::started: s.started = r.time_ns; s.thread = r.thread; s.has_started = true; break;
+				case trace_event::linked: s.parent = r.other; break;
+				default: s.ended = r.time_ns; s.end_thread = r.thread; s.end = r.event; s.has_ended = true; break;
+				}
+			}
+
+			static const char* const status_names[] = { "created", "queued", "started", "completed", "faulted", "canceled", "linked" };
+			bool first = true;
+			auto begin_event = [&]() -> std::ostream& {
+				os << (first ? "\n  " : ",\n  ");
+				first = false;
+				return os;
+			};
+			auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+
+			os << "{ \"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+			for (const auto& [id, s] : spans) {
+				if (!s.has_ended) {
+					continue;
+				}
+
+				if (s.has_started) {
+					begin_event() << "{ \"name\": \"task " << id << "\", \"cat\": \"task\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << s.thread << ", \"ts\": ";
+					write_json_number(os, us(s.started));
+					os << ", \"dur\": ";
+					write_json_number(os, us(s.ended - s.started));
+					os << ", \"args\": { \"id\": " << id << ", \"parent\": " << s.parent << ", \"status\": \"" << status_names[static_cast<size_t>(s.end)] << "\", \"queued_us\": ";
+					write_json_number(os, s.has_queued ? us(s.started - s.queued) : 0.0);
+					os << " } }";
+
+					if (s.has_queued) {
+						begin_event() << "{ \"name\": \"queued\", \"cat\": \"queue\", \"ph\": \"b\", \"id\": " << id << ", \"pid\": 0, \"tid\": " << s.thread << ", \"ts\": ";
+						write_json_number(os, us(s.queued));
+						os << " }";
+						begin_event() << "{ \"name\": \"queued\", \"cat\": \"queue\", \"ph\": \"e\", \"id\": " << id << ", \"pid\": 0, \"tid\": " << s.thread << ", \"ts\": ";
+						write_json_number(os, us(s.started));
+						os << " }";
+					}
+				}
+				else {
+					begin_event() << "{ \"name\": \"task " << id << " " << status_names[static_cast<size_t>(s.end)] << "\", \"cat\": \"task\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 0, \"tid\": " << s.end_thread << ", \"ts\": ";
+					write_json_number(os, us(s.ended));
+					os << ", \"args\": { \"id\": " << id << ", \"parent\": " << s.parent << " } }";
+				}
+
+				auto parent = spans.find(s.parent);
+				if (s.parent != 0 && parent != spans.end() && parent->second.has_ended) {
+					const span& p = parent->second;
+					begin_event() << "{ \"name\": \"then\", \"cat\": \"link\", \"ph\": \"s\", \"id\": " << id << ", \"pid\": 0, \"tid\": " << p.end_thread << ", \"ts\": ";
+					write_json_number(os, us(p.ended));
+					os << " }";
+					begin_event() << "{ \"name\": \"then\", \"cat\": \"link\", \"ph\": \"f\", \"bp\": \"e\", \"id\": " << id << ", \"pid\": 0, \"tid\": " << (s.has_started ? s.thread : s.end_thread) << ", \"ts\": ";
+					write_json_number(os, us(s.has_started ? s.started : s.ended));
+					os << " }";
+				}
+			}
+			os << "\n] }\n";
+		}
+	};
+
+#define CPPTASK_TRACE_EVENT(event, task, other) ::cpptask::tracer::record((event), (task), (other))
+#else
+#define CPPTASK_TRACE_EVENT(event, task, other) ((void)0)
+#endif
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <ostream>
+#include <iomanip>
+#include <sstream>
+
+namespace bench
+{
+	// bumped by the replaced global operator new of the benchmark executable.
+	inline std::atomic<size_t> allocation_count{ 0 };
+
+	using clock = std::chrono::steady_clock;
+
+	static inline double elapsed_ns(clock::time_point begin, clock::time_point end)
+	{
+		return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	}
+
+	struct percentiles {
+		double p50 = 0;
+		double p90 = 0;
+		double p99 = 0;
+		double max = 0;
+		double mean = 0;
+
+		// nearest rank percentiles of samples; sorts them.
+		static percentiles of(std::vector<double>& samples) {
+			percentiles result;
+			if (samples.empty()) {
+				return result;
+			}
+
+			std::sort(samples.begin(), samples.end());
+			auto rank = [&samples](double p) {
+				size_t index = static_cast<size_t>(p * static_cast<double>(samples.size()));
+				return samples[std::min(index, samples.size() - 1)];
+			};
+			result.p50 = rank(0.50);
+			result.p90 = rank(0.90);
+			result.p99 = rank(0.99);
+			result.max = samples.back();
+			result.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / static_cast<double>(samples.size());
+			return result;
+		}
+	};
+
+	struct result {
+		std::string name;
+		std::string variant;
+		size_t threads = 0;
+		size_t operations = 0;
+		double ops_per_second = 0;
+		percentiles latency_ns;
+		double allocations_per_op = 0;
+	};
+
+	// samples are nanoseconds per operation; operations is how many operations one sample covers.
+	static inline result make_result(const std::string& name, const std::string& variant, size_t threads, size_t operations, std::vector<double>& samples, size_t allocations)
+	{
+		result r;
+		r.name = name;
+		r.variant = variant;
+		r.threads = threads;
+		r.operations = operations * samples.size();
+		r.latency_ns = percentiles::of(samples);
+		r.ops_per_second = r.latency_ns.p50 > 0 ? 1e9 / r.latency_ns.p50 : 0;
+		r.allocations_per_op = r.operations != 0 ? static_cast<double>(allocations) / static_cast<double>(r.operations) : 0;
+		return r;
+	}
+
+	class reporter {
+	private:
+		std::vector<result> results;
+
+		static std::string escape(const std::string& text) {
+			std::string escaped;
+			for (char c : text) {
+				if (c == '"' || c == '\\') {
+					escaped += '\\';
+				}
+				escaped += c;
+			}
+			return escaped;
+		}
+
+	public:
+		void add(result r) { results.push_back(std::move(r)); }
+
+		const std::vector<result>& all() const { return results; }
+
+		result& last() { return results.back(); }
+
+		void write_text(std::ostream& os) const {
+			os << std::left << std::setw(14) << "case" << std::setw(16) << "variant" << std::right
+				<< std::setw(8) << "threads" << std::setw(14) << "ops/s"
+				<< std::setw(12) << "p50 ns" << std::setw(12) << "p90 ns" << std::setw(12) << "p99 ns" << std::setw(12) << "max ns"
+				<< std::setw(10) << "alloc/op" << "\n";
+
+			os << std::fixed;
+			for (const auto& r : results) {
+				os << std::left << std::setw(14) << r.name << std::setw(16) << r.variant << std::right
+					<< std::setw(8) << r.threads << std::setw(14) << std::setprecision(0) << r.ops_per_second
+					<< std::setw(12) << std::setprecision(1) << r.latency_ns.p50 << std::setw(12) << r.latency_ns.p90
+					<< std::setw(12) << r.latency_ns.p99 << std::setw(12) << r.latency_ns.max
+					<< std::setw(10) << std::setprecision(2) << r.allocations_per_op << "\n";
+			}
+			os << std::defaultfloat;
+		}
+
+		void write_json(std::ostream& os, size_t hardware_threads) const {
+			os << "{\n  \"hardware_concurrency\": " << hardware_threads << ",\n  \"results\": [";
+			for (size_t i = 0; i < results.size(); ++i) {
+				const auto& r = results[i];
+				os << (i == 0 ? "\n" : ",\n")
+					<< "    { \"name\": \"" << escape(r.name) << "\", \"variant\": \"" << escape(r.variant) << "\""
+					<< ", \"threads\": " << r.threads << ", \"operations\": " << r.operations
+					<< ", \"ops_per_second\": " << r.ops_per_second
+					<< ", \"latency_ns\": { \"p50\": " << r.latency_ns.p50 << ", \"p90\": " << r.latency_ns.p90
+					<< ", \"p99\": " << r.latency_ns.p99 << ", \"max\": " << r.latency_ns.max << ", \"mean\": " << r.latency_ns.mean << " }"
+					<< ", \"allocations_per_op\": " << r.allocations_per_op << " }";
+			}
+			os << "\n  ]\n}\n";
+		}
+
+		void write_csv(std::ostream& os) const {
+			os << "name,variant,threads,operations,ops_per_second,p50_ns,p90_ns,p99_ns,max_ns,mean_ns,allocations_per_op\n";
+			for (const auto& r : results) {
+				os << r.name << ',' << r.variant << ',' << r.threads << ',' << r.operations << ',' << r.ops_per_second << ','
+					<< r.latency_ns.p50 << ',' << r.latency_ns.p90 << ',' << r.latency_ns.p99 << ',' << r.latency_ns.max << ','
+					<< r.latency_ns.mean << ',' << r.allocations_per_op << "\n";
+			}
+		}
+	};
+}
@@ -0,0 +1,1383 @@
+#include "task.h"
+#include "combinators.h"
+#include "parallel.h"
+#include "delay.h"
+#include "bounded.h"
+#include "batch.h"
+#include "pipeline.h"
+#include "channel.h"
+#include "graph.h"
+#include "file_io.h"
+#include "reactor.h"
+#include "cache.h"
+#include "bench.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <fstream>
+#include <future>
+#include <functional>
+#include <condition_variable>
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <sys/resource.h>
+#endif
+#if defined(CPPTASK_BENCH_STD_PAR)
+#include <execution>
+#endif
+
+using namespace std;
+using namespace cpptask;
+
+// every allocation is counted, plain, array and over aligned alike. memory comes from malloc or the aligned
+// allocator and goes back to the matching free; gcc doesn't see that these replacements allocate with malloc
+// and flags each free.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static void* bench_allocate(size_t size, size_t alignment = 0)
+{
+	bench::allocation_count.fetch_add(1, std::memory_order_relaxed);
+	size = size == 0 ? 1 : size;
+	void* p = nullptr;
+	if (alignment <= alignof(std::max_align_t)) {
+		p = std::malloc(size);
+	}
+	else {
+#if defined(_MSC_VER)
+		p = _aligned_malloc(size, alignment);
+#else
+		p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+	}
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+static void bench_free(void* p, size_t alignment = 0) noexcept
+{
+#if defined(_MSC_VER)
+	if (alignment > alignof(std::max_align_t)) {
+		_aligned_free(p);
+		return;
+	}
+#endif
+	(void)alignment;
+	std::free(p);
+}
+
+void* operator new(size_t size) { return bench_allocate(size); }
+void* operator new[](size_t size) { return bench_allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return bench_allocate(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return bench_allocate(size, static_cast<size_t>(alignment)); }
+
+void operator delete(void* p) noexcept { bench_free(p); }
+void operator delete[](void* p) noexcept { bench_free(p); }
+void operator delete(void* p, size_t) noexcept { bench_free(p); }
+void operator delete[](void* p, size_t) noexcept { bench_free(p); }
+void operator delete(void* p, std::align_val_t alignment) noexcept { bench_free(p, static_cast<size_t>(alignment)); }
+void operator delete[](void* p, std::align_val_t alignment) noexcept { bench_free(p, static_cast<size_t>(alignment)); }
+void operator delete(void* p, size_t, std::align_val_t alignment) noexcept { bench_free(p, static_cast<size_t>(alignment)); }
+void operator delete[](void* p, size_t, std::align_val_t alignment) noexcept { bench_free(p, static_cast<size_t>(alignment)); }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+struct bench_context {
+	scheduler& sched;
+	size_t threads;
+	size_t scale;
+	bool first_sweep;
+	bench::reporter& out;
+
+	// iteration counts are divided by scale in quick runs.
+	size_t count(size_t full) const { return std::max<size_t>(full / scale, 1); }
+
+	// baselines that don't run on the scheduler are measured once and reported with 0 threads.
+	bench_context baseline() const { return { sched, 0, scale, first_sweep, out }; }
+};
+
+struct bench_case {
+	const char* name;
+	const char* description;
+	void(*run)(bench_context&);
+};
+
+// runs repetitions of body, each covering operations operations, and records nanoseconds per operation.
+template<typename F>
+static void measure(bench_context& ctx, const string& name, const string& variant, size_t repetitions, size_t operations, F&& body)
+{
+	body();
+
+	vector<double> samples;
+	samples.reserve(repetitions);
+	size_t allocations = bench::allocation_count.load();
+	for (size_t r = 0; r < repetitions; ++r) {
+		auto begin = bench::clock::now();
+		body();
+		samples.push_back(bench::elapsed_ns(begin, bench::clock::now()) / static_cast<double>(operations));
+	}
+	allocations = bench::allocation_count.load() - allocations;
+
+	ctx.out.add(bench::make_result(name, variant, ctx.threads, operations, samples, allocations));
+}
+
+// run_async + get of trivial tasks, with task state from the global allocator and from the block pool.
+static void bench_spawn(bench_context& ctx)
+{
+	const size_t task_count = ctx.count(20000);
+	vector<task<size_t>> tasks;
+	tasks.reserve(task_count);
+
+	auto spawn = [&]() {
+		for (size_t i = 0; i < task_count; ++i) {
+			tasks.push_back(run_async(ctx.sched, [i]() { return i; }));
+		}
+		size_t sum = 0;
+		for (auto& t : tasks) {
+			sum += t.get();
+		}
+		tasks.clear();
+		return sum;
+	};
+
+	for (bool pooled : { false, true }) {
+		block_pool::set_enabled(pooled);
+		measure(ctx, "spawn", pooled ? "pooled" : "system", 20, task_count, spawn);
+	}
+	block_pool::set_enabled(false);
+
+	if (!ctx.first_sweep) {
+		return;
+	}
+
+	auto base = ctx.baseline();
+	const size_t async_count = ctx.count(2000);
+	measure(base, "spawn", "std::async", 5, async_count, [&]() {
+		vector<future<size_t>> futures;
+		futures.reserve(async_count);
+		for (size_t i = 0; i < async_count; ++i) {
+			futures.push_back(std::async(std::launch::async, [i]() { return i; }));
+		}
+		for (auto& f : futures) {
+			f.get();
+		}
+	});
+}
+
+// submit one task and wait for it, so every sample includes waking a worker and the waiter.
+static void bench_latency(bench_context& ctx)
+{
+	measure(ctx, "latency", "run_async+get", ctx.count(10000), 1, [&]() {
+		run_async(ctx.sched, []() { return 1; }).get();
+	});
+
+	measure(ctx, "latency", "coroutine", ctx.count(10000), 1, [&]() {
+		auto co = [](scheduler& sched) -> task<int> {
+			int value = co_await run_async(sched, []() { return 1; });
+			co_return value + 1;
+		};
+		co(ctx.sched).get();
+	});
+}
+
+static void bench_then_chain(bench_context& ctx)
+{
+	const size_t stage_count = ctx.count(10000);
+	vector<double> samples;
+	size_t allocations = 0;
+	for (size_t r = 0; r < 10; ++r) {
+		size_t before = bench::allocation_count.load();
+		auto head = make_task(ctx.sched, []() { return 0; });
+		auto tail = head;
+		for (size_t i = 0; i < stage_count; ++i) {
+			tail = tail.then([](task<int>& t) { return t.get() + 1; });
+		}
+		allocations += bench::allocation_count.load() - before;
+
+		auto begin = bench::clock::now();
+		head.start();
+		tail.wait();
+		samples.push_back(bench::elapsed_ns(begin, bench::clock::now()) / static_cast<double>(stage_count));
+	}
+	ctx.out.add(bench::make_result("then_chain", "per_stage", ctx.threads, stage_count, samples, allocations));
+}
+
+// scatter width tasks and gather them with when_all.
+static void bench_fan_out(bench_context& ctx)
+{
+	for (size_t width : { 16, 256, 4096, 65536 }) {
+		if (width > ctx.count(65536)) {
+			break;
+		}
+
+		measure(ctx, "fan_out", "width=" + to_string(width), std::max<size_t>(8, 262144 / width / ctx.scale), width, [&]() {
+			vector<task<size_t>> tasks;
+			tasks.reserve(width);
+			for (size_t i = 0; i < width; ++i) {
+				tasks.push_back(run_async(ctx.sched, [i]() { return i; }));
+			}
+			when_all(std::move(tasks)).get();
+		});
+	}
+}
+
+// time from cancel() until a waiter sees the task canceled.
+static void bench_cancel(bench_context& ctx)
+{
+	const size_t iterations = ctx.count(2000);
+
+	vector<double> samples;
+	size_t allocations = bench::allocation_count.load();
+	for (size_t i = 0; i < iterations; ++i) {
+		cancellation_token_source source;
+		auto token = source.token();
+		std::atomic<bool> started{ false };
+		auto t = run_async(ctx.sched, [token, &started]() {
+			started.store(true, std::memory_order_release);
+			while (!token.is_cancellation_requested()) {
+				std::this_thread::yield();
+			}
+			token.throw_if_cancellation_requested();
+		});
+		while (!started.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+
+		auto begin = bench::clock::now();
+		source.cancel();
+		t.wait();
+		samples.push_back(bench::elapsed_ns(begin, bench::clock::now()));
+	}
+	allocations = bench::allocation_count.load() - allocations;
+	ctx.out.add(bench::make_result("cancel", "running", ctx.threads, 1, samples, allocations));
+
+	measure(ctx, "cancel", "queued", iterations, 1, [&]() {
+		cancellation_token_source source;
+		task<void> t(task_function<void>([]() {}), ctx.sched, source.token(), false);
+		source.cancel();
+		t.start();
+		t.wait();
+	});
+
+	// continuations waiting on an antecedent that never completes, all canceled by one token.
+	const size_t width = 1024;
+	measure(ctx, "cancel", "pending_bulk", ctx.count(200), width, [&]() {
+		cancellation_token_source source;
+		task_completion_source<void> gate(ctx.sched);
+		auto antecedent = gate.get_task();
+		vector<task<void>> pending;
+		pending.reserve(width);
+		for (size_t i = 0; i < width; ++i) {
+			pending.push_back(antecedent.then([](task<void>&) {}, source.token()));
+		}
+		source.cancel();
+		for (auto& t : pending) {
+			t.wait();
+		}
+		gate.set_result();
+	});
+
+	measure(ctx, "cancel", "register", ctx.count(200), width, [&]() {
+		cancellation_token_source source;
+		auto token = source.token();
+		for (size_t i = 0; i < width; ++i) {
+			auto registration = token.register_callback([]() {});
+		}
+	});
+
+	// how late a deadline token fires after its deadline.
+	vector<double> lateness;
+	allocations = bench::allocation_count.load();
+	for (size_t i = 0; i < ctx.count(200); ++i) {
+		std::atomic<bench::clock::rep> fired{ 0 };
+		auto deadline = bench::clock::now() + std::chrono::milliseconds(1);
+		cancellation_token_source source;
+		source.cancel_at(deadline);
+		auto registration = source.token().register_callback([&fired]() {
+			fired.store(bench::clock::now().time_since_epoch().count(), std::memory_order_release);
+			fired.notify_one();
+		});
+		fired.wait(0, std::memory_order_acquire);
+		lateness.push_back(bench::elapsed_ns(deadline, bench::clock::time_point(bench::clock::duration(fired.load()))));
+	}
+	allocations = bench::allocation_count.load() - allocations;
+	ctx.out.add(bench::make_result("cancel", "deadline_late", ctx.threads, 1, lateness, allocations));
+}
+
+// timer wheel insert/cancel with many timeouts pending, and how late timers fire.
+static void bench_timer(bench_context& ctx)
+{
+	if (!ctx.first_sweep) {
+		return;
+	}
+
+	auto& wheel = timer_wheel::instance();
+	const size_t pending = ctx.count(200000);
+	vector<timer_wheel::timer_id> background;
+	background.reserve(pending);
+	for (size_t i = 0; i < pending; ++i) {
+		background.push_back(wheel.add(std::chrono::seconds(60) + std::chrono::microseconds(i * 37), []() {}));
+	}
+
+	const size_t batch = 1024;
+	vector<timer_wheel::timer_id> ids(batch);
+	measure(ctx, "timer", "add_cancel", ctx.count(200), batch, [&]() {
+		for (size_t i = 0; i < batch; ++i) {
+			ids[i] = wheel.add(std::chrono::milliseconds(10 + i), []() {});
+		}
+		for (size_t i = 0; i < batch; ++i) {
+			wheel.cancel(ids[i]);
+		}
+	});
+
+	// lateness of timers spread over 100ms while the background timeouts stay pending.
+	const size_t fired = ctx.count(100000);
+	vector<double> lateness(fired);
+	std::atomic<size_t> remaining{ fired };
+	size_t allocations = bench::allocation_count.load();
+	// the first deadline leaves time to create all timers, so creating them doesn't compete with firing them.
+	const auto start = bench::clock::now() + std::chrono::milliseconds(5) + std::chrono::microseconds(fired * 2);
+	for (size_t i = 0; i < fired; ++i) {
+		const auto deadline = start + std::chrono::microseconds(i * 100000 / fired);
+		delay(deadline - bench::clock::now()).on_completed([&lateness, &remaining, deadline, i]() {
+			lateness[i] = bench::elapsed_ns(deadline, bench::clock::now());
+			if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				remaining.notify_one();
+			}
+		});
+	}
+	for (size_t left = remaining.load(); left != 0; left = remaining.load()) {
+		remaining.wait(left);
+	}
+	allocations = bench::allocation_count.load() - allocations;
+	ctx.out.add(bench::make_result("timer", "fire_late", 1, 1, lateness, allocations));
+
+	for (auto id : background) {
+		wheel.cancel(id);
+	}
+}
+
+// keeps a backlog of batch items on ex until stopped; each item occupies its worker for a while and posts itself again.
+// items block rather than spin, so latencies show queueing in the scheduler rather than the OS sharing cores.
+struct batch_load {
+	executor& exec;
+	std::atomic<bool> stopping{ false };
+	std::atomic<size_t> live{ 0 };
+
+	batch_load(executor& ex, size_t backlog) : exec(ex) {
+		for (size_t i = 0; i < backlog; ++i) {
+			post_item();
+		}
+	}
+
+	~batch_load() {
+		stopping.store(true);
+		for (size_t left = live.load(); left != 0; left = live.load()) {
+			live.wait(left);
+		}
+	}
+
+	void post_item() {
+		live.fetch_add(1);
+		exec.post([this]() {
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+			if (!stopping.load()) {
+				post_item();
+			}
+			if (live.fetch_sub(1) == 1) {
+				live.notify_all();
+			}
+		});
+	}
+};
+
+// latency of short interactive tasks while batch work saturates the workers: everything in one lane,
+// batch work in the background lane, and additionally one worker reserved for the interactive lane.
+static void bench_priority(bench_context& ctx)
+{
+	const size_t samples_count = ctx.count(2000);
+	struct variant {
+		const char* name;
+		size_t reserved;
+		task_priority batch;
+		task_priority urgent;
+	};
+	const variant variants[] = {
+		{ "fifo", 0, task_priority::normal, task_priority::normal },
+		{ "lanes", 0, task_priority::background, task_priority::interactive },
+		{ "lanes+reserved", 1, task_priority::background, task_priority::interactive },
+	};
+
+	for (const auto& v : variants) {
+		scheduler sched(ctx.threads + v.reserved, v.reserved);
+		batch_load load(sched.lane(v.batch), (ctx.threads + v.reserved) * 16);
+		executor& urgent = sched.lane(v.urgent);
+
+		vector<double> samples;
+		samples.reserve(samples_count);
+		size_t allocations = bench::allocation_count.load();
+		for (size_t i = 0; i < samples_count; ++i) {
+			auto begin = bench::clock::now();
+			run_async(urgent, []() { return 1; }).get();
+			samples.push_back(bench::elapsed_ns(begin, bench::clock::now()));
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		allocations = bench::allocation_count.load() - allocations;
+		ctx.out.add(bench::make_result("priority", v.name, ctx.threads, 1, samples, allocations));
+	}
+}
+
+// per task cost of submitting and completing batches of trivial tasks, one run_async at a time against one
+// run_async_batch, at growing batch sizes.
+static void bench_batch(bench_context& ctx)
+{
+	for (size_t full : { size_t(1000), size_t(10000), size_t(100000), size_t(1000000) }) {
+		const size_t task_count = ctx.count(full);
+		const size_t repetitions = full >= 1000000 ? 3 : 10;
+		const string size = std::to_string(task_count);
+
+		vector<task<size_t>> tasks;
+		tasks.reserve(task_count);
+		measure(ctx, "batch", "run_async/" + size, repetitions, task_count, [&]() {
+			for (size_t i = 0; i < task_count; ++i) {
+				tasks.push_back(run_async(ctx.sched, [i]() { return i; }));
+			}
+			for (auto& t : tasks) {
+				t.wait();
+			}
+			tasks.clear();
+		});
+		tasks.shrink_to_fit();
+
+		measure(ctx, "batch", "batch/" + size, repetitions, task_count, [&]() {
+			run_async_batch(ctx.sched, task_count, [](size_t i) { return i; }).wait();
+		});
+	}
+}
+
+// a burst of small tasks submitted faster than the workers run them, unbounded and through a bounded queue with
+// each overflow policy. a sample covers submitting the burst and waiting for every task of it.
+static void bench_backpressure(bench_context& ctx)
+{
+	const size_t task_count = ctx.count(20000);
+	const size_t capacity = 256;
+	auto work = []() {
+		size_t x = 0;
+		for (size_t i = 0; i < 200; ++i) {
+			x = x * 31 + i;
+		}
+		return x;
+	};
+
+	vector<task<size_t>> tasks;
+	tasks.reserve(task_count);
+	auto wait_all = [&]() {
+		for (auto& t : tasks) {
+			t.wait();
+		}
+		tasks.clear();
+	};
+
+	measure(ctx, "backpressure", "unbounded", 10, task_count, [&]() {
+		for (size_t i = 0; i < task_count; ++i) {
+			tasks.push_back(run_async(ctx.sched, work));
+		}
+		wait_all();
+	});
+
+	const pair<const char*, overflow_policy> policies[] = {
+		{ "block", overflow_policy::block },
+		{ "reject", overflow_policy::reject },
+		{ "drop_oldest", overflow_policy::drop_oldest },
+		{ "caller_runs", overflow_policy::caller_runs },
+	};
+	for (const auto& [name, policy] : policies) {
+		bounded_executor bounded(ctx.sched, capacity, policy);
+		measure(ctx, "backpressure", name, 10, task_count, [&]() {
+			for (size_t i = 0; i < task_count; ++i) {
+				tasks.push_back(run_async(bounded, work));
+			}
+			wait_all();
+		});
+	}
+}
+
+// items through three stages, the middle one doing the work : a then() chain per item against a pipeline with a
+// parallel middle stage and an in order last stage, at a few token counts.
+static void bench_pipeline(bench_context& ctx)
+{
+	const size_t item_count = ctx.count(20000);
+	auto work = [](size_t v) {
+		for (size_t i = 0; i < 200; ++i) {
+			v = v * 31 + i;
+		}
+		return v;
+	};
+
+	size_t sink = 0;
+	vector<task<size_t>> chains;
+	chains.reserve(item_count);
+	measure(ctx, "pipeline", "then_chain", 10, item_count, [&]() {
+		for (size_t i = 0; i < item_count; ++i) {
+			chains.push_back(run_async(ctx.sched, [i]() { return i; }).then([work](task<size_t>& t) { return work(t.get()); }));
+		}
+		for (auto& t : chains) {
+			sink += t.get();
+		}
+		chains.clear();
+	});
+
+	for (size_t tokens : { size_t(1), ctx.threads * 2, ctx.threads * 8 }) {
+		measure(ctx, "pipeline", "tokens/" + std::to_string(tokens), 10, item_count, [&]() {
+			size_t next = 0;
+			make_pipeline([&](flow_control& fc) {
+				if (next == item_count) {
+					fc.stop();
+				}
+				return next++;
+			})
+			.stage(stage_mode::parallel, work)
+			.stage(stage_mode::serial_in_order, [&](size_t v) { sink += v; })
+			.run(ctx.sched, tokens)
+			.get();
+		});
+	}
+	(void)sink;
+}
+
+// the usual hand rolled bounded queue the channel bench compares against, blocking its threads while it waits.
+template<typename T>
+class condvar_queue {
+private:
+	std::mutex mtx;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+
+public:
+	explicit condvar_queue(size_t capacityIn) : capacity(capacityIn) {}
+
+	void push(T value) {
+		std::unique_lock<std::mutex> lk(mtx);
+		not_full.wait(lk, [this]() { return items.size() < capacity; });
+		items.push_back(std::move(value));
+		lk.unlock();
+		not_empty.notify_one();
+	}
+
+	bool pop(T& out) {
+		std::unique_lock<std::mutex> lk(mtx);
+		not_empty.wait(lk, [this]() { return closed || !items.empty(); });
+		if (items.empty()) {
+			return false;
+		}
+		out = std::move(items.front());
+		items.pop_front();
+		lk.unlock();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			closed = true;
+		}
+		not_empty.notify_all();
+	}
+};
+
+static task<void> channel_producer(channel<size_t>& ch, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		co_await ch.send(i);
+	}
+}
+
+static task<size_t> channel_consumer(channel<size_t>& ch)
+{
+	size_t sum = 0;
+	for (;;) {
+		try {
+			sum += co_await ch.receive();
+		}
+		catch (const channel_closed&) {
+			co_return sum;
+		}
+	}
+}
+
+// values through a bounded queue between n producers and n consumers : a mutex + condition variable queue with
+// a thread per producer and consumer, against a channel with a coroutine per producer and consumer on the
+// scheduler. a sample covers sending every value and draining the queue.
+static void bench_channel(bench_context& ctx)
+{
+	const size_t capacity = 1024;
+	for (size_t n : { size_t(1), size_t(4), size_t(16), size_t(64) }) {
+		const size_t per_producer = std::max<size_t>(ctx.count(200000) / n, 1);
+		const size_t value_count = per_producer * n;
+		const string pairs = std::to_string(n) + "x" + std::to_string(n);
+		size_t sink = 0;
+
+		if (ctx.first_sweep) {
+			bench_context base = ctx.baseline();
+			measure(base, "channel", "condvar/" + pairs, 5, value_count, [&]() {
+				condvar_queue<size_t> queue(capacity);
+				vector<std::thread> threads;
+				std::atomic<size_t> sum{ 0 };
+				for (size_t c = 0; c < n; ++c) {
+					threads.emplace_back([&]() {
+						size_t value = 0, local = 0;
+						while (queue.pop(value)) {
+							local += value;
+						}
+						sum += local;
+					});
+				}
+				vector<std::thread> producers;
+				for (size_t p = 0; p < n; ++p) {
+					producers.emplace_back([&]() {
+						for (size_t i = 0; i < per_producer; ++i) {
+							queue.push(i);
+						}
+					});
+				}
+				for (auto& t : producers) {
+					t.join();
+				}
+				queue.close();
+				for (auto& t : threads) {
+					t.join();
+				}
+				sink += sum;
+			});
+		}
+
+		measure(ctx, "channel", "channel/" + pairs, 5, value_count, [&]() {
+			channel<size_t> ch(capacity);
+			// started from the workers so their awaits resume on the scheduler.
+			vector<task<task<size_t>>> consumers;
+			vector<task<task<void>>> producers;
+			for (size_t i = 0; i < n; ++i) {
+				consumers.push_back(run_async(ctx.sched, [&]() { return channel_consumer(ch); }));
+			}
+			for (size_t i = 0; i < n; ++i) {
+				producers.push_back(run_async(ctx.sched, [&]() { return channel_producer(ch, per_producer); }));
+			}
+			for (auto& t : producers) {
+				t.get().wait();
+			}
+			ch.close();
+			for (auto& t : consumers) {
+				sink += t.get().get();
+			}
+		});
+		(void)sink;
+	}
+}
+
+// 100k node DAGs : wide (a source, the nodes side by side, a sink), deep (one chain) and layered (100 nodes per layer,
+// each depending on two of the layer before). the graph is built once and run again for every sample; wide and deep
+// are also run as tasks, a when_all over run_async and a then() chain, built anew each sample as tasks can't rerun.
+static void bench_graph(bench_context& ctx)
+{
+	const size_t node_count = ctx.count(100000);
+	const size_t repetitions = 5;
+
+	{
+		task_graph g;
+		auto source = g.add([]() {});
+		auto sink = g.add([]() {});
+		for (size_t i = 0; i < node_count; ++i) {
+			auto n = g.add([]() {});
+			g.precede(source, n);
+			g.precede(n, sink);
+		}
+		measure(ctx, "graph", "graph/wide", repetitions, node_count, [&]() { g.run(ctx.sched).get(); });
+		measure(ctx, "graph", "tasks/wide", repetitions, node_count, [&]() {
+			vector<task<void>> tasks;
+			tasks.reserve(node_count);
+			for (size_t i = 0; i < node_count; ++i) {
+				tasks.push_back(run_async(ctx.sched, []() {}));
+			}
+			when_all(std::move(tasks)).get();
+		});
+	}
+
+	{
+		task_graph g;
+		auto previous = g.add([]() {});
+		for (size_t i = 1; i < node_count; ++i) {
+			auto n = g.add([]() {});
+			g.precede(previous, n);
+			previous = n;
+		}
+		measure(ctx, "graph", "graph/deep", repetitions, node_count, [&]() { g.run(ctx.sched).get(); });
+		measure(ctx, "graph", "tasks/deep", repetitions, node_count, [&]() {
+			auto head = make_task(ctx.sched, []() {});
+			auto tail = head;
+			for (size_t i = 1; i < node_count; ++i) {
+				tail = tail.then([](task<void>&) {});
+			}
+			head.start();
+			tail.wait();
+		});
+	}
+
+	{
+		const size_t width = std::min<size_t>(100, node_count);
+		task_graph g;
+		for (size_t i = 0; i < node_count; ++i) {
+			g.add([]() {});
+			if (i >= width) {
+				const size_t layer_start = i - i % width;
+				g.precede(i - width, i);
+				g.precede(layer_start - width + (i + 1) % width, i);
+			}
+		}
+		measure(ctx, "graph", "graph/layered", repetitions, node_count, [&]() { g.run(ctx.sched).get(); });
+	}
+}
+
+#if defined(__linux__)
+// reads a temp file in blocks, all blocks in flight at once : a blocking pread in a task per block, against io_uring
+// reads submitted as one batch, into plain and into registered buffers. the file is in the page cache, so this is
+// the cost of getting the I/O issued and completed rather than of the disk.
+static void bench_file_io(bench_context& ctx)
+{
+	const size_t file_size = std::max<size_t>(ctx.count(size_t(64) << 20), size_t(1) << 20);
+	char path[] = "/tmp/cpptask_bench_XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0) {
+		return;
+	}
+	unlink(path);
+
+	vector<char> buffer(file_size, 'x');
+	for (size_t offset = 0; offset < file_size;) {
+		const ssize_t written = pwrite(fd, buffer.data() + offset, file_size - offset, static_cast<off_t>(offset));
+		if (written <= 0) {
+			close(fd);
+			return;
+		}
+		offset += static_cast<size_t>(written);
+	}
+
+	for (size_t block : { size_t(4096), size_t(65536) }) {
+		const size_t block_count = file_size / block;
+		const string size = std::to_string(block / 1024) + "k";
+		vector<task<size_t>> reads;
+		reads.reserve(block_count);
+		auto wait_all = [&]() {
+			for (auto& r : reads) {
+				r.get();
+			}
+			reads.clear();
+		};
+
+		measure(ctx, "file_io", "pread_task/" + size, 5, block_count, [&]() {
+			for (size_t i = 0; i < block_count; ++i) {
+				reads.push_back(run_async(ctx.sched, [&, i]() { return static_cast<size_t>(pread(fd, buffer.data() + i * block, block, static_cast<off_t>(i * block))); }));
+			}
+			wait_all();
+		});
+
+		measure(ctx, "file_io", "uring/" + size, 5, block_count, [&]() {
+			{
+				io_batch batch;
+				for (size_t i = 0; i < block_count; ++i) {
+					reads.push_back(async_read(fd, buffer.data() + i * block, block, i * block));
+				}
+			}
+			wait_all();
+		});
+
+		io_ring::instance().register_buffers({ iovec{ buffer.data(), buffer.size() } });
+		measure(ctx, "file_io", "uring_fixed/" + size, 5, block_count, [&]() {
+			{
+				io_batch batch;
+				for (size_t i = 0; i < block_count; ++i) {
+					reads.push_back(async_read_fixed(fd, buffer.data() + i * block, block, i * block, 0));
+				}
+			}
+			wait_all();
+		});
+		io_ring::instance().unregister_buffers();
+	}
+	close(fd);
+}
+
+static task<void> echo_connection(async_socket socket)
+{
+	char buffer[256];
+	for (;;) {
+		const size_t n = co_await socket.receive(buffer, sizeof(buffer));
+		if (n == 0) {
+			co_return;
+		}
+		co_await socket.send(buffer, n);
+	}
+}
+
+// keeps the echo tasks to wait for them before the reactor goes.
+static task<void> echo_server(async_socket listener, vector<task<void>>& connections, cancellation_token token)
+{
+	for (;;) {
+		connections.push_back(echo_connection(co_await listener.accept(token)));
+	}
+}
+
+static task<void> echo_client(async_socket socket, size_t rounds)
+{
+	char message[64] = {};
+	char reply[sizeof(message)];
+	for (size_t r = 0; r < rounds; ++r) {
+		co_await socket.send(message, sizeof(message));
+		for (size_t received = 0; received < sizeof(reply);) {
+			const size_t n = co_await socket.receive(reply + received, sizeof(reply) - received);
+			if (n == 0) {
+				co_return;
+			}
+			received += n;
+		}
+	}
+}
+
+// an echo server over loopback with a coroutine per connection, and as many clients each doing 64 byte round trips,
+// all connections busy at once. connections are capped by the open file limit, two descriptors each.
+static void bench_echo(bench_context& ctx)
+{
+	rlimit limit;
+	size_t max_connections = 10000;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+		max_connections = std::min<size_t>(max_connections, (static_cast<size_t>(limit.rlim_cur) - 64) / 2);
+	}
+
+	reactor r(ctx.sched);
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	async_socket listener = async_socket::listen(reinterpret_cast<sockaddr*>(&address), sizeof(address), SOMAXCONN, r);
+	socklen_t length = sizeof(address);
+	getsockname(listener.native_handle(), reinterpret_cast<sockaddr*>(&address), &length);
+
+	vector<task<void>> connections;
+	cancellation_token_source stop;
+	auto server = echo_server(listener, connections, stop.token());
+
+	for (size_t n : { size_t(100), size_t(1000), size_t(10000) }) {
+		n = std::min(n, max_connections);
+		vector<async_socket> clients;
+		clients.reserve(n);
+		// connected a backlog's worth at a time.
+		while (clients.size() < n) {
+			vector<task<async_socket>> connecting;
+			for (size_t i = clients.size(); i < n && connecting.size() < 1000; ++i) {
+				connecting.push_back(async_socket::connect(reinterpret_cast<sockaddr*>(&address), sizeof(address), cancellation_token{}, r));
+			}
+			for (auto& c : connecting) {
+				clients.push_back(c.get());
+			}
+		}
+
+		const size_t rounds = std::max<size_t>(ctx.count(200000) / n, 1);
+		measure(ctx, "echo", "reactor/" + std::to_string(n), 5, n * rounds, [&]() {
+			// started from the workers so their awaits resume on the scheduler.
+			vector<task<task<void>>> running;
+			running.reserve(n);
+			for (auto& c : clients) {
+				running.push_back(run_async(ctx.sched, [&c, rounds]() { return echo_client(c, rounds); }));
+			}
+			for (auto& t : running) {
+				t.get().get();
+			}
+		});
+
+		for (auto& c : clients) {
+			c.close();
+		}
+	}
+
+	stop.cancel();
+	server.wait();
+	for (auto& c : connections) {
+		c.wait();
+	}
+	listener.close();
+}
+#endif
+
+// memory bound fan-out : each task fills a buffer of its own and a then() continuation sums it, so the data a
+// continuation reads was just written by its antecedent. unpinned workers against pinned ones on one and on two
+// emulated nodes, and on the detected topology with every cpu in the first sweep. on a two socket machine the
+// detected run is the one that keeps buffers and task state on the node that touches them.
+static void bench_numa(bench_context& ctx)
+{
+	const size_t buffer_size = size_t(256) << 10;
+	const size_t task_count = std::max<size_t>(ctx.count(512), 4);
+
+	struct variant {
+		string name;
+		cpu_topology topology;
+		bool pinned;
+	};
+	vector<variant> variants = {
+		{ "flat", cpu_topology::flat(ctx.threads), false },
+		{ "pinned/1node", cpu_topology::emulated(1, ctx.threads), true },
+	};
+	if (ctx.threads >= 2) {
+		variants.push_back({ "pinned/2nodes", cpu_topology::emulated(2, ctx.threads / 2), true });
+	}
+
+	block_pool::set_enabled(true);
+	auto run_variant = [&](bench_context& c, const string& name, const cpu_topology& topology, bool pinned) {
+		scheduler sched(topology, pinned);
+		size_t sink = 0;
+		measure(c, "numa", name, 5, task_count, [&]() {
+			vector<task<size_t>> tasks;
+			tasks.reserve(task_count);
+			for (size_t i = 0; i < task_count; ++i) {
+				tasks.push_back(run_async(sched, [buffer_size, i]() {
+					return std::make_shared<vector<size_t>>(buffer_size / sizeof(size_t), i);
+				}).then([](task<std::shared_ptr<vector<size_t>>>& produced) {
+					auto data = produced.get();
+					return std::accumulate(data->begin(), data->end(), size_t(0));
+				}));
+			}
+			for (auto& t : tasks) {
+				sink += t.get();
+			}
+		});
+		(void)sink;
+	};
+
+	for (const auto& v : variants) {
+		run_variant(ctx, v.name, v.topology, v.pinned);
+	}
+	if (ctx.first_sweep) {
+		const cpu_topology detected = cpu_topology::detect();
+		bench_context all{ ctx.sched, detected.cpu_count(), ctx.scale, ctx.first_sweep, ctx.out };
+		run_variant(all, "detected/" + std::to_string(detected.node_count()) + "nodes", detected, true);
+	}
+	block_pool::set_enabled(false);
+}
+
+// requests for an expensive computation from many callers at once, each computed again against memoized in an
+// async_cache : 16 hot keys every caller shares, and 1k and 64k uniform keys over a 4k entry cache. the variant
+// carries the hit rate of the measured repetitions.
+static void bench_cache(bench_context& ctx)
+{
+	const size_t request_count = ctx.count(20000);
+	const size_t caller_count = std::max<size_t>(ctx.threads, 1) * 4;
+	auto compute = [](uint64_t key) {
+		uint64_t h = key + 1;
+		for (int i = 0; i < 4096; ++i) {
+			h = h * 6364136223846793005ull + 1442695040888963407ull;
+		}
+		return h;
+	};
+
+	auto run_callers = [&](auto&& request) {
+		vector<task<uint64_t>> callers;
+		callers.reserve(caller_count);
+		for (size_t c = 0; c < caller_count; ++c) {
+			callers.push_back(run_async(ctx.sched, [&request, c, share = request_count / caller_count]() {
+				uint64_t seed = c * 0x9E3779B97F4A7C15ull + 1;
+				uint64_t sum = 0;
+				for (size_t i = 0; i < share; ++i) {
+					seed ^= seed << 13;
+					seed ^= seed >> 7;
+					seed ^= seed << 17;
+					sum += request(seed);
+				}
+				return sum;
+			}));
+		}
+		uint64_t sum = 0;
+		for (auto& c : callers) {
+			sum += c.get();
+		}
+		return sum;
+	};
+
+	uint64_t sink = 0;
+	measure(ctx, "cache", "uncached", 5, request_count, [&]() {
+		sink += run_callers([&](uint64_t seed) { return compute(seed % 16); });
+	});
+
+	for (size_t key_count : { size_t(16), size_t(1024), size_t(65536) }) {
+		async_cache<uint64_t, uint64_t> cache(4096, {}, 16, ctx.sched);
+		size_t hits = 0;
+		size_t misses = 0;
+		measure(ctx, "cache", "keys" + std::to_string(key_count), 5, request_count, [&]() {
+			const auto before = cache.stats();
+			sink += run_callers([&](uint64_t seed) { return cache.get_or_add(seed % key_count, compute).get(); });
+			const auto after = cache.stats();
+			hits += after.hits - before.hits;
+			misses += after.misses - before.misses;
+		});
+		// the warm up run counts too; it's one of six.
+		const double hit_rate = hits + misses != 0 ? 100.0 * static_cast<double>(hits) / static_cast<double>(hits + misses) : 0;
+		char label[32];
+		std::snprintf(label, sizeof(label), "/hit%.0f%%", hit_rate);
+		ctx.out.last().variant += label;
+	}
+	(void)sink;
+}
+
+// one task yielding a 1MB buffer read by 64 then() continuations : copying it out with get() in each, against
+// reading it in place with get_ref().
+static void bench_shared_result(bench_context& ctx)
+{
+	const size_t consumer_count = 64;
+	const size_t buffer_size = size_t(1) << 20;
+	for (bool by_ref : { false, true }) {
+		size_t sink = 0;
+		measure(ctx, "shared_result", by_ref ? "get_ref" : "get", std::max<size_t>(ctx.count(50), 3), consumer_count, [&]() {
+			auto produced = run_async(ctx.sched, [buffer_size]() { return vector<char>(buffer_size, 1); });
+			vector<task<size_t>> consumers;
+			consumers.reserve(consumer_count);
+			for (size_t i = 0; i < consumer_count; ++i) {
+				if (by_ref) {
+					consumers.push_back(produced.then([i](task<vector<char>>& t) { return static_cast<size_t>(t.get_ref()[i]); }));
+				}
+				else {
+					consumers.push_back(produced.then([i](task<vector<char>>& t) { return static_cast<size_t>(t.get()[i]); }));
+				}
+			}
+			for (auto& c : consumers) {
+				sink += c.get();
+			}
+		});
+		(void)sink;
+	}
+}
+
+// faulted tasks against the same tasks returning a value.
+static void bench_exception(bench_context& ctx)
+{
+	const size_t task_count = ctx.count(20000);
+
+	for (bool faulted : { false, true }) {
+		measure(ctx, "exception", faulted ? "throw" : "value", 10, task_count, [&]() {
+			vector<task<int>> tasks;
+			tasks.reserve(task_count);
+			for (size_t i = 0; i < task_count; ++i) {
+				tasks.push_back(run_async(ctx.sched, [faulted]() {
+					if (faulted) {
+						throw std::runtime_error("fault");
+					}
+					return 1;
+				}));
+			}
+
+			size_t caught = 0;
+			for (auto& t : tasks) {
+				try {
+					t.get();
+				}
+				catch (const std::exception&) {
+					++caught;
+				}
+			}
+			return caught;
+		});
+	}
+
+	// faults and cancellations that are only observed through the status, the path of timeouts and when_any losers.
+	const exception_ptr fault = make_exception_ptr(std::runtime_error("fault"));
+	measure(ctx, "exception", "set_exception", 10, task_count, [&]() {
+		size_t faulted = 0;
+		for (size_t i = 0; i < task_count; ++i) {
+			task_completion_source<int> source(ctx.sched);
+			source.set_exception(fault);
+			faulted += source.get_task().is_faulted();
+		}
+		return faulted;
+	});
+
+	measure(ctx, "exception", "set_canceled", 10, task_count, [&]() {
+		size_t canceled = 0;
+		for (size_t i = 0; i < task_count; ++i) {
+			task_completion_source<int> source(ctx.sched);
+			source.set_canceled();
+			canceled += source.get_task().is_canceled();
+		}
+		return canceled;
+	});
+
+	measure(ctx, "exception", "cancel_get", 10, task_count, [&]() {
+		size_t caught = 0;
+		for (size_t i = 0; i < task_count; ++i) {
+			task_completion_source<int> source(ctx.sched);
+			source.set_canceled();
+			try {
+				source.get_task().get();
+			}
+			catch (const task_cancelled&) {
+				++caught;
+			}
+		}
+		return caught;
+	});
+}
+
+static void bench_parallel(bench_context& ctx)
+{
+	const size_t count = ctx.count(1 << 22);
+	vector<double> input(count);
+	vector<double> output(count);
+	for (size_t i = 0; i < count; ++i) {
+		input[i] = static_cast<double>((i * 2654435761u) % 1000003);
+	}
+
+	auto add = [](double lhs, double rhs) { return lhs + rhs; };
+	auto transform_op = [](double x) { return x * 0.5 + 1.0; };
+	volatile double sink = 0;
+
+	auto base = ctx.baseline();
+	if (ctx.first_sweep) {
+		measure(base, "sum", "serial", 10, count, [&]() { sink = std::accumulate(input.begin(), input.end(), 0.0); });
+		measure(base, "transform", "serial", 10, count, [&]() { std::transform(input.begin(), input.end(), output.begin(), transform_op); });
+		measure(base, "sort", "serial", 3, count, [&]() {
+			output = input;
+			std::sort(output.begin(), output.end());
+		});
+	}
+
+	measure(ctx, "sum", "parallel_reduce", 10, count, [&]() {
+		sink = parallel_reduce(ctx.sched, input.begin(), input.end(), 0, 0.0,
+			[](auto first, auto last, double init) { return std::accumulate(first, last, init); }, add);
+	});
+
+	measure(ctx, "transform", "parallel_for", 10, count, [&]() {
+		parallel_for(ctx.sched, size_t(0), count, 0, [&](size_t first, size_t last) {
+			std::transform(input.begin() + first, input.begin() + last, output.begin() + first, transform_op);
+		});
+	});
+
+	auto parallel_sort = [&](vector<double>& values) {
+		const size_t chunk_count = ctx.sched.concurrency() * 4;
+		const size_t chunk = (values.size() + chunk_count - 1) / chunk_count;
+		auto bound = [&](size_t index) { return values.begin() + static_cast<ptrdiff_t>(std::min(index * chunk, values.size())); };
+
+		parallel_for(ctx.sched, size_t(0), chunk_count, 1, [&](size_t c) { std::sort(bound(c), bound(c + 1)); });
+		for (size_t width = 1; width < chunk_count; width *= 2) {
+			parallel_for(ctx.sched, size_t(0), (chunk_count + 2 * width - 1) / (2 * width), 1, [&](size_t pair) {
+				const size_t first = pair * 2 * width;
+				std::inplace_merge(bound(first), bound(first + width), bound(first + 2 * width));
+			});
+		}
+	};
+
+	measure(ctx, "sort", "parallel_for", 3, count, [&]() {
+		output = input;
+		parallel_sort(output);
+	});
+
+#if defined(CPPTASK_BENCH_STD_PAR)
+	if (ctx.first_sweep) {
+		measure(base, "sum", "std::par", 10, count, [&]() { sink = std::reduce(std::execution::par, input.begin(), input.end(), 0.0); });
+		measure(base, "transform", "std::par", 10, count, [&]() { std::transform(std::execution::par, input.begin(), input.end(), output.begin(), transform_op); });
+		measure(base, "sort", "std::par", 3, count, [&]() {
+			output = input;
+			std::sort(std::execution::par, output.begin(), output.end());
+		});
+	}
+#endif
+	(void)sink;
+}
+
+static const bench_case cases[] = {
+	{ "spawn", "spawn/complete throughput of run_async + get", &bench_spawn },
+	{ "latency", "end-to-end latency of a single task", &bench_latency },
+	{ "then_chain", "per stage cost of a then() chain", &bench_then_chain },
+	{ "shared_result", "a 1MB result read by 64 continuations, copied out with get() against read in place with get_ref()", &bench_shared_result },
+	{ "fan_out", "when_all fan-out/fan-in at growing widths", &bench_fan_out },
+	{ "cancel", "cancellation propagation latency", &bench_cancel },
+	{ "priority", "interactive latency under a saturating batch backlog", &bench_priority },
+	{ "timer", "timer wheel insert/cancel and firing accuracy under load", &bench_timer },
+	{ "exception", "cost of the faulted path", &bench_exception },
+	{ "batch", "per task cost of run_async_batch against one by one run_async, 1k to 1M tasks", &bench_batch },
+	{ "backpressure", "a submission burst unbounded and through a bounded queue per overflow policy", &bench_backpressure },
+	{ "pipeline", "items through a three stage pipeline against a then() chain per item", &bench_pipeline },
+	{ "channel", "a bounded channel against a mutex + condvar queue, 1 to 64 producers and consumers", &bench_channel },
+	{ "graph", "wide, deep and layered 100k node task graphs, rerun, against the same shapes built from tasks", &bench_graph },
+#if defined(__linux__)
+	{ "file_io", "block reads of a cached temp file, pread in a task against batched io_uring reads", &bench_file_io },
+	{ "echo", "64 byte round trips through a loopback echo server on the epoll reactor, 100 to 10k connections", &bench_echo },
+#endif
+	{ "numa", "memory bound fan-out with then() continuations, unpinned against pinned workers on emulated and detected nodes", &bench_numa },
+	{ "cache", "single flight memoization under key contention, hit rate in the variant, against computing every request", &bench_cache },
+	{ "parallel", "parallel_for / parallel_reduce over large vectors", &bench_parallel },
+};
+
+static vector<size_t> default_thread_counts()
+{
+	const size_t hardware = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	vector<size_t> counts;
+	for (size_t n = 1; n < hardware; n *= 2) {
+		counts.push_back(n);
+	}
+	counts.push_back(hardware);
+	return counts;
+}
+
+static vector<size_t> parse_thread_counts(const string& list)
+{
+	vector<size_t> counts;
+	stringstream ss(list);
+	string item;
+	while (getline(ss, item, ',')) {
+		if (size_t n = static_cast<size_t>(std::strtoul(item.c_str(), nullptr, 10))) {
+			counts.push_back(n);
+		}
+	}
+	return counts;
+}
+
+static void usage()
+{
+	cout << "usage : CppTaskBench [--threads 1,2,4] [--filter name[,name]] [--format text|json|csv] [--output file] [--quick] [--list]";
+#if defined(CPPTASK_TRACE)
+	cout << " [--trace file]";
+#endif
+	cout << endl;
+}
+
+#if defined(CPPTASK_TRACE)
+// per worker counters of a sweep, to tell idle workers and steal heavy ones apart.
+static void print_metrics(const scheduler& sched, size_t threads)
+{
+	auto m = sched.metrics();
+	cerr << "workers on " << threads << " threads :" << endl;
+	for (size_t i = 0; i < m.workers.size(); ++i) {
+		const auto& w = m.workers[i];
+		cerr << "  " << i << (w.reserved ? " (reserved)" : "") << " node " << w.node << " executed " << w.executed << " stolen " << w.stolen
+			<< " idle " << w.idle_ns / 1000000 << "ms queued " << w.queue_depth << endl;
+	}
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	vector<size_t> thread_counts = default_thread_counts();
+	vector<string> filters;
+	string format = "text";
+	string output;
+	string trace_output;
+	size_t scale = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		auto value = [&]() -> string {
+			if (i + 1 >= argc) {
+				usage();
+				std::exit(1);
+			}
+			return argv[++i];
+		};
+
+		if (arg == "--threads") {
+			thread_counts = parse_thread_counts(value());
+		}
+		else if (arg == "--filter") {
+			stringstream ss(value());
+			string name;
+			while (getline(ss, name, ',')) {
+				filters.push_back(name);
+			}
+		}
+		else if (arg == "--format") {
+			format = value();
+		}
+		else if (arg == "--output") {
+			output = value();
+		}
+#if defined(CPPTASK_TRACE)
+		else if (arg == "--trace") {
+			trace_output = value();
+		}
+#endif
+		else if (arg == "--quick") {
+			scale = 16;
+		}
+		else if (arg == "--list") {
+			for (const auto& c : cases) {
+				cout << c.name << " : " << c.description << endl;
+			}
+			return 0;
+		}
+		else {
+			usage();
+			return arg == "--help" ? 0 : 1;
+		}
+	}
+
+	if (format != "text" && format != "json" && format != "csv") {
+		usage();
+		return 1;
+	}
+
+	bench::reporter out;
+	for (size_t threads : thread_counts) {
+		scheduler sched(threads);
+		bench_context ctx{ sched, threads, scale, threads == thread_counts.front(), out };
+		for (const auto& c : cases) {
+			if (!filters.empty() && std::find(filters.begin(), filters.end(), c.name) == filters.end()) {
+				continue;
+			}
+			cerr << "running " << c.name << " on " << threads << " threads" << endl;
+			c.run(ctx);
+		}
+#if defined(CPPTASK_TRACE)
+		print_metrics(sched, threads);
+#endif
+	}
+
+#if defined(CPPTASK_TRACE)
+	// the rings keep the latest events of each thread, so a trace covers the tail of the run.
+	if (!trace_output.empty()) {
+		ofstream trace_file(trace_output);
+		if (!trace_file) {
+			cerr << "can't open " << trace_output << endl;
+			return 1;
+		}
+		tracer::instance().write_chrome_trace(trace_file);
+	}
+#endif
+
+	ofstream file;
+	if (!output.empty()) {
+		file.open(output);
+		if (!file) {
+			cerr << "can't open " << output << endl;
+			return 1;
+		}
+	}
+	ostream& os = output.empty() ? cout : file;
+
+	if (format == "json") {
+		out.write_json(os, std::thread::hardware_concurrency());
+	}
+	else if (format == "csv") {
+		out.write_csv(os);
+	}
+	else {
+		out.write_text(os);
+	}
+	return 0;
+}
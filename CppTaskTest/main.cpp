@@ -0,0 +1,602 @@
+#include "task.h"
+#include "timer.h"
+#include "delay.h"
+#include "channel.h"
+#include "graph.h"
+#include "cache.h"
+#include "reactor.h"
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <optional>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace cpptask;
+
+// regression checks for bugs that the examples and the bench don't catch.
+// each case runs in its own ctest test, so a hang shows up as that test timing out.
+
+static void check(bool condition, const string& what)
+{
+	if (!condition) {
+		throw std::runtime_error(what);
+	}
+}
+
+// one worker busy with items that keep posting themselves to its deque must still run a task posted from outside.
+static void scheduler_self_posting_backlog()
+{
+	struct repost : work_item {
+		scheduler* sched;
+		std::atomic<bool>* stop;
+
+		repost(scheduler* schedIn, std::atomic<bool>* stopIn) : sched(schedIn), stop(stopIn) {}
+
+		void execute() override {
+			if (stop->load(std::memory_order_acquire)) {
+				delete this;
+				return;
+			}
+			sched->post(this);
+		}
+	};
+
+	std::atomic<bool> stop{ false };
+	scheduler sched(1);
+	for (int i = 0; i < 16; ++i) {
+		sched.post(new repost(&sched, &stop));
+	}
+	const int value = run_async(sched, []() { return 42; }).get();
+	stop.store(true, std::memory_order_release);
+	check(value == 42, "task posted from outside returned the wrong value");
+
+	// the same once the backlog was already running when the task is posted.
+	stop.store(false, std::memory_order_release);
+	for (int i = 0; i < 16; ++i) {
+		sched.post(new repost(&sched, &stop));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	check(run_async(sched, []() { return 7; }).get() == 7, "task posted to a running backlog returned the wrong value");
+	stop.store(true, std::memory_order_release);
+}
+
+// waits up to limit for count to reach expected.
+static bool wait_for(const std::atomic<int>& count, int expected, std::chrono::milliseconds limit)
+{
+	const auto deadline = std::chrono::steady_clock::now() + limit;
+	while (count.load(std::memory_order_acquire) < expected) {
+		if (std::chrono::steady_clock::now() >= deadline) {
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+// a level 1 wrap of the wheel is 256 * 256 ticks of 100us, about 6.55s. a timer due a whole wrap of its level
+// ahead lands in the level's current slot, and timers added after the timer thread idled that long are placed
+// from where the thread stopped.
+static void timer_wheel_level_wrap()
+{
+	using namespace std::chrono;
+	const auto wrap = duration_cast<steady_clock::duration>(timer_wheel::tick * 256 * 256);
+	auto& wheel = timer_wheel::instance();
+	std::atomic<int> fired{ 0 };
+	std::atomic<int64_t> wrap_late_us{ -1 };
+
+	// from inside a callback, right after the thread advanced, due just under a wrap later.
+	const auto start = steady_clock::now();
+	wheel.add(milliseconds(5), [&]() {
+		const auto due = steady_clock::now() + wrap - microseconds(3600);
+		wheel.add(due, [&, due]() {
+			wrap_late_us.store(duration_cast<microseconds>(steady_clock::now() - due).count(), std::memory_order_relaxed);
+			fired.fetch_add(1, std::memory_order_release);
+		});
+		fired.fetch_add(1, std::memory_order_release);
+	});
+
+	// after the thread idled a little longer than a wrap.
+	std::this_thread::sleep_until(start + wrap + microseconds(2400));
+	check(fired.load() >= 1, "5ms timer didn't fire");
+	const auto added = steady_clock::now();
+	std::atomic<int64_t> short_late_us{ -1 };
+	wheel.add(milliseconds(1), [&]() {
+		short_late_us.store(duration_cast<microseconds>(steady_clock::now() - added).count(), std::memory_order_relaxed);
+		fired.fetch_add(1, std::memory_order_release);
+	});
+	check(wait_for(fired, 3, milliseconds(1000)), "timers due after an idle wrap didn't fire");
+	check(short_late_us.load() < 100000, "1ms timer added after an idle wrap fired " + std::to_string(short_late_us.load()) + "us late");
+	check(wrap_late_us.load() < 100000, "timer due a wrap ahead fired " + std::to_string(wrap_late_us.load()) + "us late");
+	check(wheel.pending() == 0, "timers left pending");
+}
+
+// delays, scheduled tasks, deadline tokens and periodic schedules set due a wrap ahead, and set after the timer
+// thread idled for a wrap.
+static void delay_after_idle_wrap()
+{
+	using namespace std::chrono;
+	const auto wrap = duration_cast<steady_clock::duration>(timer_wheel::tick * 256 * 256);
+	std::atomic<int> done{ 0 };
+	auto counter = [&done]() { return [&done]() { done.fetch_add(1, std::memory_order_release); }; };
+
+	std::optional<task<void>> wrap_delay;
+	std::optional<task<int>> wrap_scheduled;
+	std::optional<cancellation_token_source> wrap_deadline;
+	std::optional<cancellation_registration> wrap_registration;
+	const auto start = steady_clock::now();
+	delay(milliseconds(5)).on_completed([&]() {
+		const auto wrap_due = steady_clock::now() + wrap - microseconds(3600);
+		wrap_delay = delay(wrap_due - steady_clock::now());
+		wrap_delay->on_completed(counter());
+		wrap_scheduled = schedule_at(wrap_due, []() { return 1; });
+		wrap_scheduled->on_completed(counter());
+		wrap_deadline.emplace();
+		wrap_deadline->cancel_at(wrap_due);
+		wrap_registration = wrap_deadline->token().register_callback(counter());
+		done.fetch_add(1, std::memory_order_release);
+	});
+
+	std::this_thread::sleep_until(start + wrap + microseconds(2400));
+	check(done.load() >= 1, "5ms delay didn't complete");
+
+	delay(milliseconds(1)).on_completed(counter());
+	schedule_after(milliseconds(1), []() { return 2; }).on_completed(counter());
+	cancellation_token_source deadline(milliseconds(1));
+	auto registration = deadline.token().register_callback(counter());
+	std::atomic<int> runs{ 0 };
+	cancellation_token_source stop;
+	auto periodic = schedule_every(milliseconds(1), [&]() {
+		if (runs.fetch_add(1) + 1 == 3) {
+			stop.cancel();
+		}
+	}, stop.token());
+	periodic.on_completed(counter());
+
+	check(wait_for(done, 8, milliseconds(1000)), "timers due after an idle wrap didn't complete, " + std::to_string(done.load()) + " of 8 did");
+	check(wrap_scheduled->get() == 1, "task scheduled a wrap ahead returned the wrong value");
+	check(wrap_deadline->is_cancellation_requested(), "deadline a wrap ahead didn't cancel");
+	check(deadline.is_cancellation_requested(), "deadline set after an idle wrap didn't cancel");
+	check(runs.load() == 3, "periodic schedule ran " + std::to_string(runs.load()) + " times");
+}
+
+// a continuation of a delay runs on a scheduler worker, so a slow one doesn't hold up the timer thread.
+static void delay_continuation_on_worker()
+{
+	using namespace std::chrono;
+	auto on_worker = delay(milliseconds(1)).then([](task<void>&) {
+		return scheduler::default_instance().is_worker_thread();
+	});
+	check(on_worker.get(), "delay continuation didn't run on a scheduler worker");
+
+	auto slow = delay(milliseconds(1)).then([](task<void>&) { std::this_thread::sleep_for(milliseconds(500)); });
+	std::this_thread::sleep_for(milliseconds(20));
+	const auto start = steady_clock::now();
+	delay(milliseconds(1)).wait();
+	const auto waited = steady_clock::now() - start;
+	slow.wait();
+	check(waited < milliseconds(200), "1ms delay took " + std::to_string(duration_cast<milliseconds>(waited).count()) + "ms behind a slow continuation");
+
+	cancellation_token_source source;
+	auto canceled = delay(seconds(60), source.token());
+	source.cancel();
+	canceled.wait();
+	check(canceled.is_canceled(), "canceled delay didn't complete as canceled");
+}
+
+// a task that is expected to fault with E.
+template<typename E, typename T>
+static bool faults_with(const task<T>& t)
+{
+	try {
+		t.get();
+	}
+	catch (const E&) {
+		return true;
+	}
+	catch (...) {
+	}
+	return false;
+}
+
+// a closed channel refuses sends but still hands out what was sent before, then faults receives.
+static void channel_close_drains_then_throws()
+{
+	channel<int> ch(4);
+	ch.send(1).wait();
+	ch.send(2).wait();
+	channel<int> empty;
+	auto waiting = empty.receive();
+	ch.close();
+	empty.close();
+
+	check(ch.is_closed(), "channel doesn't report closed");
+	check(!ch.try_send(3), "closed channel took a try_send");
+	check(faults_with<channel_closed>(ch.send(3)), "send to a closed channel didn't fault with channel_closed");
+	check(ch.receive().get() == 1 && ch.receive().get() == 2, "closed channel didn't drain in order");
+	check(faults_with<channel_closed>(ch.receive()), "receive from a drained closed channel didn't fault with channel_closed");
+	check(faults_with<channel_closed>(waiting), "receive waiting when the channel closed didn't fault with channel_closed");
+}
+
+// a receive canceled while it waits completes as canceled and doesn't take the next value.
+static void channel_receive_canceled()
+{
+	channel<int> ch;
+	cancellation_token_source source;
+	auto waiting = ch.receive(source.token());
+	check(!waiting.is_completed(), "receive on an empty channel completed");
+	source.cancel();
+	waiting.wait();
+	check(waiting.is_canceled(), "canceled receive didn't complete as canceled");
+
+	ch.send(5).wait();
+	check(ch.receive().get() == 5, "value sent after a canceled receive was lost");
+
+	cancellation_token_source already;
+	already.cancel();
+	auto late = ch.receive(already.token());
+	late.wait();
+	check(late.is_canceled(), "receive with a canceled token on an empty channel didn't complete as canceled");
+}
+
+// a send to a full bounded channel completes once a receive made room; one canceled meanwhile drops its value.
+static void channel_bounded_send_waits_for_room()
+{
+	using namespace std::chrono;
+	channel<int> ch(2);
+	check(ch.send(1).is_completed() && ch.send(2).is_completed(), "sends within capacity didn't complete right away");
+	auto third = ch.send(3);
+	cancellation_token_source source;
+	auto dropped = ch.send(4, source.token());
+	std::this_thread::sleep_for(milliseconds(20));
+	check(!third.is_completed() && !dropped.is_completed(), "send to a full channel completed");
+	check(!ch.try_send(5), "full bounded channel took a try_send");
+
+	source.cancel();
+	dropped.wait();
+	check(dropped.is_canceled(), "canceled send didn't complete as canceled");
+	check(ch.receive().get() == 1, "first receive got the wrong value");
+	third.wait();
+	check(third.is_completed_sucessfully(), "waiting send didn't complete once there was room");
+	check(ch.receive().get() == 2 && ch.receive().get() == 3, "values came out of order");
+	int left = 0;
+	check(!ch.try_receive(left), "value of a canceled send was received");
+}
+
+// a node that faults skips what depends on it, and so does a token canceled while the graph runs.
+static void task_graph_failure_and_cancel_skip_dependents()
+{
+	std::atomic<int> ran{ 0 };
+	task_graph failing;
+	auto a = failing.add([&]() { ran.fetch_add(1); });
+	auto b = failing.add([]() { throw std::runtime_error("node b"); });
+	auto c = failing.add([&]() { ran.fetch_add(100); });
+	auto d = failing.add([&]() { ran.fetch_add(1); });
+	auto e = failing.add([&]() { ran.fetch_add(100); });
+	failing.precede(a, { b, d });
+	failing.precede(b, c);
+	failing.precede(c, e);
+	failing.precede(d, e);
+
+	auto failed = failing.run();
+	failed.wait();
+	check(failed.is_faulted(), "graph with a throwing node didn't fault");
+	check(faults_with<aggregate_exception>(failed), "faulted graph didn't throw an aggregate_exception");
+	check(ran.load() == 2, "nodes after a faulted one ran");
+	check(failing.status(a) == completed && failing.status(d) == completed, "independent nodes didn't complete");
+	check(failing.status(b) == faulted, "throwing node isn't faulted");
+	check(failing.status(c) == canceled && failing.status(e) == canceled, "dependents of a faulted node weren't skipped");
+
+	std::atomic<bool> release{ false };
+	std::atomic<bool> started{ false };
+	ran.store(0);
+	task_graph gated;
+	auto first = gated.add([&]() {
+		started.store(true);
+		while (!release.load()) {
+			std::this_thread::yield();
+		}
+	});
+	auto second = gated.add([&]() { ran.fetch_add(1); });
+	gated.precede(first, second);
+
+	cancellation_token_source source;
+	auto stopped = gated.run(source.token());
+	while (!started.load()) {
+		std::this_thread::yield();
+	}
+	source.cancel();
+	release.store(true);
+	stopped.wait();
+	check(stopped.is_canceled(), "graph canceled while running didn't complete as canceled");
+	check(gated.status(first) == completed, "running node didn't complete");
+	check(gated.status(second) == canceled && ran.load() == 0, "node after a cancel ran");
+
+	cancellation_token_source already;
+	already.cancel();
+	auto never = gated.run(already.token());
+	never.wait();
+	check(never.is_canceled() && gated.status(first) == canceled, "graph run with a canceled token ran its nodes");
+}
+
+// a graph runs again from scratch, also after a faulted run and after nodes were added.
+static void task_graph_reuse_across_runs()
+{
+	std::atomic<int> a_runs{ 0 }, b_runs{ 0 }, c_runs{ 0 }, d_runs{ 0 };
+	std::atomic<bool> fail{ false };
+	std::atomic<bool> out_of_order{ false };
+	task_graph graph;
+	auto a = graph.add([&]() { a_runs.fetch_add(1); });
+	auto b = graph.add([&]() {
+		if (fail.load()) {
+			throw std::runtime_error("node b");
+		}
+		b_runs.fetch_add(1);
+	});
+	auto c = graph.add([&]() { c_runs.fetch_add(1); });
+	auto d = graph.add([&]() {
+		if (b_runs.load() != a_runs.load() || c_runs.load() != a_runs.load()) {
+			out_of_order.store(true);
+		}
+		d_runs.fetch_add(1);
+	});
+	graph.precede(a, { b, c });
+	graph.precede(b, d);
+	graph.precede(c, d);
+
+	for (int i = 0; i < 3; ++i) {
+		graph.run().get();
+	}
+	check(a_runs.load() == 3 && b_runs.load() == 3 && c_runs.load() == 3 && d_runs.load() == 3, "nodes didn't run once per run");
+	check(!out_of_order.load(), "a node ran before its predecessors");
+
+	fail.store(true);
+	auto failed = graph.run();
+	failed.wait();
+	check(failed.is_faulted() && graph.status(d) == canceled, "faulted run didn't skip the join");
+	fail.store(false);
+	d_runs.store(0);
+	graph.run().get();
+	check(d_runs.load() == 1 && graph.status(d) == completed, "run after a faulted one didn't complete");
+
+	std::atomic<int> e_runs{ 0 };
+	auto e = graph.add([&]() { e_runs.fetch_add(1); });
+	graph.precede(d, e);
+	graph.run().get();
+	check(e_runs.load() == 1 && graph.status(e) == completed, "node added between runs didn't run");
+	check(graph.rank(a) == 4, "rank of the first node isn't the length of the longest path");
+}
+
+// callers racing on a missing key share the task of the one factory call.
+static void cache_get_or_add_single_flight()
+{
+	using namespace std::chrono;
+	async_cache<int, int> cache;
+	std::atomic<int> calls{ 0 };
+	std::atomic<int> arrived{ 0 };
+	std::atomic<int> sum{ 0 };
+	std::vector<std::thread> callers;
+	for (int i = 0; i < 8; ++i) {
+		callers.emplace_back([&]() {
+			arrived.fetch_add(1);
+			while (arrived.load() < 8) {
+				std::this_thread::yield();
+			}
+			auto value = cache.get_or_add(1, [&](const int& key) {
+				calls.fetch_add(1);
+				std::this_thread::sleep_for(milliseconds(50));
+				return key * 10;
+			});
+			sum.fetch_add(value.get());
+		});
+	}
+	for (auto& caller : callers) {
+		caller.join();
+	}
+	check(calls.load() == 1, "factory ran " + std::to_string(calls.load()) + " times for one key");
+	check(sum.load() == 80, "callers didn't all get the factory's value");
+	const auto stats = cache.stats();
+	check(stats.misses == 1 && stats.hits == 7, "expected 1 miss and 7 hits, got " + std::to_string(stats.misses) + " and " + std::to_string(stats.hits));
+}
+
+// a faulted entry isn't handed to the next caller, which runs the factory again.
+static void cache_faulted_entry_retried()
+{
+	async_cache<int, int> cache;
+	std::atomic<int> calls{ 0 };
+	auto factory = [&](const int& key) -> int {
+		if (calls.fetch_add(1) == 0) {
+			throw std::runtime_error("first call");
+		}
+		return key + 1;
+	};
+	auto first = cache.get_or_add(1, factory);
+	first.wait();
+	check(first.is_faulted(), "throwing factory didn't fault the task");
+	check(cache.get_or_add(1, factory).get() == 2, "retry after a fault returned the wrong value");
+	check(calls.load() == 2, "faulted entry wasn't retried");
+	check(cache.get_or_add(1, factory).get() == 2 && calls.load() == 2, "value after the retry wasn't cached");
+	check(cache.stats().failures == 1, "faulted entry wasn't counted as a failure");
+}
+
+// erasing a key whose factory still runs cancels the factory's token and drops the entry.
+static void cache_erase_cancels_factory()
+{
+	using namespace std::chrono;
+	async_cache<int, int> cache;
+	std::atomic<bool> started{ false };
+	std::atomic<bool> saw_cancel{ false };
+	auto running = cache.get_or_add(1, [&](const int&, cancellation_token token) {
+		started.store(true);
+		const auto limit = steady_clock::now() + seconds(5);
+		while (!token.is_cancellation_requested() && steady_clock::now() < limit) {
+			std::this_thread::sleep_for(milliseconds(1));
+		}
+		saw_cancel.store(token.is_cancellation_requested());
+		return 0;
+	});
+	while (!started.load()) {
+		std::this_thread::yield();
+	}
+	check(cache.erase(1), "erase didn't find the running entry");
+	running.wait();
+	check(saw_cancel.load(), "erase didn't cancel the factory's token");
+	check(!cache.try_get(1).has_value() && cache.size() == 0, "erased entry is still cached");
+	check(cache.get_or_add(1, [](const int& key, cancellation_token) { return key + 41; }).get() == 42, "entry added after erase returned the wrong value");
+	check(!cache.erase(2), "erase of a missing key reported success");
+}
+
+#if defined(__linux__)
+static std::pair<async_socket, async_socket> socket_pair()
+{
+	int fds[2];
+	check(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0, "socketpair failed");
+	return { async_socket(fds[0]), async_socket(fds[1]) };
+}
+
+// bytes sent come out at the other end, and the operations on one side run in the order they started.
+static void socket_round_trip_in_order()
+{
+	auto [a, b] = socket_pair();
+	char in[16] = {};
+	auto waiting = b.receive(in, sizeof(in));
+	check(!waiting.is_completed(), "receive on an empty socket completed");
+	const string hello = "hello";
+	check(a.send(hello.data(), hello.size()).get() == hello.size(), "send didn't send everything");
+	check(waiting.get() == hello.size() && string(in, hello.size()) == hello, "receive didn't get what was sent");
+
+	char first = 0, second = 0, third = 0;
+	auto r1 = b.receive(&first, 1);
+	auto r2 = b.receive(&second, 1);
+	auto r3 = b.receive(&third, 1);
+	a.send("xyz", 3).get();
+	check(r1.get() == 1 && r2.get() == 1 && r3.get() == 1, "queued receives didn't each get a byte");
+	check(first == 'x' && second == 'y' && third == 'z', "queued receives didn't take the stream in order");
+
+	// each larger than the socket buffer, so all but the first start while another waits for room.
+	const size_t chunk = size_t(1) << 20;
+	std::vector<std::vector<char>> chunks;
+	std::vector<task<size_t>> sends;
+	for (int i = 0; i < 4; ++i) {
+		chunks.emplace_back(chunk, static_cast<char>('a' + i));
+		sends.push_back(a.send(chunks.back().data(), chunk));
+	}
+	std::vector<char> received;
+	received.reserve(chunks.size() * chunk);
+	std::vector<char> buffer(64 * 1024);
+	while (received.size() < chunks.size() * chunk) {
+		const size_t n = b.receive(buffer.data(), buffer.size()).get();
+		check(n != 0, "peer shut down before everything arrived");
+		received.insert(received.end(), buffer.begin(), buffer.begin() + n);
+	}
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		check(sends[i].get() == chunk, "send didn't send everything");
+		const auto begin = received.begin() + i * chunk;
+		check(std::all_of(begin, begin + chunk, [&](char c) { return c == chunks[i][0]; }), "concurrent sends interleaved their bytes");
+	}
+}
+
+// a receive completes with 0 once the peer shut down its side.
+static void socket_receive_zero_on_shutdown()
+{
+	auto [a, b] = socket_pair();
+	char buffer[8];
+	auto waiting = b.receive(buffer, sizeof(buffer));
+	check(::shutdown(a.native_handle(), SHUT_WR) == 0, "shutdown failed");
+	check(waiting.get() == 0, "waiting receive didn't complete with 0 on shutdown");
+	check(b.receive(buffer, sizeof(buffer)).get() == 0, "receive after shutdown didn't complete with 0");
+}
+
+// a receive canceled while it waits completes as canceled, and the one queued behind it gets the data.
+static void socket_receive_canceled()
+{
+	auto [a, b] = socket_pair();
+	char dropped[8] = {};
+	char kept[8] = {};
+	cancellation_token_source source;
+	auto waiting = b.receive(dropped, sizeof(dropped), source.token());
+	auto behind = b.receive(kept, sizeof(kept));
+	source.cancel();
+	waiting.wait();
+	check(waiting.is_canceled(), "canceled receive didn't complete as canceled");
+	a.send("k", 1).get();
+	check(behind.get() == 1 && kept[0] == 'k', "receive behind a canceled one didn't get the data");
+	check(dropped[0] == 0, "canceled receive wrote its buffer");
+}
+
+// closing a socket cancels its waiting operations, and the ones started after.
+static void socket_close_cancels_waiting()
+{
+	auto [a, b] = socket_pair();
+	char buffer[8];
+	std::vector<char> big(8 << 20);
+	auto receiving = a.receive(buffer, sizeof(buffer));
+	auto sending = a.send(big.data(), big.size());
+	auto behind = a.send(big.data(), 1);
+	check(!receiving.is_completed() && !sending.is_completed() && !behind.is_completed(), "operations on a full socket completed");
+	a.close();
+	for (auto* waiting : { &receiving, &sending, &behind }) {
+		waiting->wait();
+		check(waiting->is_canceled(), "waiting operation wasn't canceled by close");
+	}
+	check(!a.is_open() && a.native_handle() == -1, "closed socket still reports open");
+	auto late = a.receive(buffer, sizeof(buffer));
+	late.wait();
+	check(late.is_canceled(), "receive on a closed socket wasn't canceled");
+}
+#endif
+
+struct test_case {
+	const char* name;
+	void(*run)();
+};
+
+static const test_case cases[] = {
+	{ "scheduler_self_posting_backlog", &scheduler_self_posting_backlog },
+	{ "timer_wheel_level_wrap", &timer_wheel_level_wrap },
+	{ "delay_after_idle_wrap", &delay_after_idle_wrap },
+	{ "delay_continuation_on_worker", &delay_continuation_on_worker },
+	{ "channel_close_drains_then_throws", &channel_close_drains_then_throws },
+	{ "channel_receive_canceled", &channel_receive_canceled },
+	{ "channel_bounded_send_waits_for_room", &channel_bounded_send_waits_for_room },
+	{ "task_graph_failure_and_cancel_skip_dependents", &task_graph_failure_and_cancel_skip_dependents },
+	{ "task_graph_reuse_across_runs", &task_graph_reuse_across_runs },
+	{ "cache_get_or_add_single_flight", &cache_get_or_add_single_flight },
+	{ "cache_faulted_entry_retried", &cache_faulted_entry_retried },
+	{ "cache_erase_cancels_factory", &cache_erase_cancels_factory },
+#if defined(__linux__)
+	{ "socket_round_trip_in_order", &socket_round_trip_in_order },
+	{ "socket_receive_zero_on_shutdown", &socket_receive_zero_on_shutdown },
+	{ "socket_receive_canceled", &socket_receive_canceled },
+	{ "socket_close_cancels_waiting", &socket_close_cancels_waiting },
+#endif
+};
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && string(argv[1]) == "--list") {
+		for (const auto& c : cases) {
+			cout << c.name << endl;
+		}
+		return 0;
+	}
+
+	int failed = 0;
+	for (const auto& c : cases) {
+		if (argc > 1 && std::find(argv + 1, argv + argc, string(c.name)) == argv + argc) {
+			continue;
+		}
+		try {
+			c.run();
+			cout << "passed " << c.name << endl;
+		}
+		catch (const std::exception& e) {
+			cout << "FAILED " << c.name << " : " << e.what() << endl;
+			++failed;
+		}
+	}
+	return failed == 0 ? 0 : 1;
+}